@@ -0,0 +1,63 @@
+#ifndef BENCH_UTIL_H_
+#define BENCH_UTIL_H_
+
+#include <sys/types.h>
+#include <sys/resource.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Helpers shared by the benchmarks: timing, sorting and descriptor limits. */
+
+static inline uint64_t
+bench_util_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec);
+}
+
+/* xorshift64* */
+static inline uint64_t
+bench_util_random(uint64_t *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return (*state * UINT64_C(0x2545f4914f6cdd1d));
+}
+
+/* qsort(3) comparison for uint64_t. */
+static inline int
+bench_util_compare_u64(void const *a, void const *b)
+{
+	uint64_t x = *(uint64_t const *)a;
+	uint64_t y = *(uint64_t const *)b;
+
+	return ((x > y) - (x < y));
+}
+
+/*
+ * Makes sure 'count' pipes fit below RLIMIT_NOFILE, raising the soft limit
+ * if necessary. Returns false with errno set if they do not.
+ */
+static inline bool
+bench_util_fd_limit(size_t count)
+{
+	struct rlimit rl;
+	rlim_t needed = (rlim_t)count * 2 + 64;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+		return (false);
+	}
+	if (rl.rlim_cur >= needed) {
+		return (true);
+	}
+	rl.rlim_cur = needed;
+	return (setrlimit(RLIMIT_NOFILE, &rl) == 0);
+}
+
+#endif
@@ -0,0 +1,124 @@
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bench_util.h"
+#include "coro.h"
+
+#define CORO_BENCH_STACK_SIZE (64 * 1024)
+
+static void
+pong(Coro c, void *arg)
+{
+	while (arg) {
+		arg = coro_transfer(c, arg);
+	}
+}
+
+static uint64_t
+percentile(uint64_t const *sorted, size_t n, double p)
+{
+	size_t i = (size_t)(p / 100.0 * (double)(n - 1) + 0.5);
+
+	return (sorted[i]);
+}
+
+static void
+usage(char const *progname)
+{
+	fprintf(stderr, "usage: %s [-n round_trips] [-w warmup_round_trips]\n",
+	    progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t round_trips = 100000;
+	size_t warmup = 1000;
+	uint64_t *samples;
+	uint64_t start, end, sum = 0;
+	Coro c;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "n:w:")) != -1) {
+		switch (ch) {
+		case 'n':
+			round_trips = strtoul(optarg, NULL, 10);
+			break;
+		case 'w':
+			warmup = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (round_trips == 0) {
+		usage(argv[0]);
+	}
+
+	samples = malloc(round_trips * sizeof(uint64_t));
+	if (!samples) {
+		err(1, "malloc");
+	}
+
+	c = coro_create(CORO_BENCH_STACK_SIZE, pong);
+	if (!c) {
+		errx(1, "coro_create failed");
+	}
+
+	for (size_t i = 0; i < warmup; ++i) {
+		(void)coro_transfer(c, (void *)(uintptr_t)(i + 1));
+	}
+
+	/*
+	 * Each sample is one round trip, i.e. two coro_transfer() calls:
+	 * into the coroutine and back out again. The clock_gettime() call
+	 * per sample is included, so the ucontext backend's numbers are
+	 * dominated by it; the unsampled run below gives the raw throughput.
+	 */
+	for (size_t i = 0; i < round_trips; ++i) {
+		uint64_t t0 = bench_util_now_ns();
+
+		if (coro_transfer(c, (void *)(uintptr_t)(i + 1)) !=
+		    (void *)(uintptr_t)(i + 1)) {
+			errx(1, "coro_transfer returned a wrong value");
+		}
+		samples[i] = bench_util_now_ns() - t0;
+		sum += samples[i];
+	}
+
+	start = bench_util_now_ns();
+	for (size_t i = 0; i < round_trips; ++i) {
+		(void)coro_transfer(c, (void *)(uintptr_t)(i + 1));
+	}
+	end = bench_util_now_ns();
+
+	coro_destroy(c);
+
+	qsort(samples, round_trips, sizeof(uint64_t), bench_util_compare_u64);
+
+	double seconds = (double)(end - start) * 1e-9;
+	double transfers = 2.0 * (double)round_trips;
+
+	printf("backend: %s\n", CORO_BENCH_BACKEND);
+	printf("round_trips: %zu\n", round_trips);
+	printf("transfers/s: %.0f\n", transfers / seconds);
+	printf("ns/transfer: %.1f\n", seconds * 1e9 / transfers);
+	printf("round_trip_ns_mean: %.1f\n",
+	    (double)sum / (double)round_trips);
+	printf("round_trip_ns_p50: %llu\n",
+	    (unsigned long long)percentile(samples, round_trips, 50.0));
+	printf("round_trip_ns_p99: %llu\n",
+	    (unsigned long long)percentile(samples, round_trips, 99.0));
+	printf("round_trip_ns_p99.9: %llu\n",
+	    (unsigned long long)percentile(samples, round_trips, 99.9));
+	printf("round_trip_ns_max: %llu\n",
+	    (unsigned long long)samples[round_trips - 1]);
+
+	free(samples);
+
+	return (0);
+}
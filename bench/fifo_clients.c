@@ -0,0 +1,316 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench_util.h"
+#include "coro_rt.h"
+#include "coro_sched.h"
+
+/*
+ * Drives 'clients' FIFO (or pipe) connections from one thread with
+ * coro_sched, or from 'workers' threads with coro_rt: every connection has
+ * a writer task sending 'messages' messages of 'size' bytes and a reader
+ * task reading until EOF.
+ */
+
+#define FIFO_CLIENTS_STACK_SIZE (64 * 1024)
+
+struct client {
+	int rfd;
+	int wfd;
+	size_t messages;
+	size_t size;
+	uint64_t received;
+};
+
+static void
+writer(struct coro_sched *sched, void *arg)
+{
+	struct client *client = arg;
+	char *buf = calloc(1, client->size);
+
+	if (!buf) {
+		err(1, "calloc");
+	}
+	for (size_t i = 0; i < client->messages; ++i) {
+		if (coro_sched_write(sched, client->wfd, buf, client->size) <
+		    0) {
+			err(1, "write");
+		}
+	}
+	free(buf);
+	close(client->wfd);
+}
+
+static void
+reader(struct coro_sched *sched, void *arg)
+{
+	struct client *client = arg;
+	char buf[16384];
+	ssize_t n;
+
+	while ((n = coro_sched_read(sched, client->rfd, buf, sizeof(buf))) >
+	    0) {
+		client->received += (uint64_t)n;
+	}
+	if (n < 0) {
+		err(1, "read");
+	}
+	close(client->rfd);
+}
+
+static void
+writer_rt(struct coro_rt_task *task, void *arg)
+{
+	struct client *client = arg;
+	char *buf = calloc(1, client->size);
+
+	if (!buf) {
+		err(1, "calloc");
+	}
+	for (size_t i = 0; i < client->messages; ++i) {
+		if (coro_rt_write(task, client->wfd, buf, client->size) < 0) {
+			err(1, "write");
+		}
+	}
+	free(buf);
+	close(client->wfd);
+}
+
+static void
+reader_rt(struct coro_rt_task *task, void *arg)
+{
+	struct client *client = arg;
+	char buf[16384];
+	ssize_t n;
+
+	while ((n = coro_rt_read(task, client->rfd, buf, sizeof(buf))) > 0) {
+		client->received += (uint64_t)n;
+	}
+	if (n < 0) {
+		err(1, "read");
+	}
+	close(client->rfd);
+}
+
+/* Returns the time coro_sched took to run all connections. */
+static uint64_t
+run_sched(struct client *clients, size_t nclients,
+    struct coro_sched_stats *stats)
+{
+	struct coro_sched *sched;
+	uint64_t start, elapsed;
+
+	if (!(sched = coro_sched_create(FIFO_CLIENTS_STACK_SIZE))) {
+		err(1, "coro_sched_create");
+	}
+	for (size_t i = 0; i < nclients; ++i) {
+		if (coro_sched_spawn(sched, writer, &clients[i]) < 0 ||
+		    coro_sched_spawn(sched, reader, &clients[i]) < 0) {
+			err(1, "coro_sched_spawn");
+		}
+	}
+
+	start = bench_util_now_ns();
+	if (coro_sched_run(sched) < 0) {
+		err(1, "coro_sched_run");
+	}
+	elapsed = bench_util_now_ns() - start;
+	coro_sched_stats(sched, stats);
+	coro_sched_destroy(sched);
+	return (elapsed);
+}
+
+/* Returns the time coro_rt took to run all connections. */
+static uint64_t
+run_rt(struct client *clients, size_t nclients, unsigned *nworkers,
+    struct coro_rt_stats *stats)
+{
+	struct coro_rt *rt;
+	uint64_t start, elapsed;
+
+	if (!(rt = coro_rt_create(*nworkers, FIFO_CLIENTS_STACK_SIZE))) {
+		err(1, "coro_rt_create");
+	}
+	*nworkers = coro_rt_workers(rt);
+	for (size_t i = 0; i < nclients; ++i) {
+		if (coro_rt_spawn(rt, writer_rt, &clients[i]) < 0 ||
+		    coro_rt_spawn(rt, reader_rt, &clients[i]) < 0) {
+			err(1, "coro_rt_spawn");
+		}
+	}
+
+	start = bench_util_now_ns();
+	if (coro_rt_run(rt) < 0) {
+		err(1, "coro_rt_run");
+	}
+	elapsed = bench_util_now_ns() - start;
+	coro_rt_stats(rt, stats);
+	coro_rt_destroy(rt);
+	return (elapsed);
+}
+
+static void
+open_fifo(struct client *client, char const *tmpdir, size_t i)
+{
+	char path[PATH_MAX];
+
+	if ((size_t)snprintf(path, sizeof(path), "%s/%zu", tmpdir, i) >=
+	    sizeof(path)) {
+		errx(1, "%s: path too long", tmpdir);
+	}
+	if (mkfifo(path, 0600) < 0) {
+		err(1, "mkfifo");
+	}
+	if ((client->rfd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK)) <
+	    0) {
+		err(1, "open");
+	}
+	if ((client->wfd = open(path, O_WRONLY | O_CLOEXEC | O_NONBLOCK)) <
+	    0) {
+		err(1, "open");
+	}
+	(void)unlink(path);
+}
+
+static void
+usage(char const *progname)
+{
+	fprintf(stderr,
+	    "usage: %s [-p] [-c clients] [-m messages] [-s size] [-t workers] "
+	    "[-d dir]\n",
+	    progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	char const *progname = argv[0];
+	char const *dir = NULL;
+	char tmpdir[PATH_MAX];
+	size_t nclients = 1000;
+	size_t messages = 64;
+	size_t size = 4096;
+	bool use_pipes = false;
+	bool use_rt = false;
+	unsigned nworkers = 1;
+	struct coro_sched_stats stats;
+	struct coro_rt_stats rt_stats = { 0 };
+	struct client *clients;
+	uint64_t elapsed, total = 0;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "c:d:m:ps:t:")) != -1) {
+		switch (ch) {
+		case 'c':
+			nclients = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 'm':
+			messages = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			use_pipes = true;
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			/* 0 means one worker per CPU. */
+			nworkers = (unsigned)strtoul(optarg, NULL, 10);
+			use_rt = true;
+			break;
+		default:
+			usage(progname);
+		}
+	}
+	if (nclients == 0 || size == 0 || optind != argc) {
+		usage(progname);
+	}
+
+	if (!dir) {
+		dir = getenv("TMPDIR");
+	}
+	if (!dir) {
+		dir = "/tmp";
+	}
+
+	if (!bench_util_fd_limit(nclients)) {
+		err(1, "setrlimit");
+	}
+
+	if (!(clients = calloc(nclients, sizeof(*clients)))) {
+		err(1, "calloc");
+	}
+	if (!use_pipes) {
+		(void)snprintf(tmpdir, sizeof(tmpdir), "%s/fifo-clients.XXXXXX",
+		    dir);
+		if (!mkdtemp(tmpdir)) {
+			err(1, "mkdtemp");
+		}
+	}
+	for (size_t i = 0; i < nclients; ++i) {
+		int p[2];
+
+		if (use_pipes) {
+			if (pipe2(p, O_CLOEXEC | O_NONBLOCK) < 0) {
+				err(1, "pipe2");
+			}
+			clients[i].rfd = p[0];
+			clients[i].wfd = p[1];
+		} else {
+			open_fifo(&clients[i], tmpdir, i);
+		}
+		clients[i].messages = messages;
+		clients[i].size = size;
+	}
+	if (!use_pipes) {
+		(void)rmdir(tmpdir);
+	}
+
+	if (use_rt) {
+		elapsed = run_rt(clients, nclients, &nworkers, &rt_stats);
+		stats.switches = rt_stats.switches;
+		stats.kevents = rt_stats.kevents;
+		stats.events = rt_stats.events;
+	} else {
+		elapsed = run_sched(clients, nclients, &stats);
+	}
+
+	for (size_t i = 0; i < nclients; ++i) {
+		if (clients[i].received != (uint64_t)messages * size) {
+			errx(1, "client %zu received %llu bytes", i,
+			    (unsigned long long)clients[i].received);
+		}
+		total += clients[i].received;
+	}
+
+	printf("%-9s %7s %8s %12s %10s %10s %12s %10s %12s %10s\n",
+	    "transport", "workers", "clients", "bytes", "seconds", "MB/s",
+	    "switches", "kevents", "events/call", "steals");
+	printf("%-9s %7u %8zu %12llu %10.3f %10.1f %12llu %10llu %12.1f "
+	       "%10llu\n",
+	    use_pipes ? "pipe" : "fifo", nworkers, nclients,
+	    (unsigned long long)total,
+	    (double)elapsed / 1e9,
+	    (double)total / 1e6 / ((double)elapsed / 1e9),
+	    (unsigned long long)stats.switches,
+	    (unsigned long long)stats.kevents,
+	    stats.kevents ? (double)stats.events / (double)stats.kevents : 0.0,
+	    (unsigned long long)rt_stats.steals);
+
+	free(clients);
+	return (0);
+}
@@ -0,0 +1,178 @@
+#include <sys/types.h>
+#include <sys/event.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench_util.h"
+
+/*
+ * Measures how many EVFILT_READ events per second can be harvested from
+ * pipes that all became readable, with exact byte counts in 'data' and,
+ * where the kqueue implementation offers it, with NOTE_NODATA.
+ */
+
+#define EVENT_BATCH 1024
+
+/*
+ * Makes every pipe readable, then harvests all events. Returns the time
+ * the harvest took; the pipes are drained again outside of it.
+ */
+static uint64_t
+round_once(int kq, int (*pipes)[2], size_t npipes, struct kevent *events,
+    bool check_data)
+{
+	char byte = 0;
+	size_t harvested = 0;
+	uint64_t start, end;
+
+	for (size_t i = 0; i < npipes; ++i) {
+		if (write(pipes[i][1], &byte, 1) != 1) {
+			err(1, "write");
+		}
+	}
+
+	start = bench_util_now_ns();
+	do {
+		int n = kevent(kq, NULL, 0, events, EVENT_BATCH,
+		    &(struct timespec) { 0, 0 });
+
+		if (n < 0) {
+			err(1, "kevent");
+		}
+		if (n == 0) {
+			errx(1, "harvested %zu of %zu events", harvested,
+			    npipes);
+		}
+		for (int i = 0; check_data && i < n; ++i) {
+			if (events[i].data != 1) {
+				errx(1, "expected data 1, got %lld",
+				    (long long)events[i].data);
+			}
+		}
+		harvested += (size_t)n;
+	} while (harvested < npipes);
+	end = bench_util_now_ns();
+
+	for (size_t i = 0; i < npipes; ++i) {
+		if (read(pipes[i][0], &byte, 1) != 1) {
+			err(1, "read");
+		}
+	}
+
+	return (end - start);
+}
+
+static void
+run(char const *mode, unsigned int fflags, int (*pipes)[2], size_t npipes,
+    unsigned rounds)
+{
+	struct kevent *events = calloc(EVENT_BATCH, sizeof(struct kevent));
+	uint64_t total = 0;
+	int kq;
+
+	if (!events) {
+		err(1, "calloc");
+	}
+	if ((kq = kqueue()) < 0) {
+		err(1, "kqueue");
+	}
+	for (size_t i = 0; i < npipes; ++i) {
+		struct kevent kev;
+
+		EV_SET(&kev, pipes[i][0], EVFILT_READ, EV_ADD | EV_CLEAR,
+		    fflags, 0, 0);
+		if (kevent(kq, &kev, 1, NULL, 0, NULL) < 0) {
+			err(1, "kevent");
+		}
+	}
+	/* Nothing is readable yet, but the registrations may be pending. */
+	if (kevent(kq, NULL, 0, events, EVENT_BATCH,
+		&(struct timespec) { 0, 0 }) < 0) {
+		err(1, "kevent");
+	}
+
+	for (unsigned r = 0; r < rounds; ++r) {
+		total += round_once(kq, pipes, npipes, events, fflags == 0);
+	}
+
+	double events_total = (double)npipes * rounds;
+
+	printf("%-8s %8zu %8u %14.0f %12.1f\n", mode, npipes, rounds,
+	    events_total / ((double)total / 1e9),
+	    (double)total / events_total);
+	fflush(stdout);
+
+	close(kq);
+	free(events);
+}
+
+static void
+usage(char const *progname)
+{
+	fprintf(stderr, "usage: %s [-n pipes] [-r rounds]\n", progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	char const *progname = argv[0];
+	size_t npipes = 1000;
+	unsigned rounds = 200;
+	int (*pipes)[2];
+	int ch;
+
+	while ((ch = getopt(argc, argv, "n:r:")) != -1) {
+		switch (ch) {
+		case 'n':
+			npipes = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			rounds = (unsigned)strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(progname);
+		}
+	}
+	if (npipes == 0 || rounds == 0 || optind != argc) {
+		usage(progname);
+	}
+
+	if (!bench_util_fd_limit(npipes)) {
+		err(1, "setrlimit");
+	}
+
+	if (!(pipes = calloc(npipes, sizeof(*pipes)))) {
+		err(1, "calloc");
+	}
+	for (size_t i = 0; i < npipes; ++i) {
+		if (pipe2(pipes[i], O_CLOEXEC | O_NONBLOCK) < 0) {
+			err(1, "pipe2");
+		}
+	}
+
+	printf("%-8s %8s %8s %14s %12s\n", "mode", "pipes", "rounds",
+	    "events/s", "ns/event");
+
+	run("exact", 0, pipes, npipes, rounds);
+#ifdef NOTE_NODATA
+	run("nodata", NOTE_NODATA, pipes, npipes, rounds);
+#else
+	warnx("NOTE_NODATA not available, skipping");
+#endif
+
+	for (size_t i = 0; i < npipes; ++i) {
+		close(pipes[i][0]);
+		close(pipes[i][1]);
+	}
+	free(pipes);
+
+	return (0);
+}
@@ -0,0 +1,534 @@
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench_util.h"
+#include "kq_changelist.h"
+
+#define EVENT_BATCH 16
+#define READ_BUFFER_SIZE 4096
+#define MAX_SAMPLES (1 << 20)
+
+enum arm {
+	ARM_CLEAR,
+	ARM_ONESHOT,
+	ARM_DISPATCH,
+};
+
+static char const *const arm_names[] = {
+	[ARM_CLEAR] = "clear",
+	[ARM_ONESHOT] = "oneshot",
+	[ARM_DISPATCH] = "dispatch",
+};
+
+struct run {
+	bool shared;
+	enum arm arm;
+	int nthreads;
+	int nwriters;
+	size_t npipes;
+	int (*pipes)[2];
+	int *kqs;
+	uint64_t pace_ns;
+	atomic_bool stop;
+};
+
+struct service {
+	struct run *run;
+	int kq;
+	pthread_t thread;
+	uint64_t wakeups;
+	uint64_t events;
+	uint64_t spurious;
+	uint64_t messages;
+	size_t nsamples;
+	uint64_t *samples;
+};
+
+struct writer {
+	struct run *run;
+	pthread_t thread;
+	uint64_t rng;
+	uint64_t full;
+};
+
+static unsigned short
+arm_flags(enum arm arm)
+{
+	switch (arm) {
+	case ARM_CLEAR:
+		return (EV_CLEAR);
+	case ARM_ONESHOT:
+		return (EV_ONESHOT);
+	case ARM_DISPATCH:
+		return (EV_DISPATCH);
+	}
+
+	return (0);
+}
+
+/*
+ * Reads every message that is in the pipe and records its latency. Returns
+ * false if there was nothing to read, because another thread was faster.
+ */
+static bool
+drain(struct service *service, int fd)
+{
+	static _Thread_local uint64_t buf[READ_BUFFER_SIZE / sizeof(uint64_t)];
+	bool got_any = false;
+	ssize_t r;
+
+	while ((r = read(fd, buf, sizeof(buf))) > 0) {
+		uint64_t now = bench_util_now_ns();
+		size_t n = (size_t)r / sizeof(uint64_t);
+
+		for (size_t i = 0; i < n; ++i) {
+			if (service->nsamples < MAX_SAMPLES) {
+				service->samples[service->nsamples++] =
+				    now - buf[i];
+			}
+		}
+		service->messages += n;
+		got_any = true;
+	}
+	if (r < 0 && errno != EAGAIN) {
+		err(1, "read");
+	}
+
+	return (got_any);
+}
+
+/*
+ * Services one kqueue. Filters armed with EV_ONESHOT or EV_DISPATCH are
+ * armed again after draining, together with the next harvest.
+ */
+static void *
+service_run(void *arg)
+{
+	struct service *service = arg;
+	struct run *run = service->run;
+	struct kevent events[EVENT_BATCH];
+	struct kq_changelist cl;
+
+	if (kq_changelist_init(&cl, service->kq, EVENT_BATCH) < 0) {
+		err(1, "kq_changelist_init");
+	}
+
+	while (!atomic_load_explicit(&run->stop, memory_order_relaxed)) {
+		int n = kq_changelist_submit(&cl, events, EVENT_BATCH,
+		    &(struct timespec) { 0, 100 * 1000 * 1000 });
+
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			err(1, "kevent");
+		}
+		if (n == 0) {
+			continue;
+		}
+
+		++service->wakeups;
+		for (int i = 0; i < n; ++i) {
+			int fd = (int)events[i].ident;
+
+			++service->events;
+			if (!drain(service, fd)) {
+				++service->spurious;
+			}
+
+			if (run->arm == ARM_ONESHOT) {
+				(void)kq_changelist_add(&cl, (uintptr_t)fd,
+				    EVFILT_READ, EV_ADD | EV_ONESHOT, 0, 0,
+				    NULL);
+			} else if (run->arm == ARM_DISPATCH) {
+				(void)kq_changelist_add(&cl, (uintptr_t)fd,
+				    EVFILT_READ, EV_ENABLE | EV_DISPATCH, 0, 0,
+				    NULL);
+			}
+		}
+	}
+
+	kq_changelist_fini(&cl);
+
+	return (NULL);
+}
+
+/* Writes timestamps to random pipes until the run stops. */
+static void *
+writer_run(void *arg)
+{
+	struct writer *writer = arg;
+	struct run *run = writer->run;
+	uint64_t next = bench_util_now_ns();
+
+	while (!atomic_load_explicit(&run->stop, memory_order_relaxed)) {
+		size_t i =
+		    (size_t)(bench_util_random(&writer->rng) % run->npipes);
+		uint64_t now = bench_util_now_ns();
+
+		if (run->pace_ns) {
+			if (now < next) {
+				struct timespec ts = {
+					(time_t)((next - now) / 1000000000),
+					(long)((next - now) % 1000000000),
+				};
+				nanosleep(&ts, NULL);
+				now = bench_util_now_ns();
+			}
+			next += run->pace_ns;
+		}
+
+		if (write(run->pipes[i][1], &now, sizeof(now)) < 0) {
+			if (errno != EAGAIN) {
+				err(1, "write");
+			}
+			++writer->full;
+		}
+	}
+
+	return (NULL);
+}
+
+static void
+run_one(struct run *run, double seconds)
+{
+	struct service *services;
+	struct writer *writers;
+	int nkqs = run->shared ? 1 : run->nthreads;
+	uint64_t start, elapsed;
+	uint64_t *samples;
+	size_t nsamples = 0;
+	struct service total = { 0 };
+	uint64_t full = 0;
+
+	run->kqs = calloc((size_t)nkqs, sizeof(int));
+	services = calloc((size_t)run->nthreads, sizeof(struct service));
+	writers = calloc((size_t)run->nwriters, sizeof(struct writer));
+	if (!run->kqs || !services || !writers) {
+		err(1, "calloc");
+	}
+
+	for (int i = 0; i < nkqs; ++i) {
+		struct kq_changelist cl;
+
+		if ((run->kqs[i] = kqueue()) < 0) {
+			err(1, "kqueue");
+		}
+		if (kq_changelist_init(&cl, run->kqs[i], 1024) < 0) {
+			err(1, "kq_changelist_init");
+		}
+		for (size_t j = (size_t)i; j < run->npipes; j += (size_t)nkqs) {
+			if (kq_changelist_add(&cl, (uintptr_t)run->pipes[j][0],
+				EVFILT_READ, EV_ADD | arm_flags(run->arm), 0,
+				0, NULL) < 0) {
+				err(1, "kevent");
+			}
+		}
+		if (kq_changelist_submit(&cl, NULL, 0, NULL) < 0) {
+			err(1, "kevent");
+		}
+		kq_changelist_fini(&cl);
+	}
+
+	atomic_store(&run->stop, false);
+	start = bench_util_now_ns();
+
+	for (int i = 0; i < run->nthreads; ++i) {
+		services[i].run = run;
+		services[i].kq = run->kqs[run->shared ? 0 : i];
+		services[i].samples = malloc(MAX_SAMPLES * sizeof(uint64_t));
+		if (!services[i].samples) {
+			err(1, "malloc");
+		}
+		if ((errno = pthread_create(&services[i].thread, NULL,
+			 service_run, &services[i])) != 0) {
+			err(1, "pthread_create");
+		}
+	}
+	for (int i = 0; i < run->nwriters; ++i) {
+		writers[i].run = run;
+		writers[i].rng = UINT64_C(0x9e3779b97f4a7c15) *
+		    (uint64_t)(i + 1);
+		if ((errno = pthread_create(&writers[i].thread, NULL,
+			 writer_run, &writers[i])) != 0) {
+			err(1, "pthread_create");
+		}
+	}
+
+	struct timespec ts = {
+		(time_t)seconds,
+		(long)((seconds - (double)(time_t)seconds) * 1e9),
+	};
+	nanosleep(&ts, NULL);
+	atomic_store(&run->stop, true);
+
+	for (int i = 0; i < run->nwriters; ++i) {
+		pthread_join(writers[i].thread, NULL);
+		full += writers[i].full;
+	}
+	for (int i = 0; i < run->nthreads; ++i) {
+		pthread_join(services[i].thread, NULL);
+	}
+	elapsed = bench_util_now_ns() - start;
+
+	for (int i = 0; i < run->nthreads; ++i) {
+		total.wakeups += services[i].wakeups;
+		total.events += services[i].events;
+		total.spurious += services[i].spurious;
+		total.messages += services[i].messages;
+		nsamples += services[i].nsamples;
+	}
+	samples = malloc((nsamples ? nsamples : 1) * sizeof(uint64_t));
+	if (!samples) {
+		err(1, "malloc");
+	}
+	nsamples = 0;
+	for (int i = 0; i < run->nthreads; ++i) {
+		memcpy(samples + nsamples, services[i].samples,
+		    services[i].nsamples * sizeof(uint64_t));
+		nsamples += services[i].nsamples;
+		free(services[i].samples);
+	}
+	qsort(samples, nsamples, sizeof(uint64_t), bench_util_compare_u64);
+
+	double secs = (double)elapsed * 1e-9;
+
+	printf("%-10s %-8s %7d %7d %12.0f %12.0f %8.2f %9.2f %9.1f %9.1f "
+	       "%9.1f %9llu\n",
+	    run->shared ? "shared" : "per-thread", arm_names[run->arm],
+	    run->nthreads, run->nwriters, (double)total.messages / secs,
+	    (double)total.wakeups / secs,
+	    total.wakeups ? (double)total.events / (double)total.wakeups : 0,
+	    total.events ? 100.0 * (double)total.spurious /
+		    (double)total.events
+			 : 0,
+	    nsamples ? (double)samples[nsamples / 2] / 1e3 : 0,
+	    nsamples ? (double)samples[nsamples * 99 / 100] / 1e3 : 0,
+	    nsamples ? (double)samples[nsamples * 999 / 1000] / 1e3 : 0,
+	    (unsigned long long)full);
+	fflush(stdout);
+
+	/* Leftover messages would count against the next run. */
+	for (size_t i = 0; i < run->npipes; ++i) {
+		static uint64_t buf[READ_BUFFER_SIZE / sizeof(uint64_t)];
+
+		while (read(run->pipes[i][0], buf, sizeof(buf)) > 0) {
+		}
+	}
+	for (int i = 0; i < nkqs; ++i) {
+		close(run->kqs[i]);
+	}
+	free(samples);
+	free(writers);
+	free(services);
+	free(run->kqs);
+}
+
+static void
+open_pipes(struct run *run)
+{
+	for (size_t i = 0; i < run->npipes; ++i) {
+		if (pipe2(run->pipes[i], O_CLOEXEC | O_NONBLOCK) < 0) {
+			err(1, "pipe2");
+		}
+	}
+}
+
+static void
+fifo_path(char *buf, size_t size, char const *tmpdir, size_t i)
+{
+	if ((size_t)snprintf(buf, size, "%s/%zu", tmpdir, i) >= size) {
+		errx(1, "%s: path too long", tmpdir);
+	}
+}
+
+/* Gives every reader a FIFO of its own in 'tmpdir'. */
+static void
+open_fifos(struct run *run, char const *tmpdir)
+{
+	char path[PATH_MAX];
+
+	for (size_t i = 0; i < run->npipes; ++i) {
+		fifo_path(path, sizeof(path), tmpdir, i);
+		if (mkfifo(path, 0600) < 0) {
+			err(1, "mkfifo");
+		}
+		if ((run->pipes[i][0] = open(path,
+			 O_RDONLY | O_CLOEXEC | O_NONBLOCK)) < 0) {
+			err(1, "open");
+		}
+		if ((run->pipes[i][1] = open(path,
+			 O_WRONLY | O_CLOEXEC | O_NONBLOCK)) < 0) {
+			err(1, "open");
+		}
+	}
+}
+
+static void
+close_pipes(struct run *run, char const *tmpdir)
+{
+	char path[PATH_MAX];
+
+	for (size_t i = 0; i < run->npipes; ++i) {
+		close(run->pipes[i][0]);
+		close(run->pipes[i][1]);
+		if (tmpdir) {
+			fifo_path(path, sizeof(path), tmpdir, i);
+			(void)unlink(path);
+		}
+	}
+}
+
+static void
+usage(char const *progname)
+{
+	fprintf(stderr,
+	    "usage: %s [-t threads] [-w writers] [-n pipes] [-s seconds] "
+	    "[-r rate]\n"
+	    "          [-m shared|per-thread] [-a clear|oneshot|dispatch]\n"
+	    "          [-f] [-d dir]\n",
+	    progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct run run = { 0 };
+	char const *progname = argv[0];
+	char const *mode = NULL;
+	char const *arm = NULL;
+	char const *dir = NULL;
+	char tmpdir[PATH_MAX];
+	bool use_fifos = false;
+	double seconds = 1.0;
+	double rate = 0;
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int ch;
+
+	run.nthreads = ncpus > 1 ? (int)ncpus : 2;
+	run.nwriters = 2;
+	run.npipes = 1024;
+
+	while ((ch = getopt(argc, argv, "a:d:fm:n:r:s:t:w:")) != -1) {
+		switch (ch) {
+		case 'a':
+			arm = optarg;
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 'f':
+			use_fifos = true;
+			break;
+		case 'm':
+			mode = optarg;
+			break;
+		case 'n':
+			run.npipes = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			rate = strtod(optarg, NULL);
+			break;
+		case 's':
+			seconds = strtod(optarg, NULL);
+			break;
+		case 't':
+			run.nthreads = (int)strtol(optarg, NULL, 10);
+			break;
+		case 'w':
+			run.nwriters = (int)strtol(optarg, NULL, 10);
+			break;
+		default:
+			usage(progname);
+		}
+	}
+	argc -= optind;
+
+	if (argc > 0 || run.npipes == 0 || run.nthreads <= 0 ||
+	    run.nwriters <= 0 || seconds <= 0 || rate < 0) {
+		usage(progname);
+	}
+	if (mode && strcmp(mode, "shared") != 0 &&
+	    strcmp(mode, "per-thread") != 0) {
+		usage(progname);
+	}
+	if (arm && strcmp(arm, "clear") != 0 && strcmp(arm, "oneshot") != 0 &&
+	    strcmp(arm, "dispatch") != 0) {
+		usage(progname);
+	}
+	if (rate > 0) {
+		/* 'rate' is the number of messages per second per writer. */
+		run.pace_ns = (uint64_t)(1e9 / rate);
+	}
+
+	if (!bench_util_fd_limit(run.npipes)) {
+		err(1, "setrlimit");
+	}
+
+	run.pipes = calloc(run.npipes, sizeof(*run.pipes));
+	if (!run.pipes) {
+		err(1, "calloc");
+	}
+	tmpdir[0] = '\0';
+	if (use_fifos) {
+		if (!dir) {
+			dir = getenv("TMPDIR");
+		}
+		if (!dir) {
+			dir = "/tmp";
+		}
+		if ((size_t)snprintf(tmpdir, sizeof(tmpdir),
+			"%s/kqueue-contention.XXXXXX", dir) >= sizeof(tmpdir)) {
+			errx(1, "%s: path too long", dir);
+		}
+		if (!mkdtemp(tmpdir)) {
+			err(1, "mkdtemp");
+		}
+		open_fifos(&run, tmpdir);
+	} else {
+		open_pipes(&run);
+	}
+
+	printf("%-10s %-8s %7s %7s %12s %12s %8s %9s %9s %9s %9s %9s\n",
+	    "mode", "arm", "threads", "writers", "msgs/s", "wakeups/s",
+	    "ev/wake", "spurious%", "p50_us", "p99_us", "p999_us", "full");
+
+	for (int shared = 1; shared >= 0; --shared) {
+		if (mode && (strcmp(mode, "shared") == 0) != shared) {
+			continue;
+		}
+		for (size_t a = 0; a < sizeof(arm_names) / sizeof(arm_names[0]);
+		     ++a) {
+			if (arm && strcmp(arm, arm_names[a]) != 0) {
+				continue;
+			}
+			run.shared = shared;
+			run.arm = (enum arm)a;
+			run_one(&run, seconds);
+		}
+	}
+
+	close_pipes(&run, tmpdir[0] != '\0' ? tmpdir : NULL);
+	if (tmpdir[0] != '\0') {
+		(void)rmdir(tmpdir);
+	}
+	free(run.pipes);
+
+	return (0);
+}
@@ -0,0 +1,358 @@
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench_util.h"
+
+#define EVENT_BATCH 1024
+
+struct pairs {
+	size_t count;
+	int *rfds;
+	int *wfds;
+};
+
+static void
+open_pipes(struct pairs *pairs)
+{
+	for (size_t i = 0; i < pairs->count; ++i) {
+		int p[2];
+
+		if (pipe2(p, O_CLOEXEC | O_NONBLOCK) < 0) {
+			err(1, "pipe2");
+		}
+		pairs->rfds[i] = p[0];
+		pairs->wfds[i] = p[1];
+	}
+}
+
+static void
+fifo_path(char *buf, size_t size, char const *tmpdir, size_t i)
+{
+	if ((size_t)snprintf(buf, size, "%s/%zu", tmpdir, i) >= size) {
+		errx(1, "%s: path too long", tmpdir);
+	}
+}
+
+static void
+open_fifos(struct pairs *pairs, char const *tmpdir)
+{
+	char path[PATH_MAX];
+
+	for (size_t i = 0; i < pairs->count; ++i) {
+		fifo_path(path, sizeof(path), tmpdir, i);
+		if (mkfifo(path, 0600) < 0) {
+			err(1, "mkfifo");
+		}
+		if ((pairs->rfds[i] = open(path,
+			 O_RDONLY | O_CLOEXEC | O_NONBLOCK)) < 0) {
+			err(1, "open");
+		}
+		if ((pairs->wfds[i] = open(path,
+			 O_WRONLY | O_CLOEXEC | O_NONBLOCK)) < 0) {
+			err(1, "open");
+		}
+	}
+}
+
+static void
+close_pairs(struct pairs *pairs, char const *tmpdir)
+{
+	char path[PATH_MAX];
+
+	for (size_t i = 0; i < pairs->count; ++i) {
+		close(pairs->rfds[i]);
+		close(pairs->wfds[i]);
+		if (tmpdir) {
+			fifo_path(path, sizeof(path), tmpdir, i);
+			(void)unlink(path);
+		}
+	}
+}
+
+/* Returns the mean cost of one EV_ADD in nanoseconds. */
+static double
+register_all(int kq, struct pairs const *pairs)
+{
+	uint64_t start = bench_util_now_ns();
+
+	for (size_t i = 0; i < pairs->count; ++i) {
+		struct kevent kev;
+
+		EV_SET(&kev, pairs->rfds[i], EVFILT_READ, EV_ADD | EV_CLEAR, 0,
+		    0, (void *)(uintptr_t)i);
+		if (kevent(kq, &kev, 1, NULL, 0, NULL) < 0) {
+			err(1, "kevent");
+		}
+	}
+
+	return ((double)(bench_util_now_ns() - start) / (double)pairs->count);
+}
+
+/*
+ * Makes 'active' randomly chosen pipes readable, then measures how long it
+ * takes to harvest all of their events. The pipes are drained again
+ * afterwards, outside of the measurement.
+ */
+static uint64_t
+iterate(int kq, struct pairs const *pairs, size_t *order, size_t active,
+    uint64_t *rng)
+{
+	static struct kevent events[EVENT_BATCH];
+	char byte = 0;
+	size_t harvested = 0;
+	uint64_t start, end;
+
+	/* Partial Fisher-Yates shuffle: order[0..active) is the sample. */
+	for (size_t i = 0; i < active; ++i) {
+		size_t j = i +
+		    (size_t)(bench_util_random(rng) % (pairs->count - i));
+		size_t tmp = order[i];
+
+		order[i] = order[j];
+		order[j] = tmp;
+		if (write(pairs->wfds[order[i]], &byte, 1) != 1) {
+			err(1, "write");
+		}
+	}
+
+	start = bench_util_now_ns();
+	do {
+		int n = kevent(kq, NULL, 0, events, EVENT_BATCH,
+		    &(struct timespec) { 0, 0 });
+
+		if (n < 0) {
+			err(1, "kevent");
+		}
+		if (n == 0 && harvested < active) {
+			errx(1, "harvested %zu of %zu events", harvested,
+			    active);
+		}
+		harvested += (size_t)n;
+	} while (harvested < active);
+	end = bench_util_now_ns();
+
+	for (size_t i = 0; i < active; ++i) {
+		if (read(pairs->rfds[order[i]], &byte, 1) != 1) {
+			err(1, "read");
+		}
+	}
+
+	return (end - start);
+}
+
+static void
+run(char const *transport, size_t count, double const *ratios,
+    size_t ratios_count, unsigned iterations, char const *dir)
+{
+	struct pairs pairs = { .count = count };
+	char tmpdir[PATH_MAX];
+	uint64_t *samples;
+	size_t *order;
+	uint64_t rng = UINT64_C(0x9e3779b97f4a7c15) ^ count;
+	double register_ns;
+	int kq;
+
+	pairs.rfds = calloc(count, sizeof(int));
+	pairs.wfds = calloc(count, sizeof(int));
+	order = calloc(count, sizeof(size_t));
+	samples = calloc(iterations, sizeof(uint64_t));
+	if (!pairs.rfds || !pairs.wfds || !order || !samples) {
+		err(1, "calloc");
+	}
+	for (size_t i = 0; i < count; ++i) {
+		order[i] = i;
+	}
+
+	tmpdir[0] = '\0';
+	if (strcmp(transport, "fifo") == 0) {
+		(void)snprintf(tmpdir, sizeof(tmpdir), "%s/many-fifos.XXXXXX",
+		    dir);
+		if (!mkdtemp(tmpdir)) {
+			err(1, "mkdtemp");
+		}
+		open_fifos(&pairs, tmpdir);
+	} else {
+		open_pipes(&pairs);
+	}
+
+	kq = kqueue();
+	if (kq < 0) {
+		err(1, "kqueue");
+	}
+	register_ns = register_all(kq, &pairs);
+
+	for (size_t r = 0; r < ratios_count; ++r) {
+		size_t active = (size_t)(ratios[r] * (double)count + 0.5);
+		uint64_t sum = 0;
+
+		if (active == 0 && ratios[r] > 0) {
+			active = 1;
+		}
+		if (active > count) {
+			active = count;
+		}
+
+		for (unsigned i = 0; i < iterations; ++i) {
+			samples[i] = iterate(kq, &pairs, order, active, &rng);
+			sum += samples[i];
+		}
+		qsort(samples, iterations, sizeof(uint64_t),
+		    bench_util_compare_u64);
+
+		double mean = (double)sum / iterations;
+
+		printf("%-9s %8zu %8.4f %8zu %12.1f %12.0f %12llu %12llu "
+		       "%12.1f\n",
+		    transport, count, ratios[r], active, register_ns, mean,
+		    (unsigned long long)samples[iterations / 2],
+		    (unsigned long long)samples[iterations * 99 / 100],
+		    active ? mean / (double)active : 0.0);
+		fflush(stdout);
+	}
+
+	close(kq);
+	close_pairs(&pairs, tmpdir[0] != '\0' ? tmpdir : NULL);
+	if (tmpdir[0] != '\0') {
+		(void)rmdir(tmpdir);
+	}
+	free(samples);
+	free(order);
+	free(pairs.wfds);
+	free(pairs.rfds);
+}
+
+static void
+usage(char const *progname)
+{
+	fprintf(stderr,
+	    "usage: %s [-p | -f] [-a active_ratio]... [-i iterations] "
+	    "[-d dir] [fd_count...]\n",
+	    progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t default_counts[] = { 1000, 10000, 100000 };
+	double default_ratios[] = { 0.0, 0.001, 0.01, 0.1, 1.0 };
+	size_t *counts = default_counts;
+	size_t counts_count =
+	    sizeof(default_counts) / sizeof(default_counts[0]);
+	double *ratios = default_ratios;
+	size_t ratios_count =
+	    sizeof(default_ratios) / sizeof(default_ratios[0]);
+	char const *progname = argv[0];
+	char const *dir = NULL;
+	bool use_pipes = true;
+	bool use_fifos = true;
+	unsigned iterations = 50;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "a:d:fi:p")) != -1) {
+		switch (ch) {
+		case 'a':
+			if (ratios == default_ratios) {
+				ratios = NULL;
+				ratios_count = 0;
+			}
+			ratios = realloc(ratios,
+			    (ratios_count + 1) * sizeof(double));
+			if (!ratios) {
+				err(1, "realloc");
+			}
+			ratios[ratios_count] = strtod(optarg, NULL);
+			if (ratios[ratios_count] < 0 ||
+			    ratios[ratios_count] > 1) {
+				usage(progname);
+			}
+			++ratios_count;
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 'f':
+			use_pipes = false;
+			use_fifos = true;
+			break;
+		case 'i':
+			iterations = (unsigned)strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			use_pipes = true;
+			use_fifos = false;
+			break;
+		default:
+			usage(progname);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (iterations == 0) {
+		usage(progname);
+	}
+
+	if (argc > 0) {
+		counts = calloc((size_t)argc, sizeof(size_t));
+		if (!counts) {
+			err(1, "calloc");
+		}
+		for (int i = 0; i < argc; ++i) {
+			counts[i] = strtoul(argv[i], NULL, 10);
+			if (counts[i] == 0) {
+				usage(progname);
+			}
+		}
+		counts_count = (size_t)argc;
+	}
+
+	if (!dir) {
+		dir = getenv("TMPDIR");
+	}
+	if (!dir) {
+		dir = "/tmp";
+	}
+
+	printf("%-9s %8s %8s %8s %12s %12s %12s %12s %12s\n", "transport",
+	    "fds", "ratio", "active", "register_ns", "harvest_ns", "p50_ns",
+	    "p99_ns", "ns/event");
+
+	for (size_t i = 0; i < counts_count; ++i) {
+		if (!bench_util_fd_limit(counts[i])) {
+			warnx("%zu fds: RLIMIT_NOFILE too low, skipping",
+			    counts[i]);
+			continue;
+		}
+		if (use_pipes) {
+			run("pipe", counts[i], ratios, ratios_count, iterations,
+			    dir);
+		}
+		if (use_fifos) {
+			run("fifo", counts[i], ratios, ratios_count, iterations,
+			    dir);
+		}
+	}
+
+	if (counts != default_counts) {
+		free(counts);
+	}
+	if (ratios != default_ratios) {
+		free(ratios);
+	}
+
+	return (0);
+}
@@ -0,0 +1,368 @@
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench_util.h"
+#include "pipe_size.h"
+
+#define READ_BUFFER_SIZE (64 * 1024)
+
+struct counters {
+	uint64_t syscalls;
+	uint64_t wakeups;
+};
+
+/*
+ * Waits for the single filter registered on 'kq'. It was added with
+ * EV_CLEAR, so the caller must do I/O until EAGAIN before it may wait again.
+ */
+static void
+wait_ready(int kq, int fd, struct counters *counters)
+{
+	struct kevent kev;
+	int n;
+
+	do {
+		n = kevent(kq, NULL, 0, &kev, 1, NULL);
+		++counters->syscalls;
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		err(1, "kevent");
+	}
+	if (n != 1 || kev.ident != (uintptr_t)fd) {
+		errx(1, "kevent returned an unexpected event");
+	}
+	++counters->wakeups;
+}
+
+static int
+register_filter(int fd, short filter, struct counters *counters)
+{
+	struct kevent kev;
+	int kq;
+
+	kq = kqueue();
+	if (kq < 0) {
+		err(1, "kqueue");
+	}
+	EV_SET(&kev, fd, filter, EV_ADD | EV_CLEAR, 0, 0, 0);
+	if (kevent(kq, &kev, 1, NULL, 0, NULL) < 0) {
+		err(1, "kevent");
+	}
+	counters->syscalls += 2;
+
+	return (kq);
+}
+
+static void
+run_writer(int fd, size_t write_size, uint64_t bytes,
+    struct counters *counters)
+{
+	char *buf;
+	int kq;
+
+	buf = calloc(1, write_size);
+	if (!buf) {
+		err(1, "calloc");
+	}
+
+	kq = register_filter(fd, EVFILT_WRITE, counters);
+
+	while (bytes > 0) {
+		wait_ready(kq, fd, counters);
+
+		for (;;) {
+			size_t n = bytes < write_size ? (size_t)bytes
+						      : write_size;
+			ssize_t r = write(fd, buf, n);
+
+			++counters->syscalls;
+			if (r < 0) {
+				if (errno == EAGAIN || errno == EINTR) {
+					break;
+				}
+				err(1, "write");
+			}
+			bytes -= (uint64_t)r;
+			if (bytes == 0) {
+				break;
+			}
+		}
+	}
+
+	close(kq);
+	close(fd);
+	free(buf);
+}
+
+static uint64_t
+run_reader(int fd, struct counters *counters)
+{
+	static char buf[READ_BUFFER_SIZE];
+	uint64_t bytes = 0;
+	int kq;
+
+	kq = register_filter(fd, EVFILT_READ, counters);
+
+	for (;;) {
+		wait_ready(kq, fd, counters);
+
+		for (;;) {
+			ssize_t r = read(fd, buf, sizeof(buf));
+
+			++counters->syscalls;
+			if (r < 0) {
+				if (errno == EAGAIN || errno == EINTR) {
+					break;
+				}
+				err(1, "read");
+			}
+			if (r == 0) {
+				close(kq);
+				return (bytes);
+			}
+			bytes += (uint64_t)r;
+		}
+	}
+}
+
+/*
+ * Streams 'bytes' bytes from a forked writer process to the reader in this
+ * process and prints one result row. Both sides run their own kqueue event
+ * loop on a non-blocking descriptor, so every kevent(2) return is counted as
+ * a wakeup.
+ */
+static void
+run(char const *transport, int rfd, int wfd, long pipe_size,
+    size_t write_size, uint64_t bytes)
+{
+	struct counters *counters;
+	uint64_t start, end, received;
+	long capacity;
+	pid_t pid;
+	int status;
+
+	capacity = pipe_size > 0 ? pipe_size_set(wfd, pipe_size)
+				 : pipe_size_default();
+	if (capacity < 0) {
+		err(1, "cannot resize the %s to %ld bytes", transport,
+		    pipe_size);
+	}
+
+	counters = mmap(NULL, 2 * sizeof(struct counters),
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+	if (counters == MAP_FAILED) {
+		err(1, "mmap");
+	}
+
+	start = bench_util_now_ns();
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		close(rfd);
+		run_writer(wfd, write_size, bytes, &counters[1]);
+		_exit(0);
+	}
+	close(wfd);
+
+	received = run_reader(rfd, &counters[0]);
+	end = bench_util_now_ns();
+	close(rfd);
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "writer failed");
+	}
+	if (received != bytes) {
+		errx(1, "received %llu bytes instead of %llu",
+		    (unsigned long long)received, (unsigned long long)bytes);
+	}
+
+	double mb = (double)bytes / (1024.0 * 1024.0);
+	double seconds = (double)(end - start) * 1e-9;
+	uint64_t syscalls = counters[0].syscalls + counters[1].syscalls;
+	uint64_t wakeups = counters[0].wakeups + counters[1].wakeups;
+
+	printf("%-9s %10ld %10zu %12llu %10.1f %14.1f %12.1f %12.1f\n",
+	    transport, capacity, write_size, (unsigned long long)bytes,
+	    mb / seconds,
+	    (double)syscalls / mb, (double)wakeups / mb,
+	    (double)counters[1].wakeups / mb);
+	fflush(stdout);
+
+	munmap(counters, 2 * sizeof(struct counters));
+}
+
+static void
+usage(char const *progname)
+{
+	fprintf(stderr,
+	    "usage: %s [-S | -c pipe_size]... [-b bytes] [-n max_writes] "
+	    "[-d dir]\n"
+	    "          [write_size...]\n",
+	    progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t default_write_sizes[] = { 1, PIPE_BUF, 16 * 1024, 64 * 1024 };
+	size_t *write_sizes = default_write_sizes;
+	size_t write_sizes_count =
+	    sizeof(default_write_sizes) / sizeof(default_write_sizes[0]);
+	uint64_t bytes = 64 * 1024 * 1024;
+	uint64_t max_writes = 1024 * 1024;
+	long *pipe_sizes = NULL;
+	size_t pipe_sizes_count = 0;
+	char const *progname = argv[0];
+	char const *dir = NULL;
+	char tmpdir[PATH_MAX];
+	char fifo_path[PATH_MAX];
+	int ch;
+
+	while ((ch = getopt(argc, argv, "b:c:d:n:S")) != -1) {
+		switch (ch) {
+		case 'b':
+			bytes = strtoull(optarg, NULL, 10);
+			break;
+		case 'c':
+			pipe_sizes = realloc(pipe_sizes,
+			    (pipe_sizes_count + 1) * sizeof(long));
+			if (!pipe_sizes) {
+				err(1, "realloc");
+			}
+			pipe_sizes[pipe_sizes_count] = strtol(optarg, NULL, 10);
+			if (pipe_sizes[pipe_sizes_count] <= 0) {
+				usage(progname);
+			}
+			++pipe_sizes_count;
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 'n':
+			max_writes = strtoull(optarg, NULL, 10);
+			break;
+		case 'S':
+			for (long size = PIPE_SIZE_MIN; size <= PIPE_SIZE_MAX;
+			     size *= 2) {
+				pipe_sizes = realloc(pipe_sizes,
+				    (pipe_sizes_count + 1) * sizeof(long));
+				if (!pipe_sizes) {
+					err(1, "realloc");
+				}
+				pipe_sizes[pipe_sizes_count++] = size;
+			}
+			break;
+		default:
+			usage(progname);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (bytes == 0 || max_writes == 0) {
+		usage(progname);
+	}
+
+	if (argc > 0) {
+		write_sizes = calloc((size_t)argc, sizeof(size_t));
+		if (!write_sizes) {
+			err(1, "calloc");
+		}
+		for (int i = 0; i < argc; ++i) {
+			write_sizes[i] = strtoul(argv[i], NULL, 10);
+			if (write_sizes[i] == 0) {
+				usage(progname);
+			}
+		}
+		write_sizes_count = (size_t)argc;
+	}
+
+	if (!dir) {
+		dir = getenv("TMPDIR");
+	}
+	(void)snprintf(tmpdir, sizeof(tmpdir), "%s/pipe-throughput.XXXXXX",
+	    dir ? dir : "/tmp");
+	if (!mkdtemp(tmpdir)) {
+		err(1, "mkdtemp");
+	}
+	if ((size_t)snprintf(fifo_path, sizeof(fifo_path), "%s/fifo",
+		tmpdir) >= sizeof(fifo_path)) {
+		errx(1, "%s: path too long", tmpdir);
+	}
+	if (mkfifo(fifo_path, 0600) < 0) {
+		err(1, "mkfifo");
+	}
+
+	/* Without sizes, pipes keep whatever size the kernel gives them. */
+	if (pipe_sizes_count == 0) {
+		pipe_sizes = calloc(1, sizeof(long));
+		if (!pipe_sizes) {
+			err(1, "calloc");
+		}
+		pipe_sizes_count = 1;
+	}
+
+	printf("%-9s %10s %10s %12s %10s %14s %12s %12s\n", "transport",
+	    "pipe_size", "write_size", "bytes", "MB/s", "syscalls/MB",
+	    "wakeups/MB", "w_wakeups/MB");
+
+	for (size_t i = 0; i < pipe_sizes_count * write_sizes_count; ++i) {
+		long pipe_size = pipe_sizes[i / write_sizes_count];
+		size_t write_size = write_sizes[i % write_sizes_count];
+		uint64_t run_bytes = bytes;
+		int p[2];
+
+		/*
+		 * Small writes are capped at 'max_writes' write(2) calls per
+		 * run so that the 1 byte case finishes in reasonable time.
+		 */
+		if (run_bytes / write_size > max_writes) {
+			run_bytes = max_writes * write_size;
+		}
+
+		if (pipe2(p, O_CLOEXEC | O_NONBLOCK) < 0) {
+			err(1, "pipe2");
+		}
+		run("pipe", p[0], p[1], pipe_size, write_size, run_bytes);
+
+		if ((p[0] = open(fifo_path,
+			 O_RDONLY | O_CLOEXEC | O_NONBLOCK)) < 0) {
+			err(1, "open");
+		}
+		if ((p[1] = open(fifo_path,
+			 O_WRONLY | O_CLOEXEC | O_NONBLOCK)) < 0) {
+			err(1, "open");
+		}
+		run("fifo", p[0], p[1], pipe_size, write_size, run_bytes);
+	}
+
+	(void)unlink(fifo_path);
+	(void)rmdir(tmpdir);
+
+	free(pipe_sizes);
+	if (write_sizes != default_write_sizes) {
+		free(write_sizes);
+	}
+
+	return (0);
+}
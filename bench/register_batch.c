@@ -0,0 +1,263 @@
+#include <sys/types.h>
+#include <sys/event.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench_util.h"
+#include "kq_changelist.h"
+
+#define EVENT_BATCH 1024
+
+struct result {
+	uint64_t add_ns;
+	uint64_t delete_ns;
+	uint64_t syscalls;
+};
+
+/* Registers the read end of 'p' for reading and the write end for writing. */
+static void
+set_pair(struct kevent kev[2], int const p[2], unsigned short flags)
+{
+	EV_SET(&kev[0], p[0], EVFILT_READ, flags, 0, 0, 0);
+	EV_SET(&kev[1], p[1], EVFILT_WRITE, flags, 0, 0, 0);
+}
+
+/* Harvests events until the queue is empty. */
+static void
+harvest(int kq, struct kevent *events, struct result *result)
+{
+	int n;
+
+	do {
+		n = kevent(kq, NULL, 0, events, EVENT_BATCH,
+		    &(struct timespec) { 0, 0 });
+		++result->syscalls;
+		if (n < 0) {
+			err(1, "kevent");
+		}
+	} while (n == EVENT_BATCH);
+}
+
+/* One kevent(2) call per pipe, like the tests and fifo-kqueue do it. */
+static void
+round_per_fd(int kq, int (*pipes)[2], size_t npipes, struct kevent *events,
+    struct result *result)
+{
+	struct kevent kev[2];
+	uint64_t start = bench_util_now_ns();
+
+	for (size_t i = 0; i < npipes; ++i) {
+		set_pair(kev, pipes[i], EV_ADD | EV_CLEAR);
+		if (kevent(kq, kev, 2, NULL, 0, NULL) < 0) {
+			err(1, "kevent");
+		}
+	}
+	result->syscalls += npipes;
+	harvest(kq, events, result);
+	result->add_ns += bench_util_now_ns() - start;
+
+	start = bench_util_now_ns();
+	for (size_t i = 0; i < npipes; ++i) {
+		set_pair(kev, pipes[i], EV_DELETE);
+		if (kevent(kq, kev, 2, NULL, 0, NULL) < 0) {
+			err(1, "kevent");
+		}
+	}
+	result->syscalls += npipes;
+	result->delete_ns += bench_util_now_ns() - start;
+}
+
+static void
+queue(struct kq_changelist *cl, int fd, short filter, unsigned short flags,
+    struct result *result)
+{
+	/* A full changelist is flushed with a kevent(2) call of its own. */
+	if (cl->nchanges == cl->capacity) {
+		++result->syscalls;
+	}
+	if (kq_changelist_add(cl, (uintptr_t)fd, filter, flags, 0, 0, NULL) <
+	    0) {
+		err(1, "kevent");
+	}
+}
+
+/*
+ * Queues all changes on a changelist of 'capacity' entries. The last batch
+ * of additions is submitted by the first harvest.
+ */
+static void
+round_batched(int kq, int (*pipes)[2], size_t npipes, int capacity,
+    struct kevent *events, struct result *result)
+{
+	struct kq_changelist cl;
+	uint64_t start;
+	int n;
+
+	if (kq_changelist_init(&cl, kq, capacity) < 0) {
+		err(1, "kq_changelist_init");
+	}
+
+	start = bench_util_now_ns();
+	for (size_t i = 0; i < npipes; ++i) {
+		queue(&cl, pipes[i][0], EVFILT_READ, EV_ADD | EV_CLEAR,
+		    result);
+		queue(&cl, pipes[i][1], EVFILT_WRITE, EV_ADD | EV_CLEAR,
+		    result);
+	}
+	n = kq_changelist_submit(&cl, events, EVENT_BATCH,
+	    &(struct timespec) { 0, 0 });
+	++result->syscalls;
+	if (n < 0) {
+		err(1, "kevent");
+	}
+	if (n == EVENT_BATCH) {
+		harvest(kq, events, result);
+	}
+	result->add_ns += bench_util_now_ns() - start;
+
+	start = bench_util_now_ns();
+	for (size_t i = 0; i < npipes; ++i) {
+		queue(&cl, pipes[i][0], EVFILT_READ, EV_DELETE, result);
+		queue(&cl, pipes[i][1], EVFILT_WRITE, EV_DELETE, result);
+	}
+	if (kq_changelist_submit(&cl, NULL, 0, NULL) < 0) {
+		err(1, "kevent");
+	}
+	++result->syscalls;
+	result->delete_ns += bench_util_now_ns() - start;
+
+	kq_changelist_fini(&cl);
+}
+
+static void
+report(char const *mode, int capacity, size_t npipes, unsigned rounds,
+    struct result const *result)
+{
+	double fds = (double)(npipes * 2 * rounds);
+
+	printf("%-8s %8d %8zu %12.1f %12.1f %14.1f\n", mode, capacity,
+	    npipes * 2, (double)result->add_ns / fds,
+	    (double)result->delete_ns / fds,
+	    (double)result->syscalls / rounds);
+	fflush(stdout);
+}
+
+static void
+usage(char const *progname)
+{
+	fprintf(stderr,
+	    "usage: %s [-n fds] [-r rounds] [batch_size...]\n", progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	int default_batch_sizes[] = { 2, 64, 1024, 16384 };
+	int *batch_sizes = default_batch_sizes;
+	size_t batch_sizes_count =
+	    sizeof(default_batch_sizes) / sizeof(default_batch_sizes[0]);
+	char const *progname = argv[0];
+	size_t npipes = 5000;
+	unsigned rounds = 10;
+	struct kevent *events;
+	int (*pipes)[2];
+	int ch;
+
+	while ((ch = getopt(argc, argv, "n:r:")) != -1) {
+		switch (ch) {
+		case 'n':
+			npipes = strtoul(optarg, NULL, 10) / 2;
+			break;
+		case 'r':
+			rounds = (unsigned)strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(progname);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (npipes == 0 || rounds == 0) {
+		usage(progname);
+	}
+
+	if (argc > 0) {
+		batch_sizes = calloc((size_t)argc, sizeof(int));
+		if (!batch_sizes) {
+			err(1, "calloc");
+		}
+		for (int i = 0; i < argc; ++i) {
+			batch_sizes[i] = (int)strtol(argv[i], NULL, 10);
+			if (batch_sizes[i] < 2) {
+				usage(progname);
+			}
+		}
+		batch_sizes_count = (size_t)argc;
+	}
+
+	if (!bench_util_fd_limit(npipes)) {
+		err(1, "setrlimit");
+	}
+
+	pipes = calloc(npipes, sizeof(*pipes));
+	events = calloc(EVENT_BATCH, sizeof(struct kevent));
+	if (!pipes || !events) {
+		err(1, "calloc");
+	}
+	for (size_t i = 0; i < npipes; ++i) {
+		if (pipe2(pipes[i], O_CLOEXEC | O_NONBLOCK) < 0) {
+			err(1, "pipe2");
+		}
+	}
+
+	printf("%-8s %8s %8s %12s %12s %14s\n", "mode", "batch", "fds",
+	    "add_ns/fd", "delete_ns/fd", "syscalls/round");
+
+	for (size_t i = 0; i <= batch_sizes_count; ++i) {
+		struct result result = { 0 };
+		int kq = kqueue();
+
+		if (kq < 0) {
+			err(1, "kqueue");
+		}
+
+		for (unsigned round = 0; round < rounds; ++round) {
+			if (i == 0) {
+				round_per_fd(kq, pipes, npipes, events,
+				    &result);
+			} else {
+				round_batched(kq, pipes, npipes,
+				    batch_sizes[i - 1], events, &result);
+			}
+		}
+
+		if (i == 0) {
+			report("per-fd", 2, npipes, rounds, &result);
+		} else {
+			report("batched", batch_sizes[i - 1], npipes, rounds,
+			    &result);
+		}
+
+		close(kq);
+	}
+
+	for (size_t i = 0; i < npipes; ++i) {
+		close(pipes[i][0]);
+		close(pipes[i][1]);
+	}
+	free(events);
+	free(pipes);
+	if (batch_sizes != default_batch_sizes) {
+		free(batch_sizes);
+	}
+
+	return (0);
+}
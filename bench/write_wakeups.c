@@ -0,0 +1,327 @@
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench_util.h"
+#include "pipe_size.h"
+
+/* Returns the number of pending EVFILT_WRITE events, without blocking. */
+static int
+poll_write(int kq, int64_t *data)
+{
+	struct kevent kev;
+	int n;
+
+	*data = 0;
+	n = kevent(kq, NULL, 0, &kev, 1, &(struct timespec) { 0, 0 });
+	if (n < 0) {
+		err(1, "kevent");
+	}
+	if (n == 1) {
+		if (kev.filter != EVFILT_WRITE) {
+			errx(1, "unexpected filter %d", kev.filter);
+		}
+		*data = (int64_t)kev.data;
+	}
+
+	return (n);
+}
+
+/*
+ * Fills the pipe until write(2) returns EAGAIN. Large writes come first, then
+ * single bytes top up the last partially filled page.
+ */
+static size_t
+fill(int fd)
+{
+	static char buf[64 * 1024];
+	size_t filled = 0;
+	size_t chunk = sizeof(buf);
+	ssize_t r;
+
+	for (;;) {
+		r = write(fd, buf, chunk);
+		if (r < 0) {
+			if (errno != EAGAIN) {
+				err(1, "write");
+			}
+			if (chunk == 1) {
+				break;
+			}
+			chunk = 1;
+			continue;
+		}
+		filled += (size_t)r;
+	}
+
+	return (filled);
+}
+
+struct summary {
+	size_t reads;
+	size_t wakeups;
+	int64_t data_min;
+	int64_t data_max;
+	uint64_t interval_ns_sum;
+};
+
+/*
+ * Drains 'filled' bytes in reads of 'read_size' bytes, checking for an
+ * EVFILT_WRITE after every read(2). Unless 'quiet' is set, every wakeup is
+ * printed as one CSV row.
+ */
+static void
+drain(char const *transport, int fd, int kq, size_t filled, size_t read_size,
+    unsigned round, char *buf, bool quiet, struct summary *summary)
+{
+	size_t drained = 0;
+	uint64_t start, previous;
+
+	start = previous = bench_util_now_ns();
+
+	while (drained < filled) {
+		size_t n = filled - drained < read_size ? filled - drained
+							: read_size;
+		ssize_t r = read(fd, buf, n);
+		int64_t data;
+
+		if (r < 0) {
+			err(1, "read");
+		}
+		if (r == 0) {
+			errx(1, "unexpected EOF");
+		}
+		drained += (size_t)r;
+		++summary->reads;
+
+		if (poll_write(kq, &data) == 0) {
+			continue;
+		}
+
+		uint64_t now = bench_util_now_ns();
+
+		++summary->wakeups;
+		if (summary->wakeups == 1 || data < summary->data_min) {
+			summary->data_min = data;
+		}
+		if (summary->wakeups == 1 || data > summary->data_max) {
+			summary->data_max = data;
+		}
+		summary->interval_ns_sum += now - previous;
+
+		if (!quiet) {
+			printf("%s,%zu,%u,%zu,%zu,%lld,%llu,%llu\n", transport,
+			    read_size, round, summary->wakeups, drained,
+			    (long long)data,
+			    (unsigned long long)(now - previous),
+			    (unsigned long long)(now - start));
+		}
+		previous = now;
+	}
+}
+
+static void
+usage(char const *progname)
+{
+	fprintf(stderr,
+	    "usage: %s [-p] [-s] [-c pipe_size] [-r rounds] [-d dir] "
+	    "[read_size...]\n",
+	    progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t default_read_sizes[] = { 1, 512, PIPE_BUF - 1, PIPE_BUF,
+		PIPE_BUF + 1, 8192, 16384, 65536 };
+	size_t *read_sizes = default_read_sizes;
+	size_t read_sizes_count =
+	    sizeof(default_read_sizes) / sizeof(default_read_sizes[0]);
+	size_t max_read_size = 0;
+	char const *progname = argv[0];
+	char const *dir = NULL;
+	char const *transport = "fifo";
+	bool use_pipe = false;
+	bool summary_only = false;
+	unsigned rounds = 10;
+	long pipe_size = 0;
+	char tmpdir[PATH_MAX];
+	char fifo_path[PATH_MAX];
+	int p[2];
+	int ch;
+
+	while ((ch = getopt(argc, argv, "c:d:pr:s")) != -1) {
+		switch (ch) {
+		case 'c':
+			pipe_size = strtol(optarg, NULL, 10);
+			if (pipe_size <= 0) {
+				usage(progname);
+			}
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 'p':
+			transport = "pipe";
+			use_pipe = true;
+			break;
+		case 'r':
+			rounds = (unsigned)strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			summary_only = true;
+			break;
+		default:
+			usage(progname);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (rounds == 0) {
+		usage(progname);
+	}
+
+	if (argc > 0) {
+		read_sizes = calloc((size_t)argc, sizeof(size_t));
+		if (!read_sizes) {
+			err(1, "calloc");
+		}
+		for (int i = 0; i < argc; ++i) {
+			read_sizes[i] = strtoul(argv[i], NULL, 10);
+			if (read_sizes[i] == 0) {
+				usage(progname);
+			}
+		}
+		read_sizes_count = (size_t)argc;
+	}
+	for (size_t i = 0; i < read_sizes_count; ++i) {
+		if (read_sizes[i] > max_read_size) {
+			max_read_size = read_sizes[i];
+		}
+	}
+
+	char *buf = malloc(max_read_size);
+	if (!buf) {
+		err(1, "malloc");
+	}
+
+	tmpdir[0] = '\0';
+	if (use_pipe) {
+		if (pipe2(p, O_CLOEXEC | O_NONBLOCK) < 0) {
+			err(1, "pipe2");
+		}
+	} else {
+		if (!dir) {
+			dir = getenv("TMPDIR");
+		}
+		(void)snprintf(tmpdir, sizeof(tmpdir),
+		    "%s/write-wakeups.XXXXXX", dir ? dir : "/tmp");
+		if (!mkdtemp(tmpdir)) {
+			err(1, "mkdtemp");
+		}
+		if ((size_t)snprintf(fifo_path, sizeof(fifo_path), "%s/fifo",
+			tmpdir) >= sizeof(fifo_path)) {
+			errx(1, "%s: path too long", tmpdir);
+		}
+		if (mkfifo(fifo_path, 0600) < 0) {
+			err(1, "mkfifo");
+		}
+		if ((p[0] = open(fifo_path,
+			 O_RDONLY | O_CLOEXEC | O_NONBLOCK)) < 0) {
+			err(1, "open");
+		}
+		if ((p[1] = open(fifo_path,
+			 O_WRONLY | O_CLOEXEC | O_NONBLOCK)) < 0) {
+			err(1, "open");
+		}
+	}
+
+	/* The capacity column shows what the kernel made of the size. */
+	if (pipe_size > 0 && pipe_size_set(p[1], pipe_size) < 0) {
+		err(1, "cannot resize the %s to %ld bytes", transport,
+		    pipe_size);
+	}
+
+	int kq = kqueue();
+	if (kq < 0) {
+		err(1, "kqueue");
+	}
+
+	struct kevent kev;
+	EV_SET(&kev, p[1], EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, 0);
+	if (kevent(kq, &kev, 1, NULL, 0, NULL) < 0) {
+		err(1, "kevent");
+	}
+
+	if (summary_only) {
+		printf("transport,read_size,rounds,capacity,reads,wakeups,"
+		       "wakeups_per_mb,data_min,data_max,interval_ns_mean\n");
+	} else {
+		printf("transport,read_size,round,wakeup,drained,data,"
+		       "interval_ns,elapsed_ns\n");
+	}
+
+	for (size_t i = 0; i < read_sizes_count; ++i) {
+		struct summary summary = { 0 };
+		size_t drained_total = 0;
+		size_t filled = 0;
+
+		for (unsigned round = 0; round < rounds; ++round) {
+			int64_t data;
+
+			filled = fill(p[1]);
+
+			/* Consume the EVFILT_WRITE left over from the fill. */
+			(void)poll_write(kq, &data);
+			if (poll_write(kq, &data) != 0) {
+				errx(1, "EVFILT_WRITE on a full %s",
+				    transport);
+			}
+
+			drain(transport, p[0], kq, filled, read_sizes[i],
+			    round, buf, summary_only, &summary);
+			drained_total += filled;
+		}
+
+		if (summary_only) {
+			printf("%s,%zu,%u,%zu,%zu,%zu,%.1f,%lld,%lld,%.0f\n",
+			    transport, read_sizes[i], rounds, filled,
+			    summary.reads, summary.wakeups,
+			    (double)summary.wakeups /
+				((double)drained_total / (1024.0 * 1024.0)),
+			    (long long)summary.data_min,
+			    (long long)summary.data_max,
+			    summary.wakeups
+				? (double)summary.interval_ns_sum /
+				    (double)summary.wakeups
+				: 0.0);
+		}
+	}
+
+	close(kq);
+	close(p[0]);
+	close(p[1]);
+	if (tmpdir[0] != '\0') {
+		(void)unlink(fifo_path);
+		(void)rmdir(tmpdir);
+	}
+	free(buf);
+	if (read_sizes != default_read_sizes) {
+		free(read_sizes);
+	}
+
+	return (0);
+}
@@ -0,0 +1,1300 @@
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sys/event.h"
+
+/*
+ * kqueue(2) on top of epoll(7), following FreeBSD's pipe and FIFO filters
+ * closely enough for the tests and fifo-kqueue's scenarios.
+ *
+ * A kqueue is an epoll descriptor. Every descriptor with knotes is
+ * registered once, edge-triggered, for both directions. Linux does not wake
+ * epoll for every change FreeBSD activates knotes on: a partial read
+ * changes 'data' without a wakeup, and writers are only woken once a read
+ * empties a full pipe, never by their own writes. So pipe and FIFO ends
+ * also get an inotify(7) watch on reads, writes, opens and closes, which
+ * activates them on I/O through any descriptor. Harvesting only evaluates
+ * descriptors on the kqueue's active list: those epoll or inotify reported
+ * since the last harvest, and level-triggered knotes that were true when
+ * last evaluated. A harvest is O(ready).
+ *
+ * FreeBSD activates all knotes of a pipe on any read or write, and those of
+ * a FIFO also when its first reader or writer comes or its last one goes.
+ * An EV_CLEAR knote is reported whenever it is activated and true. Here,
+ * being reported by epoll or inotify counts as activation, except at EOF:
+ * then only opens and closes can happen, and Linux wakes epoll for those
+ * where FreeBSD does not. For FIFO ends, inotify also tells which epoll
+ * wakeups were for the other side coming or going. A FIFO read end that
+ * has not seen the writers go yet may take a reader's open for a writer's,
+ * or the reverse when inotify merged two opens.
+ *
+ * Ends without a watch, e.g. once inotify runs out of them, fall back to
+ * polling: their knotes that were true when last evaluated and EVFILT_WRITE
+ * on their write ends are evaluated on every harvest, and reported if their
+ * 'data' or EV_EOF changed. A write and a read of the same size between two
+ * harvests go unnoticed then.
+ *
+ * EVFILT_VNODE is an inotify(7) watch on /proc/self/fd/N. inotify only
+ * reports IN_ATTRIB when the link count changes, so NOTE_LINK and
+ * NOTE_DELETE are told apart by comparing st_nlink.
+ *
+ * Unlike on FreeBSD, closing a descriptor does not remove its knotes;
+ * EV_DELETE them first. Knotes of closed descriptors are dropped when they
+ * are next evaluated, also if the number was reused for another file by
+ * then.
+ */
+
+#ifndef PIPEFS_MAGIC
+#define PIPEFS_MAGIC 0x50495045
+#endif
+
+#define EPOLL_BATCH 256
+#define INOTIFY_TOKEN UINT64_MAX
+#define INOTIFY_MASK_FIFO (IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+#define INOTIFY_MASK (INOTIFY_MASK_FIFO | IN_MODIFY)
+#define INOTIFY_MASK_IO (IN_MODIFY | IN_ACCESS | IN_OPEN | IN_CLOSE)
+
+enum fd_kind {
+	FD_OTHER,
+	FD_PIPE_READ,
+	FD_PIPE_WRITE,
+	FD_FIFO_READ,
+	FD_FIFO_WRITE,
+};
+
+/*
+ * Knote slots of a descriptor, in the order their events are returned.
+ * FreeBSD activates EVFILT_WRITE before EVFILT_READ when a pipe closes.
+ */
+enum slot {
+	SLOT_WRITE,
+	SLOT_READ,
+	SLOT_VNODE,
+	NSLOTS,
+};
+
+struct knote {
+	struct kevent kev;	/* without EV_ADD and the other actions */
+	bool disabled;
+	bool armed;		/* false since it was last reported */
+	bool last_eof;
+	int64_t last_data;
+	int wd;			/* EVFILT_VNODE: inotify watch */
+	uint32_t mask;		/* EVFILT_VNODE: inotify events it watches */
+	unsigned int pending;	/* EVFILT_VNODE: NOTE_* not yet reported */
+	nlink_t nlink;
+	off_t size;
+};
+
+struct kfd {
+	int fd;
+	dev_t dev;
+	ino_t ino;
+	enum fd_kind kind;
+	bool in_epoll;
+	bool no_epoll;		/* epoll refused it, e.g. a regular file */
+	bool queued;
+	int io_wd;		/* pipe and FIFO ends: inotify watch, or -1 */
+	bool io;		/* read or written since the last evaluation */
+	unsigned int fifo_opens;	/* since then, less reader closes */
+	unsigned int fifo_closes[2];	/* since then, by readers, writers */
+	bool fifo_gone;		/* no other side when last evaluated */
+	bool fifo_seen_gone;	/* a read end saw the writers go */
+	bool woken;		/* epoll reported it since the last harvest */
+	uint32_t revents;	/* what epoll reported in scan 'woken_scan' */
+	unsigned long woken_scan;
+	struct kfd *prev;	/* active list */
+	struct kfd *next;
+	struct knote *knotes[NSLOTS];
+};
+
+struct kq {
+	pthread_mutex_t mutex;
+	int epfd;
+	dev_t dev;		/* of 'epfd', to notice it was closed */
+	ino_t ino;
+	int inotify_fd;
+	struct kfd **fds;	/* indexed by descriptor */
+	size_t nfds;
+	struct kfd **vnodes;	/* descriptors with an EVFILT_VNODE knote */
+	size_t nvnodes;
+	struct kfd **watched;	/* ends with an 'io_wd', sorted by it */
+	size_t nwatched;
+	struct kfd *head;	/* active list */
+	struct kfd *tail;
+	size_t nactive;
+	unsigned long scans;
+};
+
+/* Filter state of a descriptor, fetched lazily once per evaluation. */
+struct fd_state {
+	bool polled;
+	bool have_nread;
+	short revents;
+	int nread;
+};
+
+/* kqueues by epoll descriptor. */
+static pthread_mutex_t kqs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct kq **kqs;
+static size_t nkqs;
+
+static void
+queue_kfd(struct kq *kq, struct kfd *kfd)
+{
+	if (kfd->queued) {
+		return;
+	}
+	kfd->queued = true;
+	kfd->next = NULL;
+	kfd->prev = kq->tail;
+	if (kq->tail) {
+		kq->tail->next = kfd;
+	} else {
+		kq->head = kfd;
+	}
+	kq->tail = kfd;
+	++kq->nactive;
+}
+
+static void
+unqueue_kfd(struct kq *kq, struct kfd *kfd)
+{
+	if (!kfd->queued) {
+		return;
+	}
+	kfd->queued = false;
+	if (kfd->prev) {
+		kfd->prev->next = kfd->next;
+	} else {
+		kq->head = kfd->next;
+	}
+	if (kfd->next) {
+		kfd->next->prev = kfd->prev;
+	} else {
+		kq->tail = kfd->prev;
+	}
+	--kq->nactive;
+}
+
+/* The first of the watched ends with watch 'wd', or where it would go. */
+static size_t
+first_watched(struct kq const *kq, int wd)
+{
+	size_t lo = 0, hi = kq->nwatched;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (kq->watched[mid]->io_wd < wd) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return (lo);
+}
+
+/*
+ * inotify has one watch per inode, shared by the EVFILT_VNODE knotes and the
+ * pipe and FIFO ends on it. Removes it once nothing uses it any more.
+ */
+static void
+release_watch(struct kq *kq, int wd)
+{
+	size_t i;
+
+	for (i = 0; i < kq->nvnodes; ++i) {
+		if (kq->vnodes[i]->knotes[SLOT_VNODE]->wd == wd) {
+			return;
+		}
+	}
+	i = first_watched(kq, wd);
+	if (i < kq->nwatched && kq->watched[i]->io_wd == wd) {
+		return;
+	}
+	(void)inotify_rm_watch(kq->inotify_fd, wd);
+}
+
+static void
+remove_vnode(struct kq *kq, struct kfd *kfd)
+{
+	for (size_t i = 0; i < kq->nvnodes; ++i) {
+		if (kq->vnodes[i] == kfd) {
+			kq->vnodes[i] = kq->vnodes[--kq->nvnodes];
+			break;
+		}
+	}
+	release_watch(kq, kfd->knotes[SLOT_VNODE]->wd);
+}
+
+static void
+unwatch_io(struct kq *kq, struct kfd *kfd)
+{
+	int wd = kfd->io_wd;
+
+	for (size_t i = 0; i < kq->nwatched; ++i) {
+		if (kq->watched[i] == kfd) {
+			memmove(&kq->watched[i], &kq->watched[i + 1],
+			    (--kq->nwatched - i) * sizeof(*kq->watched));
+			break;
+		}
+	}
+	kfd->io_wd = -1;
+	release_watch(kq, wd);
+}
+
+static void
+free_knote(struct kq *kq, struct kfd *kfd, enum slot slot)
+{
+	if (slot == SLOT_VNODE) {
+		remove_vnode(kq, kfd);
+	}
+	free(kfd->knotes[slot]);
+	kfd->knotes[slot] = NULL;
+
+	if (kfd->in_epoll && !kfd->knotes[SLOT_READ] &&
+	    !kfd->knotes[SLOT_WRITE]) {
+		/* Fails with EBADF if the descriptor is already closed. */
+		(void)epoll_ctl(kq->epfd, EPOLL_CTL_DEL, kfd->fd, NULL);
+		kfd->in_epoll = false;
+	}
+	if (kfd->io_wd >= 0 && !kfd->knotes[SLOT_READ] &&
+	    !kfd->knotes[SLOT_WRITE]) {
+		unwatch_io(kq, kfd);
+	}
+}
+
+static void
+free_kfd(struct kq *kq, struct kfd *kfd)
+{
+	for (int slot = 0; slot < NSLOTS; ++slot) {
+		if (kfd->knotes[slot]) {
+			free_knote(kq, kfd, (enum slot)slot);
+		}
+	}
+	unqueue_kfd(kq, kfd);
+	kq->fds[kfd->fd] = NULL;
+	free(kfd);
+}
+
+static void
+free_kq(struct kq *kq)
+{
+	for (size_t i = 0; i < kq->nfds; ++i) {
+		struct kfd *kfd = kq->fds[i];
+
+		if (kfd) {
+			for (int slot = 0; slot < NSLOTS; ++slot) {
+				free(kfd->knotes[slot]);
+			}
+			free(kfd);
+		}
+	}
+	if (kq->inotify_fd >= 0) {
+		close(kq->inotify_fd);
+	}
+	pthread_mutex_destroy(&kq->mutex);
+	free(kq->vnodes);
+	free(kq->watched);
+	free(kq->fds);
+	free(kq);
+}
+
+/*
+ * Closing a kqueue is close(2) on its epoll descriptor, which we do not see.
+ * A kqueue is gone if its descriptor is closed or refers to another file.
+ * All epoll descriptors share one anonymous inode, though, so a kqueue whose
+ * number went to another epoll instance or an eventfd is not noticed here;
+ * if it went to a new kqueue, kqueue() replaces it.
+ */
+static bool
+kq_alive(struct kq const *kq)
+{
+	struct stat st;
+
+	return (fstat(kq->epfd, &st) == 0 && st.st_dev == kq->dev &&
+	    st.st_ino == kq->ino);
+}
+
+int
+kqueue(void)
+{
+	struct kq *kq, *stale = NULL;
+	struct stat st;
+	int epfd;
+
+	if (!(kq = calloc(1, sizeof(*kq)))) {
+		return (-1);
+	}
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		free(kq);
+		return (-1);
+	}
+	if (fstat(epfd, &st) < 0) {
+		close(epfd);
+		free(kq);
+		return (-1);
+	}
+	kq->epfd = epfd;
+	kq->dev = st.st_dev;
+	kq->ino = st.st_ino;
+	kq->inotify_fd = -1;
+	pthread_mutex_init(&kq->mutex, NULL);
+
+	pthread_mutex_lock(&kqs_mutex);
+	if ((size_t)epfd >= nkqs) {
+		size_t n = nkqs ? nkqs : 64;
+		struct kq **p;
+
+		while (n <= (size_t)epfd) {
+			n *= 2;
+		}
+		if (!(p = realloc(kqs, n * sizeof(*p)))) {
+			pthread_mutex_unlock(&kqs_mutex);
+			close(epfd);
+			free_kq(kq);
+			errno = ENOMEM;
+			return (-1);
+		}
+		memset(p + nkqs, 0, (n - nkqs) * sizeof(*p));
+		kqs = p;
+		nkqs = n;
+	}
+	/* Free closed kqueues, so that their inotify descriptors go, too. */
+	for (size_t i = 0; i < nkqs; ++i) {
+		if (kqs[i] && i != (size_t)epfd && !kq_alive(kqs[i])) {
+			free_kq(kqs[i]);
+			kqs[i] = NULL;
+		}
+	}
+	/* A kqueue that was closed without us noticing left this behind. */
+	stale = kqs[epfd];
+	kqs[epfd] = kq;
+	pthread_mutex_unlock(&kqs_mutex);
+
+	if (stale) {
+		free_kq(stale);
+	}
+	return (epfd);
+}
+
+static struct kq *
+lookup_kq(int kqfd)
+{
+	struct kq *kq = NULL, *stale = NULL;
+
+	pthread_mutex_lock(&kqs_mutex);
+	if (kqfd >= 0 && (size_t)kqfd < nkqs && (kq = kqs[kqfd]) &&
+	    !kq_alive(kq)) {
+		stale = kq;
+		kqs[kqfd] = kq = NULL;
+	}
+	pthread_mutex_unlock(&kqs_mutex);
+
+	if (stale) {
+		free_kq(stale);
+	}
+	return (kq);
+}
+
+static enum fd_kind
+classify(int fd, struct stat const *st)
+{
+	struct statfs sfs;
+	bool pipe;
+	int fl;
+
+	if (!S_ISFIFO(st->st_mode) || (fl = fcntl(fd, F_GETFL)) < 0) {
+		return (FD_OTHER);
+	}
+	pipe = fstatfs(fd, &sfs) == 0 && sfs.f_type == PIPEFS_MAGIC;
+	switch (fl & O_ACCMODE) {
+	case O_RDONLY:
+		return (pipe ? FD_PIPE_READ : FD_FIFO_READ);
+	case O_WRONLY:
+		return (pipe ? FD_PIPE_WRITE : FD_FIFO_WRITE);
+	default:
+		return (FD_OTHER);
+	}
+}
+
+static struct kfd *
+get_kfd(struct kq *kq, int fd, struct stat const *st)
+{
+	struct kfd *kfd;
+
+	if ((size_t)fd >= kq->nfds) {
+		size_t n = kq->nfds ? kq->nfds : 64;
+		struct kfd **p;
+
+		while (n <= (size_t)fd) {
+			n *= 2;
+		}
+		if (!(p = realloc(kq->fds, n * sizeof(*p)))) {
+			return (NULL);
+		}
+		memset(p + kq->nfds, 0, (n - kq->nfds) * sizeof(*p));
+		kq->fds = p;
+		kq->nfds = n;
+	}
+
+	kfd = kq->fds[fd];
+	if (kfd && (kfd->dev != st->st_dev || kfd->ino != st->st_ino)) {
+		/* The descriptor was closed and reused. */
+		free_kfd(kq, kfd);
+		kfd = NULL;
+	}
+	if (!kfd) {
+		if (!(kfd = calloc(1, sizeof(*kfd)))) {
+			return (NULL);
+		}
+		kfd->fd = fd;
+		kfd->dev = st->st_dev;
+		kfd->ino = st->st_ino;
+		kfd->kind = classify(fd, st);
+		kfd->io_wd = -1;
+		kq->fds[fd] = kfd;
+	}
+	return (kfd);
+}
+
+static int
+watch_epoll(struct kq *kq, struct kfd *kfd)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+		.data.u64 = (uint64_t)kfd->fd,
+	};
+
+	if (kfd->in_epoll || kfd->no_epoll) {
+		return (0);
+	}
+	if (epoll_ctl(kq->epfd, EPOLL_CTL_ADD, kfd->fd, &ev) < 0) {
+		if (errno != EPERM) {
+			return (errno);
+		}
+		kfd->no_epoll = true;
+		return (0);
+	}
+	kfd->in_epoll = true;
+	return (0);
+}
+
+static int
+open_inotify(struct kq *kq)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.u64 = INOTIFY_TOKEN,
+	};
+	int ifd;
+
+	if (kq->inotify_fd >= 0) {
+		return (0);
+	}
+	if ((ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+		return (errno);
+	}
+	if (epoll_ctl(kq->epfd, EPOLL_CTL_ADD, ifd, &ev) < 0) {
+		int error = errno;
+
+		close(ifd);
+		return (error);
+	}
+	kq->inotify_fd = ifd;
+	return (0);
+}
+
+/*
+ * Watches a pipe or FIFO end for reads, writes, opens and closes through
+ * any descriptor. This queues the end on I/O, which Linux does not always
+ * wake epoll for, and tells which epoll wakeups of a FIFO FreeBSD would
+ * activate knotes on. This is best effort: without a watch, e.g. once
+ * inotify runs out of them, the end is polled on every harvest instead.
+ */
+static void
+watch_io(struct kq *kq, struct kfd *kfd)
+{
+	char path[64];
+	struct kfd **p;
+	size_t i;
+
+	if (kfd->kind == FD_OTHER || kfd->io_wd >= 0 ||
+	    open_inotify(kq) != 0) {
+		return;
+	}
+	if (!(p = realloc(kq->watched, (kq->nwatched + 1) * sizeof(*p)))) {
+		return;
+	}
+	kq->watched = p;
+
+	(void)snprintf(path, sizeof(path), "/proc/self/fd/%d", kfd->fd);
+	kfd->io_wd = inotify_add_watch(kq->inotify_fd, path,
+	    INOTIFY_MASK_IO | IN_MASK_ADD);
+	if (kfd->io_wd >= 0) {
+		i = first_watched(kq, kfd->io_wd);
+		memmove(&kq->watched[i + 1], &kq->watched[i],
+		    (kq->nwatched - i) * sizeof(*kq->watched));
+		kq->watched[i] = kfd;
+		++kq->nwatched;
+	}
+}
+
+static int
+watch_inotify(struct kq *kq, struct kfd *kfd, struct stat const *st,
+    struct knote *kn)
+{
+	char path[64];
+	struct kfd **p;
+	int error;
+
+	if (kfd->kind == FD_PIPE_READ || kfd->kind == FD_PIPE_WRITE ||
+	    S_ISSOCK(st->st_mode)) {
+		return (EINVAL);
+	}
+	if ((error = open_inotify(kq)) != 0) {
+		return (error);
+	}
+	if (!(p = realloc(kq->vnodes, (kq->nvnodes + 1) * sizeof(*p)))) {
+		return (ENOMEM);
+	}
+	kq->vnodes = p;
+
+	/* IN_MASK_ADD keeps what pipe and FIFO ends watch on the inode. */
+	kn->mask = S_ISFIFO(st->st_mode) ? INOTIFY_MASK_FIFO : INOTIFY_MASK;
+	(void)snprintf(path, sizeof(path), "/proc/self/fd/%d", kfd->fd);
+	kn->wd = inotify_add_watch(kq->inotify_fd, path,
+	    kn->mask | IN_MASK_ADD);
+	if (kn->wd < 0) {
+		return (errno);
+	}
+	kn->nlink = st->st_nlink;
+	kn->size = st->st_size;
+	kq->vnodes[kq->nvnodes++] = kfd;
+	return (0);
+}
+
+/*
+ * FreeBSD refuses EVFILT_WRITE on a pipe whose other end is already gone.
+ * FIFOs are exempt, their ends may come and go.
+ */
+static int
+check_pipe_write(struct kfd const *kfd)
+{
+	struct pollfd pfd = { .fd = kfd->fd, .events = POLLOUT };
+
+	if (kfd->kind != FD_PIPE_READ && kfd->kind != FD_PIPE_WRITE) {
+		return (0);
+	}
+	if (poll(&pfd, 1, 0) < 0) {
+		return (errno);
+	}
+	return ((pfd.revents & (POLLHUP | POLLERR)) ? EPIPE : 0);
+}
+
+static int
+add_knote(struct kq *kq, struct kevent const *kev, enum slot slot)
+{
+	int fd = (int)kev->ident;
+	struct knote *kn;
+	struct kfd *kfd;
+	struct stat st;
+	int error;
+
+	if (fstat(fd, &st) < 0) {
+		return (errno);
+	}
+	if (!(kfd = get_kfd(kq, fd, &st))) {
+		return (ENOMEM);
+	}
+
+	if ((kn = kfd->knotes[slot])) {
+		kn->kev.fflags = kev->fflags;
+		kn->kev.data = kev->data;
+		kn->kev.udata = kev->udata;
+		queue_kfd(kq, kfd);
+		return (0);
+	}
+
+	if (slot == SLOT_WRITE && (error = check_pipe_write(kfd)) != 0) {
+		goto out;
+	}
+	if (!(kn = calloc(1, sizeof(*kn)))) {
+		error = ENOMEM;
+		goto out;
+	}
+	kn->kev = *kev;
+	kn->kev.flags &= (unsigned short)~(EV_ADD | EV_DELETE | EV_ENABLE |
+	    EV_DISABLE);
+	kn->disabled = (kev->flags & EV_DISABLE) != 0;
+	kn->armed = true;
+	error = slot == SLOT_VNODE ? watch_inotify(kq, kfd, &st, kn) :
+				     watch_epoll(kq, kfd);
+	if (error != 0) {
+		free(kn);
+		goto out;
+	}
+	kfd->knotes[slot] = kn;
+	if (slot != SLOT_VNODE) {
+		watch_io(kq, kfd);
+	}
+	queue_kfd(kq, kfd);
+
+out:
+	if (!kfd->knotes[SLOT_READ] && !kfd->knotes[SLOT_WRITE] &&
+	    !kfd->knotes[SLOT_VNODE]) {
+		free_kfd(kq, kfd);
+	}
+	return (error);
+}
+
+static int
+apply_change(struct kq *kq, struct kevent const *kev)
+{
+	struct knote *kn = NULL;
+	struct kfd *kfd = NULL;
+	enum slot slot;
+	int error;
+
+	switch (kev->filter) {
+	case EVFILT_READ:
+		slot = SLOT_READ;
+		break;
+	case EVFILT_WRITE:
+		slot = SLOT_WRITE;
+		break;
+	case EVFILT_VNODE:
+		slot = SLOT_VNODE;
+		break;
+	default:
+		return (EINVAL);
+	}
+	if (kev->ident > INT_MAX) {
+		return (EBADF);
+	}
+
+	if (kev->flags & EV_ADD) {
+		if ((error = add_knote(kq, kev, slot)) != 0) {
+			return (error);
+		}
+	}
+
+	if (kev->ident < kq->nfds && (kfd = kq->fds[kev->ident])) {
+		kn = kfd->knotes[slot];
+	}
+	if (!kn) {
+		return (ENOENT);
+	}
+
+	if (kev->flags & EV_DELETE) {
+		free_knote(kq, kfd, slot);
+		if (!kfd->knotes[SLOT_READ] && !kfd->knotes[SLOT_WRITE] &&
+		    !kfd->knotes[SLOT_VNODE]) {
+			free_kfd(kq, kfd);
+		}
+		return (0);
+	}
+	if (kev->flags & EV_DISABLE) {
+		kn->disabled = true;
+	}
+	if (kev->flags & EV_ENABLE) {
+		kn->disabled = false;
+		queue_kfd(kq, kfd);
+	}
+	return (0);
+}
+
+static unsigned int
+vnode_notes(struct kfd *kfd, struct knote *kn, uint32_t mask)
+{
+	unsigned int notes = 0;
+	struct stat st;
+
+	if (mask & IN_DELETE_SELF) {
+		notes |= NOTE_DELETE;
+	}
+	if (mask & IN_MOVE_SELF) {
+		notes |= NOTE_RENAME;
+	}
+	if ((mask & (IN_ATTRIB | IN_MODIFY)) && fstat(kfd->fd, &st) == 0) {
+		if ((mask & IN_ATTRIB) && st.st_nlink > kn->nlink) {
+			notes |= NOTE_LINK;
+		} else if ((mask & IN_ATTRIB) && st.st_nlink < kn->nlink) {
+			notes |= NOTE_DELETE;
+		} else if (mask & IN_ATTRIB) {
+			notes |= NOTE_ATTRIB;
+		}
+		if ((mask & IN_MODIFY) && st.st_size > kn->size) {
+			notes |= NOTE_WRITE | NOTE_EXTEND;
+		} else if (mask & IN_MODIFY) {
+			notes |= NOTE_WRITE;
+		}
+		kn->nlink = st.st_nlink;
+		kn->size = st.st_size;
+	}
+	return (notes & kn->kev.fflags);
+}
+
+/*
+ * Hands an event to the ends watching it. The watched ends are sorted by
+ * watch, so only those that saw the event are looked at. Ends that were
+ * read or written are polled afresh, as the I/O may be newer than what
+ * epoll reported.
+ */
+static void
+io_event(struct kq *kq, struct inotify_event const *ev)
+{
+	for (size_t i = first_watched(kq, ev->wd);
+	     i < kq->nwatched && kq->watched[i]->io_wd == ev->wd; ++i) {
+		struct kfd *kfd = kq->watched[i];
+
+		kfd->io |= (ev->mask & (IN_MODIFY | IN_ACCESS)) != 0;
+		if (ev->mask & IN_OPEN) {
+			++kfd->fifo_opens;
+		}
+		if (ev->mask & IN_CLOSE_NOWRITE) {
+			++kfd->fifo_closes[0];
+			if (kfd->fifo_opens > 0) {
+				--kfd->fifo_opens;
+			}
+		}
+		if (ev->mask & IN_CLOSE_WRITE) {
+			++kfd->fifo_closes[1];
+		}
+		if (kfd->io) {
+			kfd->woken_scan = kq->scans - 1;
+		}
+		queue_kfd(kq, kfd);
+	}
+}
+
+/* After an overflow, all watched ends count as read and written. */
+static void
+io_overflow(struct kq *kq)
+{
+	for (size_t i = 0; i < kq->nwatched; ++i) {
+		kq->watched[i]->io = true;
+		kq->watched[i]->woken_scan = kq->scans - 1;
+		queue_kfd(kq, kq->watched[i]);
+	}
+}
+
+static void
+read_inotify(struct kq *kq)
+{
+	char buf[4096]
+	    __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t n;
+
+	while ((n = read(kq->inotify_fd, buf, sizeof(buf))) > 0) {
+		for (char *p = buf; p < buf + n;) {
+			struct inotify_event const *ev = (void *)p;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				io_overflow(kq);
+			} else if (ev->mask & INOTIFY_MASK_IO) {
+				io_event(kq, ev);
+			}
+			for (size_t i = 0; i < kq->nvnodes; ++i) {
+				struct kfd *kfd = kq->vnodes[i];
+				struct knote *kn = kfd->knotes[SLOT_VNODE];
+				unsigned int notes;
+
+				if (kn->wd != ev->wd ||
+				    !(ev->mask & kn->mask)) {
+					continue;
+				}
+				notes = vnode_notes(kfd, kn,
+				    ev->mask & kn->mask);
+				if (notes != 0) {
+					kn->pending |= notes;
+					queue_kfd(kq, kfd);
+				}
+			}
+			p += sizeof(*ev) + ev->len;
+		}
+		/*
+		 * The inotify descriptor is level-triggered in epoll, so a
+		 * read that had room for more saves the one failing with
+		 * EAGAIN.
+		 */
+		if ((size_t)n + sizeof(struct inotify_event) + NAME_MAX + 1 <=
+		    sizeof(buf)) {
+			break;
+		}
+	}
+}
+
+static void
+mark_ready(struct kq *kq, struct epoll_event const *evs, int n)
+{
+	for (int i = 0; i < n; ++i) {
+		uint64_t token = evs[i].data.u64;
+
+		if (token == INOTIFY_TOKEN) {
+			read_inotify(kq);
+		} else if (token < kq->nfds && kq->fds[token]) {
+			struct kfd *kfd = kq->fds[token];
+
+			kfd->woken = true;
+			kfd->revents = evs[i].events;
+			kfd->woken_scan = kq->scans;
+			queue_kfd(kq, kfd);
+		}
+	}
+}
+
+static bool
+fetch_state(struct kfd const *kfd, struct fd_state *state, bool need_nread)
+{
+	if (!state->polled) {
+		struct pollfd pfd = {
+			.fd = kfd->fd,
+			.events = POLLIN | POLLOUT | POLLRDHUP,
+		};
+
+		if (poll(&pfd, 1, 0) < 0 || (pfd.revents & POLLNVAL)) {
+			return (false);
+		}
+		state->polled = true;
+		state->revents = pfd.revents;
+	}
+	if (need_nread && !state->have_nread) {
+		if (ioctl(kfd->fd, FIONREAD, &state->nread) < 0) {
+			state->nread = 0;
+		}
+		state->have_nread = true;
+	}
+	return (true);
+}
+
+/*
+ * Evaluates a read or write filter like FreeBSD's filt_piperead() and
+ * filt_pipewrite(). Returns false if the descriptor is gone.
+ */
+static bool
+eval_filter(struct kfd const *kfd, struct knote const *kn, enum slot slot,
+    struct fd_state *state, bool *cond, int64_t *data, unsigned short *flags)
+{
+	bool lowat = (kn->kev.fflags & NOTE_LOWAT) != 0;
+	bool nodata = (kn->kev.fflags & NOTE_NODATA) != 0;
+	bool eof = false;
+
+	*cond = false;
+	*data = 0;
+	*flags = 0;
+
+	if (slot == SLOT_READ) {
+		switch (kfd->kind) {
+		case FD_FIFO_WRITE:
+			return (true);
+		case FD_PIPE_WRITE:
+			if (!fetch_state(kfd, state, false)) {
+				return (false);
+			}
+			eof = (state->revents & POLLERR) != 0;
+			*cond = eof;
+			break;
+		case FD_PIPE_READ:
+		case FD_FIFO_READ:
+			if (!fetch_state(kfd, state, !nodata)) {
+				return (false);
+			}
+			eof = (state->revents & POLLHUP) != 0;
+			if (nodata) {
+				*cond = eof || (state->revents & POLLIN) != 0;
+				break;
+			}
+			*data = state->nread;
+			*cond = eof || *data >= (lowat && kn->kev.data > 0 ?
+							  kn->kev.data :
+							  1);
+			break;
+		case FD_OTHER:
+			if (!fetch_state(kfd, state, true)) {
+				return (false);
+			}
+			*data = state->nread;
+			eof = (state->revents & (POLLHUP | POLLRDHUP)) != 0;
+			*cond = eof || (state->revents & POLLIN) != 0;
+			break;
+		}
+	} else {
+		int capacity;
+
+		switch (kfd->kind) {
+		case FD_FIFO_READ:
+			return (true);
+		case FD_PIPE_READ:
+			/* The unused direction, like pipe_kqfilter(). */
+			if (!fetch_state(kfd, state, false)) {
+				return (false);
+			}
+			eof = (state->revents & POLLHUP) != 0;
+			*cond = eof;
+			*data = sysconf(_SC_PAGESIZE);
+			break;
+		case FD_PIPE_WRITE:
+		case FD_FIFO_WRITE:
+			if (!fetch_state(kfd, state, !nodata)) {
+				return (false);
+			}
+			if (nodata) {
+				eof = (state->revents & POLLERR) != 0;
+				*cond = eof || (state->revents & POLLOUT) != 0;
+				break;
+			}
+			capacity = fcntl(kfd->fd, F_GETPIPE_SZ);
+			if (capacity > state->nread) {
+				*data = capacity - state->nread;
+			}
+			eof = (state->revents & POLLERR) != 0;
+			*cond = eof || *data >= (lowat ? kn->kev.data :
+							 PIPE_BUF);
+			break;
+		case FD_OTHER:
+			if (!fetch_state(kfd, state, false)) {
+				return (false);
+			}
+			eof = (state->revents & (POLLHUP | POLLERR)) != 0;
+			*cond = eof || (state->revents & POLLOUT) != 0;
+			break;
+		}
+		/* FreeBSD deletes write knotes of anonymous pipes on EOF. */
+		if (eof && (kfd->kind == FD_PIPE_READ ||
+			       kfd->kind == FD_PIPE_WRITE)) {
+			*flags |= EV_ONESHOT;
+		}
+	}
+	if (eof) {
+		*flags |= EV_EOF;
+	}
+	return (true);
+}
+
+/*
+ * Whether a FIFO end with a watch was activated since its last evaluation:
+ * by I/O, or by an epoll wakeup for the first or last end of the other side
+ * coming or going. Linux also wakes the ends when one of their own side
+ * closes while the other side has none, so a wakeup only counts if inotify
+ * saw the other side close, or the other side is back. A write end always
+ * knows whether readers are there, but a read end only knows about writers
+ * once it saw them go. Until then, as inotify does not tell which side an
+ * open was on, an open counts unless a later close of a read end pairs it.
+ */
+static bool
+fifo_activated(struct kfd *kfd, bool woken, short revents)
+{
+	bool writer = kfd->kind == FD_FIFO_WRITE;
+	bool gone = (revents & (writer ? POLLERR : POLLHUP)) != 0;
+	bool active;
+
+	kfd->fifo_seen_gone |= gone;
+	active = kfd->io ||
+	    (woken && (kfd->fifo_closes[!writer] > 0 ||
+			  (kfd->fifo_gone && !gone) ||
+			  (!writer && !kfd->fifo_seen_gone &&
+			      kfd->fifo_opens > 0)));
+
+	kfd->fifo_gone = gone;
+	kfd->io = false;
+	kfd->fifo_opens = 0;
+	kfd->fifo_closes[0] = kfd->fifo_closes[1] = 0;
+	return (active);
+}
+
+/*
+ * Evaluates the knotes of 'kfd' and stores at most 'nevents' events.
+ * '*sticky' tells whether 'kfd' must be evaluated on the next harvest even if
+ * epoll does not report it. It is false if 'kfd' was freed.
+ */
+static int
+eval_kfd(struct kq *kq, struct kfd *kfd, struct kevent *events, int nevents,
+    bool *sticky)
+{
+	struct fd_state state = { 0 };
+	struct stat st;
+	bool woken = kfd->woken;
+	bool watched = kfd->io_wd >= 0;
+	bool fifo = watched &&
+	    (kfd->kind == FD_FIFO_READ || kfd->kind == FD_FIFO_WRITE);
+	bool active = false;
+	int n = 0;
+
+	/*
+	 * The knotes outlive close(2). Once the number refers to another
+	 * file, they are dropped instead of reporting its state.
+	 */
+	if (fstat(kfd->fd, &st) < 0 || st.st_dev != kfd->dev ||
+	    st.st_ino != kfd->ino) {
+		free_kfd(kq, kfd);
+		*sticky = false;
+		return (0);
+	}
+
+	/*
+	 * What epoll reported during this scan is as good as poll(2). Older
+	 * reports, of descriptors that did not fit into the last harvest, may
+	 * be stale.
+	 */
+	if (woken && kfd->woken_scan == kq->scans) {
+		state.polled = true;
+		state.revents = (short)kfd->revents;
+	}
+	kfd->woken = false;
+	*sticky = kfd->no_epoll;
+	if (fifo) {
+		if (!fetch_state(kfd, &state, false)) {
+			free_kfd(kq, kfd);
+			*sticky = false;
+			return (0);
+		}
+		active = fifo_activated(kfd, woken, state.revents);
+	} else if (watched) {
+		/* Pipe ends have no opens, epoll sees the other end close. */
+		active = woken || kfd->io;
+		kfd->io = false;
+		kfd->fifo_opens = 0;
+		kfd->fifo_closes[0] = kfd->fifo_closes[1] = 0;
+	}
+	for (int s = 0; s < NSLOTS; ++s) {
+		enum slot slot = (enum slot)s;
+		struct knote *kn = kfd->knotes[slot];
+		unsigned short flags = 0;
+		int64_t data = 0;
+		bool cond, report;
+
+		if (!kn || kn->disabled) {
+			continue;
+		}
+		if (n == nevents) {
+			*sticky = true;
+			break;
+		}
+
+		if (slot == SLOT_VNODE) {
+			cond = report = kn->pending != 0;
+		} else {
+			if (!eval_filter(kfd, kn, slot, &state, &cond, &data,
+				&flags)) {
+				free_kfd(kq, kfd);
+				*sticky = false;
+				return (n);
+			}
+			report = cond &&
+			    (!(kn->kev.flags & EV_CLEAR) || kn->armed ||
+				data != kn->last_data ||
+				((flags & EV_EOF) != 0) != kn->last_eof ||
+				(fifo ? active :
+					((woken || active) &&
+					    !(flags & EV_EOF))));
+			if (!cond) {
+				kn->armed = true;
+			}
+			if (watched || (kn->kev.fflags & NOTE_NODATA)) {
+				/*
+				 * inotify queues watched ends on every change
+				 * of 'data', and without 'data' to keep up to
+				 * date, there are none. Only level-triggered
+				 * knotes need polling then.
+				 */
+				if (cond && !(kn->kev.flags & EV_CLEAR)) {
+					*sticky = true;
+				}
+			} else if (cond || (slot == SLOT_WRITE &&
+					       kfd->kind == FD_PIPE_WRITE)) {
+				*sticky = true;
+			}
+		}
+		if (!report) {
+			continue;
+		}
+
+		events[n] = kn->kev;
+		events[n].flags |= flags;
+		events[n].fflags = slot == SLOT_VNODE ? kn->pending : 0;
+		events[n].data = data;
+		++n;
+
+		kn->armed = false;
+		kn->last_data = data;
+		kn->last_eof = (flags & EV_EOF) != 0;
+		kn->pending = 0;
+		if (events[n - 1].flags & EV_ONESHOT) {
+			free_knote(kq, kfd, slot);
+		} else if (kn->kev.flags & EV_DISPATCH) {
+			kn->disabled = true;
+		}
+	}
+
+	if (!kfd->knotes[SLOT_READ] && !kfd->knotes[SLOT_WRITE] &&
+	    !kfd->knotes[SLOT_VNODE]) {
+		free_kfd(kq, kfd);
+		*sticky = false;
+	}
+	return (n);
+}
+
+/* Evaluates every descriptor on the active list at most once. */
+static int
+collect(struct kq *kq, struct kevent *events, int nevents)
+{
+	size_t budget = kq->nactive;
+	int n = 0;
+
+	while (budget-- > 0 && n < nevents) {
+		struct kfd *kfd = kq->head;
+		bool sticky;
+
+		if (!kfd) {
+			break;
+		}
+		unqueue_kfd(kq, kfd);
+		n += eval_kfd(kq, kfd, events + n, nevents - n, &sticky);
+		if (sticky) {
+			queue_kfd(kq, kfd);
+		}
+	}
+	return (n);
+}
+
+static int
+timeout_ms(struct timespec const *deadline)
+{
+	struct timespec now;
+	int64_t ns;
+
+	if (!deadline) {
+		return (-1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = (int64_t)(deadline->tv_sec - now.tv_sec) * 1000000000 +
+	    (deadline->tv_nsec - now.tv_nsec);
+	if (ns <= 0) {
+		return (0);
+	}
+	if (ns / 1000000 >= INT_MAX) {
+		return (INT_MAX);
+	}
+	return ((int)((ns + 999999) / 1000000));
+}
+
+static int
+scan(struct kq *kq, struct kevent *events, int nevents,
+    struct timespec const *timeout)
+{
+	struct epoll_event evs[EPOLL_BATCH];
+	struct timespec deadline;
+	int wait = 0;
+
+	if (timeout) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout->tv_sec;
+		deadline.tv_nsec += timeout->tv_nsec;
+		if (deadline.tv_nsec >= 1000000000) {
+			++deadline.tv_sec;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	for (;;) {
+		int n;
+
+		++kq->scans;
+		/* The first round only collects what is already there. */
+		if (wait != 0) {
+			pthread_mutex_unlock(&kq->mutex);
+		}
+		do {
+			n = epoll_wait(kq->epfd, evs, EPOLL_BATCH, wait);
+			if (wait != 0) {
+				pthread_mutex_lock(&kq->mutex);
+				wait = 0;
+			}
+			if (n > 0) {
+				mark_ready(kq, evs, n);
+			}
+		} while (n == EPOLL_BATCH);
+		if (n < 0) {
+			return (-1);	/* EINTR, like FreeBSD */
+		}
+
+		if ((n = collect(kq, events, nevents)) > 0) {
+			return (n);
+		}
+		if ((wait = timeout_ms(timeout ? &deadline : NULL)) == 0) {
+			return (0);
+		}
+	}
+}
+
+int
+kevent(int kqfd, struct kevent const *changelist, int nchanges,
+    struct kevent *eventlist, int nevents, struct timespec const *timeout)
+{
+	struct kq *kq;
+	int nerrors = 0;
+	int n;
+
+	if (!(kq = lookup_kq(kqfd))) {
+		errno = EBADF;
+		return (-1);
+	}
+	if (nchanges < 0 || nevents < 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	pthread_mutex_lock(&kq->mutex);
+	for (int i = 0; i < nchanges; ++i) {
+		/* 'changelist' and 'eventlist' may be the same array. */
+		struct kevent kev = changelist[i];
+		int error;
+
+		kev.flags &= (unsigned short)~EV_SYSFLAGS;
+		error = apply_change(kq, &kev);
+		if (error == 0 && !(kev.flags & EV_RECEIPT)) {
+			continue;
+		}
+		if (nevents == 0) {
+			if (error == 0) {
+				continue;
+			}
+			pthread_mutex_unlock(&kq->mutex);
+			errno = error;
+			return (-1);
+		}
+		*eventlist = kev;
+		eventlist->flags = EV_ERROR;
+		eventlist->data = error;
+		++eventlist;
+		--nevents;
+		++nerrors;
+	}
+
+	if (nerrors > 0 || nevents == 0) {
+		n = nerrors;
+	} else {
+		n = scan(kq, eventlist, nevents, timeout);
+	}
+	pthread_mutex_unlock(&kq->mutex);
+	return (n);
+}
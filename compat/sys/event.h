@@ -0,0 +1,83 @@
+#ifndef SYS_EVENT_H_
+#define SYS_EVENT_H_
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * The subset of FreeBSD's <sys/event.h> that kqueue_epoll.c implements on
+ * top of epoll(7) and inotify(7): EVFILT_READ and EVFILT_WRITE on pipes,
+ * FIFOs and other pollable descriptors, and EVFILT_VNODE on files, FIFOs
+ * and directories. Constants have their FreeBSD values.
+ */
+
+struct kevent {
+	uintptr_t ident;
+	short filter;
+	unsigned short flags;
+	unsigned int fflags;
+	int64_t data;
+	void *udata;
+};
+
+#define EV_SET(kevp_, a, b, c, d, e, f)                                 \
+	do {                                                            \
+		struct kevent *kevp = (kevp_);                          \
+		kevp->ident = (uintptr_t)(a);                           \
+		kevp->filter = (b);                                     \
+		kevp->flags = (c);                                      \
+		kevp->fflags = (d);                                     \
+		kevp->data = (e);                                       \
+		kevp->udata = (f);                                      \
+	} while (0)
+
+#define EVFILT_READ (-1)
+#define EVFILT_WRITE (-2)
+#define EVFILT_VNODE (-4)
+
+/* actions */
+#define EV_ADD 0x0001
+#define EV_DELETE 0x0002
+#define EV_ENABLE 0x0004
+#define EV_DISABLE 0x0008
+
+/* flags */
+#define EV_ONESHOT 0x0010
+#define EV_CLEAR 0x0020
+#define EV_RECEIPT 0x0040
+#define EV_DISPATCH 0x0080
+
+/* returned values */
+#define EV_SYSFLAGS 0xF000
+#define EV_EOF 0x8000
+#define EV_ERROR 0x4000
+
+/* EVFILT_READ and EVFILT_WRITE: 'data' is the low water mark */
+#define NOTE_LOWAT 0x0001
+
+/*
+ * Not in FreeBSD. EVFILT_READ and EVFILT_WRITE on pipes and FIFOs return 0
+ * in 'data' instead of the byte count and trigger on plain readability and
+ * writability, without NOTE_LOWAT. This saves the FIONREAD per event, and
+ * EV_CLEAR knotes are only reported when epoll reports the descriptor, not
+ * whenever the byte count changes.
+ */
+#define NOTE_NODATA 0x00010000
+
+/*
+ * EVFILT_VNODE. NOTE_OPEN, NOTE_CLOSE, NOTE_CLOSE_WRITE and NOTE_READ are
+ * not provided: the tests only check them where they are defined.
+ */
+#define NOTE_DELETE 0x0001
+#define NOTE_WRITE 0x0002
+#define NOTE_EXTEND 0x0004
+#define NOTE_ATTRIB 0x0008
+#define NOTE_LINK 0x0010
+#define NOTE_RENAME 0x0020
+#define NOTE_REVOKE 0x0040
+
+int kqueue(void);
+int kevent(int kq, struct kevent const *changelist, int nchanges,
+    struct kevent *eventlist, int nevents, struct timespec const *timeout);
+
+#endif
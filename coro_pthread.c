@@ -1,21 +1,158 @@
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <pthread.h>
+#include <unistd.h>
+
+#if defined(__linux__) && !defined(CORO_PTHREAD_CONDVAR)
+#define CORO_PTHREAD_FUTEX
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
 #include "coro.h"
+#include "coro_stack.h"
+
+/*
+ * Every thread that takes part in transfers owns one park slot. A transfer
+ * stores the argument into the slot of the target, wakes the target up and
+ * then parks on its own slot until someone transfers back.
+ *
+ * On Linux the slot is a futex word, so a handoff is one atomic exchange
+ * plus a FUTEX_WAKE only if the target is actually asleep. Elsewhere (or
+ * with CORO_PTHREAD_CONDVAR) the slot is protected by a mutex/condvar pair.
+ */
+
+#ifdef CORO_PTHREAD_FUTEX
+enum {
+	PARK_EMPTY,
+	PARK_FULL,
+	PARK_SLEEPING,
+};
+
+#define CORO_PTHREAD_SPIN 256
+#endif
+
+struct coro_pthread_park {
+#ifdef CORO_PTHREAD_FUTEX
+	_Atomic uint32_t state;
+#else
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool full;
+#endif
+	void *arg;
+};
 
 struct coro_pthread {
 	pthread_t thread;
-	pthread_cond_t *cond;
-	pthread_mutex_t *mutex;
+	struct coro_pthread_park *park;
 	void (*fun)(Coro, void *);
-	void **arg_ptr;
+	struct coro_stack stack;
+};
+
+#ifdef CORO_PTHREAD_FUTEX
+static _Thread_local struct coro_pthread_park my_park;
+static _Atomic int spin_limit;
+#else
+static _Thread_local struct coro_pthread_park my_park = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
 };
+#endif
+
+/*
+ * Posted by coro_destroy(). A coroutine that receives it ends its thread
+ * where it is parked, so it may be destroyed while suspended.
+ */
+static char destroyed;
+
+#ifdef CORO_PTHREAD_FUTEX
+static inline void
+cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static void
+park_post(struct coro_pthread_park *park, void *arg)
+{
+	park->arg = arg;
+	if (atomic_exchange_explicit(&park->state, PARK_FULL,
+		memory_order_release) == PARK_SLEEPING) {
+		(void)syscall(SYS_futex, &park->state, FUTEX_WAKE_PRIVATE, 1,
+		    NULL, NULL, 0);
+	}
+}
+
+static void *
+park_wait(struct coro_pthread_park *park)
+{
+	int spin = atomic_load_explicit(&spin_limit, memory_order_relaxed);
+	uint32_t state;
+
+	/*
+	 * The peer usually answers within a few hundred nanoseconds when it
+	 * runs on another CPU, so spin briefly before going to sleep.
+	 */
+	for (int i = 0; i < spin; ++i) {
+		if (atomic_load_explicit(&park->state, memory_order_acquire) ==
+		    PARK_FULL) {
+			goto out;
+		}
+		cpu_relax();
+	}
+
+	state = PARK_EMPTY;
+	if (atomic_compare_exchange_strong_explicit(&park->state, &state,
+		PARK_SLEEPING, memory_order_acquire, memory_order_acquire) ||
+	    state == PARK_SLEEPING) {
+		do {
+			(void)syscall(SYS_futex, &park->state,
+			    FUTEX_WAIT_PRIVATE, PARK_SLEEPING, NULL, NULL, 0);
+		} while (atomic_load_explicit(&park->state,
+			     memory_order_acquire) != PARK_FULL);
+	}
+
+out:
+	atomic_store_explicit(&park->state, PARK_EMPTY, memory_order_relaxed);
+	return (park->arg);
+}
+#else
+static void
+park_post(struct coro_pthread_park *park, void *arg)
+{
+	pthread_mutex_lock(&park->mutex);
+	park->arg = arg;
+	park->full = true;
+	pthread_cond_signal(&park->cond);
+	pthread_mutex_unlock(&park->mutex);
+}
+
+static void *
+park_wait(struct coro_pthread_park *park)
+{
+	void *arg;
+
+	pthread_mutex_lock(&park->mutex);
+	while (!park->full) {
+		pthread_cond_wait(&park->cond, &park->mutex);
+	}
+	park->full = false;
+	arg = park->arg;
+	pthread_mutex_unlock(&park->mutex);
 
-static _Thread_local pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
-static _Thread_local pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-static _Thread_local void *my_arg;
+	return (arg);
+}
+#endif
 
 static void *
 trampoline(void *thread_arg)
@@ -25,19 +162,16 @@ trampoline(void *thread_arg)
 	void *arg;
 	struct coro_pthread parent_coro = *coros[1];
 
-	pthread_mutex_lock(&mutex);
-	{
-		pthread_mutex_lock(parent_coro.mutex);
-		coros[0]->cond = &cond;
-		coros[0]->mutex = &mutex;
-		coros[0]->arg_ptr = &my_arg;
-		fun = coros[0]->fun;
-		pthread_cond_signal(parent_coro.cond);
-		pthread_mutex_unlock(parent_coro.mutex);
+	fun = coros[0]->fun;
+	coros[0]->park = &my_park;
+
+	/* 'coros' lives on the stack of coro_create(), which returns now. */
+	park_post(parent_coro.park, NULL);
+
+	arg = park_wait(&my_park);
+	if (arg == &destroyed) {
+		return (NULL);
 	}
-	pthread_cond_wait(&cond, &mutex);
-	arg = my_arg;
-	pthread_mutex_unlock(&mutex);
 
 	fun(&parent_coro, arg);
 
@@ -48,53 +182,69 @@ Coro
 coro_create(size_t size, void (*fun)(Coro, void *))
 {
 	struct coro_pthread *coros[2];
-	struct coro_pthread my_coro = {
-		.cond = &cond, .mutex = &mutex, .arg_ptr = &my_arg
-	};
+	struct coro_pthread my_coro = { .park = &my_park };
+	pthread_attr_t attr;
+
+#ifdef CORO_PTHREAD_FUTEX
+	atomic_store_explicit(&spin_limit,
+	    sysconf(_SC_NPROCESSORS_ONLN) > 1 ? CORO_PTHREAD_SPIN : 0,
+	    memory_order_relaxed);
+#endif
 
-	(void)size;
+	if (size < (size_t)PTHREAD_STACK_MIN) {
+		size = (size_t)PTHREAD_STACK_MIN;
+	}
 
 	coros[0] = malloc(sizeof(struct coro_pthread));
 	if (!coros[0]) {
 		return (NULL);
 	}
 
+	if (coro_stack_alloc(&coros[0]->stack, size) < 0) {
+		free(coros[0]);
+		return (NULL);
+	}
+
+	if (pthread_attr_init(&attr) != 0) {
+		goto out_stack;
+	}
+	if (pthread_attr_setstack(&attr, coros[0]->stack.base,
+		coros[0]->stack.size) != 0) {
+		goto out_attr;
+	}
+
 	coros[1] = &my_coro;
+	coros[0]->fun = fun;
 
-	pthread_mutex_lock(&mutex);
-	{
-		coros[0]->fun = fun;
-		if (pthread_create(&coros[0]->thread, NULL, /**/
-		        trampoline, coros) < 0) {
-			pthread_mutex_unlock(&mutex);
-			free(coros[0]);
-			return (NULL);
-		}
+	if (pthread_create(&coros[0]->thread, &attr, /**/
+		trampoline, coros) != 0) {
+		goto out_attr;
 	}
-	pthread_cond_wait(&cond, &mutex);
-	pthread_mutex_unlock(&mutex);
+	(void)park_wait(&my_park);
+
+	pthread_attr_destroy(&attr);
 
 	return (coros[0]);
+
+out_attr:
+	pthread_attr_destroy(&attr);
+out_stack:
+	coro_stack_free(&coros[0]->stack);
+	free(coros[0]);
+	return (NULL);
 }
 
 void *
 coro_transfer(Coro coro_p, void *arg)
 {
 	struct coro_pthread *coro = (struct coro_pthread *)coro_p;
-	void *arg_local;
-
-	pthread_mutex_lock(&mutex);
-	{
-		pthread_mutex_lock(coro->mutex);
-		*coro->arg_ptr = arg;
-		pthread_cond_signal(coro->cond);
-		pthread_mutex_unlock(coro->mutex);
-	}
-	pthread_cond_wait(&cond, &mutex);
-	arg_local = my_arg;
-	pthread_mutex_unlock(&mutex);
 
-	return (arg_local);
+	park_post(coro->park, arg);
+
+	if ((arg = park_wait(&my_park)) == &destroyed) {
+		pthread_exit(NULL);
+	}
+	return (arg);
 }
 
 void
@@ -102,11 +252,8 @@ coro_destroy(Coro coro_p)
 {
 	struct coro_pthread *coro = (struct coro_pthread *)coro_p;
 
-	{
-		pthread_mutex_lock(coro->mutex);
-		pthread_cond_signal(coro->cond);
-		pthread_mutex_unlock(coro->mutex);
-	}
+	park_post(coro->park, &destroyed);
 	pthread_join(coro->thread, NULL);
+	coro_stack_free(&coro->stack);
 	free(coro_p);
 }
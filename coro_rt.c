@@ -0,0 +1,685 @@
+#include <sys/types.h>
+#include <sys/event.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "coro.h"
+#include "coro_rt.h"
+
+#define CORO_RT_EVENTS 256
+
+/* Tasks a busy worker runs between two looks at its kqueue. */
+#define CORO_RT_POLL_INTERVAL 64
+
+struct worker;
+
+struct coro_rt_task {
+	void (*fun)(struct coro_rt_task *, void *);
+	void *arg;
+	Coro coro;
+	struct worker *worker;	/* the worker running the task */
+	bool done;
+	bool yielded;		/* requeue once switched out */
+	struct kevent event;	 /* the event the task was woken up by */
+	struct coro_rt_task *next; /* run queue */
+	struct coro_rt_task *prev_task; /* all tasks */
+	struct coro_rt_task *next_task;
+};
+
+struct runq {
+	pthread_mutex_t mutex;
+	struct coro_rt_task *head;
+	struct coro_rt_task *tail;
+	_Atomic size_t len; /* may be peeked at without the mutex */
+};
+
+struct worker {
+	struct coro_rt *rt;
+	pthread_t thread;
+	Coro self; /* the worker, as seen from its tasks */
+	int kq;
+	int wake[2]; /* a pipe in 'kq', written to wake a sleeping worker */
+	_Atomic bool sleeping;
+	struct runq runq;
+	struct kevent *changes;
+	int nchanges;
+	int changes_size;
+	struct kevent *events;
+	int events_size;
+	struct coro_rt_stats stats;
+};
+
+struct coro_rt {
+	size_t stack_size;
+	unsigned nworkers;
+	struct worker *workers;
+	pthread_mutex_t tasks_mutex;
+	struct coro_rt_task *tasks; /* all tasks, parked ones included */
+	_Atomic size_t ntasks;
+	_Atomic unsigned next; /* worker for the next spawned task */
+	_Atomic unsigned nsleeping;
+	_Atomic bool done;
+	_Atomic int error;
+};
+
+/*
+ * errno is thread-local and tasks move between threads while parked. glibc
+ * declares __errno_location() const, so the compiler may reuse the address
+ * it returned before a park; accessing errno in functions of their own
+ * prevents that.
+ */
+static __attribute__((__noinline__)) int
+get_errno(void)
+{
+	return (errno);
+}
+
+static __attribute__((__noinline__)) void
+set_errno(int error)
+{
+	errno = error;
+}
+
+static void
+runq_push(struct runq *runq, struct coro_rt_task *task)
+{
+	task->next = NULL;
+	pthread_mutex_lock(&runq->mutex);
+	if (runq->tail) {
+		runq->tail->next = task;
+	} else {
+		runq->head = task;
+	}
+	runq->tail = task;
+	atomic_store(&runq->len, atomic_load(&runq->len) + 1);
+	pthread_mutex_unlock(&runq->mutex);
+}
+
+static struct coro_rt_task *
+runq_pop(struct runq *runq)
+{
+	struct coro_rt_task *task;
+
+	if (atomic_load_explicit(&runq->len, memory_order_relaxed) == 0) {
+		return (NULL);
+	}
+	pthread_mutex_lock(&runq->mutex);
+	if ((task = runq->head)) {
+		runq->head = task->next;
+		if (!runq->head) {
+			runq->tail = NULL;
+		}
+		atomic_store(&runq->len, atomic_load(&runq->len) - 1);
+	}
+	pthread_mutex_unlock(&runq->mutex);
+	return (task);
+}
+
+/*
+ * Takes the older half, rounded up, of the tasks of 'runq'. Returns the
+ * number of tasks taken, linked through 'next' starting at '*head'.
+ */
+static size_t
+runq_steal(struct runq *runq, struct coro_rt_task **head)
+{
+	struct coro_rt_task *last;
+	size_t n;
+
+	pthread_mutex_lock(&runq->mutex);
+	if ((n = (atomic_load(&runq->len) + 1) / 2) == 0) {
+		pthread_mutex_unlock(&runq->mutex);
+		return (0);
+	}
+	*head = last = runq->head;
+	for (size_t i = 1; i < n; ++i) {
+		last = last->next;
+	}
+	runq->head = last->next;
+	if (!runq->head) {
+		runq->tail = NULL;
+	}
+	last->next = NULL;
+	atomic_store(&runq->len, atomic_load(&runq->len) - n);
+	pthread_mutex_unlock(&runq->mutex);
+	return (n);
+}
+
+static void
+wake_worker(struct worker *w)
+{
+	char byte = 0;
+
+	/* If the pipe is full, the worker has a wakeup pending anyway. */
+	(void)write(w->wake[1], &byte, 1);
+}
+
+static void
+wake_one(struct coro_rt *rt)
+{
+	if (atomic_load(&rt->nsleeping) == 0) {
+		return;
+	}
+	for (unsigned i = 0; i < rt->nworkers; ++i) {
+		struct worker *w = &rt->workers[i];
+
+		if (atomic_exchange(&w->sleeping, false)) {
+			atomic_fetch_sub(&rt->nsleeping, 1);
+			wake_worker(w);
+			return;
+		}
+	}
+}
+
+static void
+wake_all(struct coro_rt *rt)
+{
+	for (unsigned i = 0; i < rt->nworkers; ++i) {
+		wake_worker(&rt->workers[i]);
+	}
+}
+
+static void
+finish(struct coro_rt *rt, int error)
+{
+	int none = 0;
+
+	if (error) {
+		(void)atomic_compare_exchange_strong(&rt->error, &none, error);
+	}
+	atomic_store(&rt->done, true);
+	wake_all(rt);
+}
+
+static int
+worker_init(struct coro_rt *rt, struct worker *w)
+{
+	struct kevent kev;
+
+	w->rt = rt;
+	w->kq = w->wake[0] = w->wake[1] = -1;
+	if (pthread_mutex_init(&w->runq.mutex, NULL) != 0) {
+		return (-1);
+	}
+	w->events_size = CORO_RT_EVENTS;
+	if (!(w->events = calloc((size_t)w->events_size,
+		  sizeof(struct kevent)))) {
+		return (-1);
+	}
+	if ((w->kq = kqueue()) < 0 || pipe(w->wake) < 0) {
+		return (-1);
+	}
+	for (int i = 0; i < 2; ++i) {
+		if (fcntl(w->wake[i], F_SETFD, FD_CLOEXEC) < 0 ||
+		    fcntl(w->wake[i], F_SETFL, O_NONBLOCK) < 0) {
+			return (-1);
+		}
+	}
+	EV_SET(&kev, w->wake[0], EVFILT_READ, EV_ADD, 0, 0, NULL);
+	return (kevent(w->kq, &kev, 1, NULL, 0, NULL));
+}
+
+static void
+worker_fini(struct worker *w)
+{
+	pthread_mutex_destroy(&w->runq.mutex);
+	if (w->kq >= 0) {
+		close(w->kq);
+	}
+	if (w->wake[0] >= 0) {
+		close(w->wake[0]);
+		close(w->wake[1]);
+	}
+	free(w->changes);
+	free(w->events);
+}
+
+struct coro_rt *
+coro_rt_create(unsigned nworkers, size_t stack_size)
+{
+	struct coro_rt *rt;
+
+	if (nworkers == 0) {
+		long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		nworkers = ncpus > 0 ? (unsigned)ncpus : 1;
+	}
+	if (!(rt = calloc(1, sizeof(*rt)))) {
+		return (NULL);
+	}
+	rt->stack_size = stack_size;
+	if (pthread_mutex_init(&rt->tasks_mutex, NULL) != 0) {
+		free(rt);
+		return (NULL);
+	}
+	if (!(rt->workers = calloc(nworkers, sizeof(struct worker)))) {
+		pthread_mutex_destroy(&rt->tasks_mutex);
+		free(rt);
+		return (NULL);
+	}
+	for (; rt->nworkers < nworkers; ++rt->nworkers) {
+		if (worker_init(rt, &rt->workers[rt->nworkers]) < 0) {
+			int error = errno;
+
+			++rt->nworkers;
+			coro_rt_destroy(rt);
+			errno = error;
+			return (NULL);
+		}
+	}
+	return (rt);
+}
+
+void
+coro_rt_destroy(struct coro_rt *rt)
+{
+	struct coro_rt_task *task;
+
+	/*
+	 * Only tasks that never ran are left if coro_rt_run() succeeded; if
+	 * it failed, tasks may also be parked in the workers' kqueues.
+	 */
+	while ((task = rt->tasks)) {
+		rt->tasks = task->next_task;
+		if (task->coro) {
+			coro_destroy(task->coro);
+		}
+		free(task);
+	}
+	pthread_mutex_destroy(&rt->tasks_mutex);
+	for (unsigned i = 0; i < rt->nworkers; ++i) {
+		worker_fini(&rt->workers[i]);
+	}
+	free(rt->workers);
+	free(rt);
+}
+
+unsigned
+coro_rt_workers(struct coro_rt const *rt)
+{
+	return (rt->nworkers);
+}
+
+int
+coro_rt_spawn(struct coro_rt *rt,
+    void (*fun)(struct coro_rt_task *, void *), void *arg)
+{
+	struct coro_rt_task *task;
+	unsigned i;
+
+	if (!(task = calloc(1, sizeof(*task)))) {
+		return (-1);
+	}
+	task->fun = fun;
+	task->arg = arg;
+	pthread_mutex_lock(&rt->tasks_mutex);
+	if ((task->next_task = rt->tasks)) {
+		task->next_task->prev_task = task;
+	}
+	rt->tasks = task;
+	pthread_mutex_unlock(&rt->tasks_mutex);
+	atomic_fetch_add(&rt->ntasks, 1);
+	i = atomic_fetch_add_explicit(&rt->next, 1, memory_order_relaxed);
+	runq_push(&rt->workers[i % rt->nworkers].runq, task);
+	wake_one(rt);
+	return (0);
+}
+
+static void
+task_entry(Coro creator, void *arg)
+{
+	struct coro_rt_task *task = arg;
+
+	(void)creator;
+	task->fun(task, task->arg);
+	task->done = true;
+
+	/* The worker destroys the coroutine, this never returns. */
+	(void)coro_transfer(task->worker->self, NULL);
+}
+
+static int
+run_task(struct worker *w, struct coro_rt_task *task)
+{
+	struct coro_rt *rt = w->rt;
+
+	if (!task->coro &&
+	    !(task->coro = coro_create(rt->stack_size, task_entry))) {
+		runq_push(&w->runq, task);
+		errno = ENOMEM;
+		return (-1);
+	}
+
+	task->worker = w;
+	++w->stats.switches;
+	(void)coro_transfer(task->coro, task);
+
+	if (task->done) {
+		pthread_mutex_lock(&rt->tasks_mutex);
+		if (task->prev_task) {
+			task->prev_task->next_task = task->next_task;
+		} else {
+			rt->tasks = task->next_task;
+		}
+		if (task->next_task) {
+			task->next_task->prev_task = task->prev_task;
+		}
+		pthread_mutex_unlock(&rt->tasks_mutex);
+		coro_destroy(task->coro);
+		free(task);
+		if (atomic_fetch_sub(&rt->ntasks, 1) == 1) {
+			finish(rt, 0);
+		}
+	} else if (task->yielded) {
+		/*
+		 * Only now that the task is switched out may it become visible
+		 * to other workers, which could steal and resume it.
+		 */
+		task->yielded = false;
+		runq_push(&w->runq, task);
+	}
+	return (0);
+}
+
+/*
+ * Takes half of the run queue of the first other worker that has tasks,
+ * keeps them on its own run queue and returns one of them.
+ */
+static struct coro_rt_task *
+steal(struct worker *w)
+{
+	struct coro_rt *rt = w->rt;
+	unsigned self = (unsigned)(w - rt->workers);
+
+	for (unsigned i = 1; i < rt->nworkers; ++i) {
+		struct worker *victim = &rt->workers[(self + i) % rt->nworkers];
+		struct coro_rt_task *head, *next;
+		size_t n;
+
+		if (atomic_load_explicit(&victim->runq.len,
+			memory_order_relaxed) == 0 ||
+		    (n = runq_steal(&victim->runq, &head)) == 0) {
+			continue;
+		}
+		w->stats.steals += n;
+		for (struct coro_rt_task *task = head->next; task;
+		     task = next) {
+			next = task->next;
+			runq_push(&w->runq, task);
+		}
+		return (head);
+	}
+	return (NULL);
+}
+
+static bool
+work_available(struct coro_rt *rt)
+{
+	for (unsigned i = 0; i < rt->nworkers; ++i) {
+		if (atomic_load(&rt->workers[i].runq.len) > 0) {
+			return (true);
+		}
+	}
+	return (false);
+}
+
+/*
+ * Submits the pending registrations and makes the tasks of the harvested
+ * events runnable. Blocks until there is an event if 'block' is set.
+ */
+static int
+worker_poll(struct worker *w, bool block)
+{
+	struct timespec const zero = { 0, 0 };
+	size_t ready = 0;
+	int n;
+
+	/*
+	 * Every change may come back as an EV_ERROR event, so there must be
+	 * room for all of them.
+	 */
+	n = kevent(w->kq, w->changes, w->nchanges, w->events, w->events_size,
+	    block ? NULL : &zero);
+	++w->stats.kevents;
+	if (n < 0) {
+		return (errno == EINTR ? 0 : -1);
+	}
+	w->nchanges = 0;
+
+	for (int i = 0; i < n; ++i) {
+		struct coro_rt_task *task = w->events[i].udata;
+
+		if (!task) {
+			char buf[64];
+
+			while (read(w->wake[0], buf, sizeof(buf)) > 0) {
+			}
+			++w->stats.wakeups;
+			continue;
+		}
+		task->event = w->events[i];
+		runq_push(&w->runq, task);
+		++ready;
+	}
+	w->stats.events += ready;
+
+	/* Let a sleeping worker steal some of them. */
+	if (ready > 1) {
+		wake_one(w->rt);
+	}
+	return (0);
+}
+
+static int
+worker_sleep(struct worker *w)
+{
+	struct coro_rt *rt = w->rt;
+	int ret = 0;
+
+	/*
+	 * Announce the sleep before the last look at the run queues: a task
+	 * pushed after that look sees the announcement and wakes a worker.
+	 */
+	atomic_store(&w->sleeping, true);
+	atomic_fetch_add(&rt->nsleeping, 1);
+	if (!work_available(rt) && !atomic_load(&rt->done)) {
+		ret = worker_poll(w, true);
+	}
+	if (atomic_exchange(&w->sleeping, false)) {
+		atomic_fetch_sub(&rt->nsleeping, 1);
+	}
+	return (ret);
+}
+
+static void
+capture_self(Coro worker, void *arg)
+{
+	struct worker *w = arg;
+
+	w->self = worker;
+	(void)coro_transfer(worker, NULL);
+}
+
+static void *
+worker_main(void *arg)
+{
+	struct worker *w = arg;
+	struct coro_rt *rt = w->rt;
+	unsigned ran = 0;
+	Coro capture;
+
+	/*
+	 * Tasks transfer back to the worker that resumed them. The handle of
+	 * the worker's own context is the parent of a coroutine it creates.
+	 */
+	if (!(capture = coro_create(rt->stack_size, capture_self))) {
+		finish(rt, ENOMEM);
+		return (NULL);
+	}
+	(void)coro_transfer(capture, w);
+
+	while (!atomic_load(&rt->done)) {
+		struct coro_rt_task *task;
+
+		if ((task = runq_pop(&w->runq)) || (task = steal(w))) {
+			if (run_task(w, task) < 0 ||
+			    (++ran % CORO_RT_POLL_INTERVAL == 0 &&
+				worker_poll(w, false) < 0)) {
+				finish(rt, errno);
+			}
+			continue;
+		}
+		if (worker_poll(w, false) < 0 ||
+		    (atomic_load(&w->runq.len) == 0 && worker_sleep(w) < 0)) {
+			finish(rt, errno);
+		}
+	}
+
+	coro_destroy(capture);
+	return (NULL);
+}
+
+int
+coro_rt_run(struct coro_rt *rt)
+{
+	unsigned started;
+	int error;
+
+	if (atomic_load(&rt->ntasks) == 0) {
+		return (0);
+	}
+	atomic_store(&rt->done, false);
+	atomic_store(&rt->error, 0);
+
+	for (started = 0; started < rt->nworkers; ++started) {
+		struct worker *w = &rt->workers[started];
+
+		if ((error = pthread_create(&w->thread, NULL, worker_main,
+			 w)) != 0) {
+			finish(rt, error);
+			break;
+		}
+	}
+	for (unsigned i = 0; i < started; ++i) {
+		pthread_join(rt->workers[i].thread, NULL);
+	}
+
+	if ((error = atomic_load(&rt->error)) != 0) {
+		errno = error;
+		return (-1);
+	}
+	return (0);
+}
+
+void
+coro_rt_stats(struct coro_rt const *rt, struct coro_rt_stats *stats)
+{
+	*stats = (struct coro_rt_stats) { 0 };
+	for (unsigned i = 0; i < rt->nworkers; ++i) {
+		struct coro_rt_stats const *s = &rt->workers[i].stats;
+
+		stats->switches += s->switches;
+		stats->kevents += s->kevents;
+		stats->events += s->events;
+		stats->steals += s->steals;
+		stats->wakeups += s->wakeups;
+	}
+}
+
+static void
+park(struct coro_rt_task *task)
+{
+	(void)coro_transfer(task->worker->self, NULL);
+}
+
+void
+coro_rt_yield(struct coro_rt_task *task)
+{
+	task->yielded = true;
+	park(task);
+}
+
+int
+coro_rt_wait(struct coro_rt_task *task, int fd, short filter,
+    struct kevent *kev)
+{
+	struct worker *w = task->worker;
+
+	if (w->nchanges == w->changes_size) {
+		int size = w->changes_size ? w->changes_size * 2 : 64;
+		struct kevent *changes, *events;
+
+		if (!(changes = realloc(w->changes,
+			  (size_t)size * sizeof(struct kevent)))) {
+			return (-1);
+		}
+		w->changes = changes;
+		w->changes_size = size;
+		if (size > w->events_size) {
+			if (!(events = realloc(w->events,
+				  (size_t)size * sizeof(struct kevent)))) {
+				return (-1);
+			}
+			w->events = events;
+			w->events_size = size;
+		}
+	}
+
+	EV_SET(&w->changes[w->nchanges], fd, filter, EV_ADD | EV_ONESHOT, 0,
+	    0, task);
+	++w->nchanges;
+	park(task);
+
+	if (kev) {
+		*kev = task->event;
+	}
+	if (task->event.flags & EV_ERROR) {
+		set_errno((int)task->event.data);
+		return (-1);
+	}
+	return (0);
+}
+
+ssize_t
+coro_rt_read(struct coro_rt_task *task, int fd, void *buf, size_t nbytes)
+{
+	for (;;) {
+		ssize_t n = read(fd, buf, nbytes);
+
+		if (n >= 0 || get_errno() != EAGAIN) {
+			return (n);
+		}
+		if (coro_rt_wait(task, fd, EVFILT_READ, NULL) < 0) {
+			return (-1);
+		}
+	}
+}
+
+ssize_t
+coro_rt_write(struct coro_rt_task *task, int fd, void const *buf,
+    size_t nbytes)
+{
+	size_t written = 0;
+
+	while (written < nbytes) {
+		ssize_t n = write(fd, (char const *)buf + written,
+		    nbytes - written);
+
+		if (n >= 0) {
+			written += (size_t)n;
+			continue;
+		}
+		if (get_errno() != EAGAIN ||
+		    coro_rt_wait(task, fd, EVFILT_WRITE, NULL) < 0) {
+			return (-1);
+		}
+	}
+	return ((ssize_t)written);
+}
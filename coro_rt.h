@@ -0,0 +1,81 @@
+#ifndef CORO_RT_H_
+#define CORO_RT_H_
+
+#include <sys/types.h>
+#include <sys/event.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * An M:N runtime for coroutines doing I/O on non-blocking descriptors,
+ * the multi-threaded counterpart of coro_sched.h. Every worker thread has
+ * its own run queue and kqueue. A task that has to wait for a descriptor
+ * registers it as EV_ONESHOT with the kqueue of the worker it runs on, and
+ * the event makes it runnable on that worker again. Workers whose run
+ * queue is empty steal half of the run queue of another worker, so ready
+ * tasks migrate to idle workers; a worker with nothing to do sleeps in
+ * kevent(2) until it gets an event or is woken up for new work.
+ *
+ * A task is resumed by whichever worker dequeues it and always transfers
+ * back to that worker, which is why the functions below take the task and
+ * not the runtime. Since a task may continue on another thread after any
+ * call that parks it, it must not hold on to thread-local state, such as
+ * the address of errno, across such calls. Thousands of tasks need the
+ * ucontext backend; the pthread backend makes every task a thread.
+ *
+ * At most one task may wait for a given descriptor and filter at a time.
+ */
+
+struct coro_rt;
+struct coro_rt_task;
+
+struct coro_rt_stats {
+	uint64_t switches; /* transfers into tasks */
+	uint64_t kevents;  /* kevent(2) calls */
+	uint64_t events;   /* events harvested, without wakeups */
+	uint64_t steals;   /* tasks taken from other workers */
+	uint64_t wakeups;  /* sleeping workers woken up */
+};
+
+/*
+ * Creates a runtime with 'nworkers' worker threads, or one per online CPU
+ * if 'nworkers' is 0.
+ */
+struct coro_rt *coro_rt_create(unsigned /* nworkers */,
+    size_t /* stack_size */);
+void coro_rt_destroy(struct coro_rt * /* rt */);
+
+unsigned coro_rt_workers(struct coro_rt const * /* rt */);
+
+/*
+ * Tasks are distributed over the workers round-robin. This may be called
+ * from within tasks.
+ */
+int coro_rt_spawn(struct coro_rt * /* rt */,
+    void (*/* fun */)(struct coro_rt_task *, void *), void * /* arg */);
+
+/*
+ * Starts the workers and waits until all tasks have returned. Returns 0,
+ * or -1 with errno set if kevent(2) or creating a coroutine or thread
+ * failed.
+ */
+int coro_rt_run(struct coro_rt * /* rt */);
+
+void coro_rt_stats(struct coro_rt const * /* rt */,
+    struct coro_rt_stats * /* stats */);
+
+/*
+ * The following may only be called from within tasks, with the task
+ * passed to the task function. They behave like their coro_sched.h
+ * counterparts.
+ */
+void coro_rt_yield(struct coro_rt_task * /* task */);
+int coro_rt_wait(struct coro_rt_task * /* task */, int /* fd */,
+    short /* filter */, struct kevent * /* kev */);
+ssize_t coro_rt_read(struct coro_rt_task * /* task */, int /* fd */,
+    void * /* buf */, size_t /* nbytes */);
+ssize_t coro_rt_write(struct coro_rt_task * /* task */, int /* fd */,
+    void const * /* buf */, size_t /* nbytes */);
+
+#endif
@@ -0,0 +1,332 @@
+#include <sys/types.h>
+#include <sys/event.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "coro.h"
+#include "coro_sched.h"
+
+#define CORO_SCHED_EVENTS 256
+
+struct coro_task {
+	struct coro_sched *sched;
+	void (*fun)(struct coro_sched *, void *);
+	void *arg;
+	Coro coro;
+	Coro scheduler;		/* the scheduler, as seen from the task */
+	bool done;
+	struct kevent event;	/* the event the task was woken up by */
+	struct coro_task *next; /* run queue */
+	struct coro_task *prev_task; /* all tasks */
+	struct coro_task *next_task;
+};
+
+struct coro_sched {
+	int kq;
+	size_t stack_size;
+	size_t ntasks;
+	size_t nwaiting; /* tasks in coro_sched_wait() */
+	struct coro_task *tasks; /* all tasks, parked ones included */
+	struct coro_task *current;
+	struct coro_task *head; /* run queue */
+	struct coro_task *tail;
+	struct kevent *changes;
+	int nchanges;
+	int changes_size;
+	struct kevent *events;
+	int events_size;
+	struct coro_sched_stats stats;
+};
+
+static void
+runq_push(struct coro_sched *sched, struct coro_task *task)
+{
+	task->next = NULL;
+	if (sched->tail) {
+		sched->tail->next = task;
+	} else {
+		sched->head = task;
+	}
+	sched->tail = task;
+}
+
+struct coro_sched *
+coro_sched_create(size_t stack_size)
+{
+	struct coro_sched *sched;
+
+	if (!(sched = calloc(1, sizeof(*sched)))) {
+		return (NULL);
+	}
+	sched->stack_size = stack_size;
+	sched->events_size = CORO_SCHED_EVENTS;
+	if (!(sched->events = calloc((size_t)sched->events_size,
+		  sizeof(struct kevent)))) {
+		free(sched);
+		return (NULL);
+	}
+	if ((sched->kq = kqueue()) < 0) {
+		free(sched->events);
+		free(sched);
+		return (NULL);
+	}
+	return (sched);
+}
+
+void
+coro_sched_destroy(struct coro_sched *sched)
+{
+	struct coro_task *task;
+
+	/*
+	 * Only tasks that never ran are left if coro_sched_run() succeeded;
+	 * if it failed, tasks may also be parked in the kqueue.
+	 */
+	while ((task = sched->tasks)) {
+		sched->tasks = task->next_task;
+		if (task->coro) {
+			coro_destroy(task->coro);
+		}
+		free(task);
+	}
+	close(sched->kq);
+	free(sched->changes);
+	free(sched->events);
+	free(sched);
+}
+
+int
+coro_sched_spawn(struct coro_sched *sched,
+    void (*fun)(struct coro_sched *, void *), void *arg)
+{
+	struct coro_task *task;
+
+	if (!(task = calloc(1, sizeof(*task)))) {
+		return (-1);
+	}
+	task->sched = sched;
+	task->fun = fun;
+	task->arg = arg;
+	if ((task->next_task = sched->tasks)) {
+		task->next_task->prev_task = task;
+	}
+	sched->tasks = task;
+	++sched->ntasks;
+	runq_push(sched, task);
+	return (0);
+}
+
+static void
+task_entry(Coro scheduler, void *arg)
+{
+	struct coro_task *task = arg;
+
+	task->scheduler = scheduler;
+	task->fun(task->sched, task->arg);
+	task->done = true;
+
+	/* The scheduler destroys the coroutine, this never returns. */
+	(void)coro_transfer(scheduler, NULL);
+}
+
+static int
+run_task(struct coro_sched *sched, struct coro_task *task)
+{
+	/*
+	 * Coroutines are created here so that the scheduler is their parent,
+	 * even for tasks spawned by other tasks.
+	 */
+	if (!task->coro &&
+	    !(task->coro = coro_create(sched->stack_size, task_entry))) {
+		runq_push(sched, task);
+		errno = ENOMEM;
+		return (-1);
+	}
+
+	sched->current = task;
+	++sched->stats.switches;
+	(void)coro_transfer(task->coro, task);
+	sched->current = NULL;
+
+	if (task->done) {
+		if (task->prev_task) {
+			task->prev_task->next_task = task->next_task;
+		} else {
+			sched->tasks = task->next_task;
+		}
+		if (task->next_task) {
+			task->next_task->prev_task = task->prev_task;
+		}
+		coro_destroy(task->coro);
+		free(task);
+		--sched->ntasks;
+	}
+	return (0);
+}
+
+int
+coro_sched_run(struct coro_sched *sched)
+{
+	while (sched->ntasks > 0) {
+		struct coro_task *task, *round;
+		struct timespec const zero = { 0, 0 };
+		int n;
+
+		/*
+		 * Only the tasks that are runnable now make up the round.
+		 * Tasks that yield or get spawned go to the next one, so
+		 * that a task yielding in a loop cannot keep the scheduler
+		 * from kevent(2).
+		 */
+		round = sched->head;
+		sched->head = sched->tail = NULL;
+		while ((task = round)) {
+			round = task->next;
+			if (run_task(sched, task) < 0) {
+				while ((task = round)) {
+					round = task->next;
+					runq_push(sched, task);
+				}
+				return (-1);
+			}
+		}
+		if (sched->ntasks == 0) {
+			break;
+		}
+		if (sched->nwaiting == 0) {
+			continue;
+		}
+
+		/*
+		 * Every change may come back as an EV_ERROR event, so there
+		 * must be room for all of them. With runnable tasks left,
+		 * only look for events that are there already.
+		 */
+		n = kevent(sched->kq, sched->changes, sched->nchanges,
+		    sched->events, sched->events_size,
+		    sched->head ? &zero : NULL);
+		++sched->stats.kevents;
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return (-1);
+		}
+		sched->nchanges = 0;
+		sched->stats.events += (uint64_t)n;
+
+		for (int i = 0; i < n; ++i) {
+			task = sched->events[i].udata;
+			task->event = sched->events[i];
+			runq_push(sched, task);
+		}
+	}
+	return (0);
+}
+
+void
+coro_sched_stats(struct coro_sched const *sched,
+    struct coro_sched_stats *stats)
+{
+	*stats = sched->stats;
+}
+
+static void
+park(struct coro_sched *sched)
+{
+	struct coro_task *task = sched->current;
+
+	(void)coro_transfer(task->scheduler, NULL);
+}
+
+void
+coro_sched_yield(struct coro_sched *sched)
+{
+	runq_push(sched, sched->current);
+	park(sched);
+}
+
+int
+coro_sched_wait(struct coro_sched *sched, int fd, short filter,
+    struct kevent *kev)
+{
+	struct coro_task *task = sched->current;
+
+	if (sched->nchanges == sched->changes_size) {
+		int size = sched->changes_size ? sched->changes_size * 2 : 64;
+		struct kevent *changes, *events;
+
+		if (!(changes = realloc(sched->changes,
+			  (size_t)size * sizeof(struct kevent)))) {
+			return (-1);
+		}
+		sched->changes = changes;
+		sched->changes_size = size;
+		if (size > sched->events_size) {
+			if (!(events = realloc(sched->events,
+				  (size_t)size * sizeof(struct kevent)))) {
+				return (-1);
+			}
+			sched->events = events;
+			sched->events_size = size;
+		}
+	}
+
+	EV_SET(&sched->changes[sched->nchanges], fd, filter,
+	    EV_ADD | EV_ONESHOT, 0, 0, task);
+	++sched->nchanges;
+	++sched->nwaiting;
+	park(sched);
+	--sched->nwaiting;
+
+	if (kev) {
+		*kev = task->event;
+	}
+	if (task->event.flags & EV_ERROR) {
+		errno = (int)task->event.data;
+		return (-1);
+	}
+	return (0);
+}
+
+ssize_t
+coro_sched_read(struct coro_sched *sched, int fd, void *buf, size_t nbytes)
+{
+	for (;;) {
+		ssize_t n = read(fd, buf, nbytes);
+
+		if (n >= 0 || errno != EAGAIN) {
+			return (n);
+		}
+		if (coro_sched_wait(sched, fd, EVFILT_READ, NULL) < 0) {
+			return (-1);
+		}
+	}
+}
+
+ssize_t
+coro_sched_write(struct coro_sched *sched, int fd, void const *buf,
+    size_t nbytes)
+{
+	size_t written = 0;
+
+	while (written < nbytes) {
+		ssize_t n = write(fd, (char const *)buf + written,
+		    nbytes - written);
+
+		if (n >= 0) {
+			written += (size_t)n;
+			continue;
+		}
+		if (errno != EAGAIN ||
+		    coro_sched_wait(sched, fd, EVFILT_WRITE, NULL) < 0) {
+			return (-1);
+		}
+	}
+	return ((ssize_t)written);
+}
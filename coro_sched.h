@@ -0,0 +1,68 @@
+#ifndef CORO_SCHED_H_
+#define CORO_SCHED_H_
+
+#include <sys/types.h>
+#include <sys/event.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A single-threaded scheduler for coroutines doing I/O on non-blocking
+ * descriptors. A task that has to wait for a descriptor registers it with
+ * the scheduler's kqueue as EV_ONESHOT, with the task itself as 'udata',
+ * and transfers back to the scheduler. The scheduler runs the tasks that
+ * are runnable when a round starts, submits all registrations of the round
+ * in one kevent(2) call and makes the tasks of the events it harvests
+ * runnable again. Tasks that yield run in the next round; while there are
+ * any, kevent(2) does not block.
+ *
+ * Tasks are coro.h coroutines, created by the scheduler when they first
+ * run, so coro_sched_spawn() may be called from within tasks. Thousands of
+ * tasks need the ucontext backend; the pthread backend makes every task a
+ * thread.
+ *
+ * At most one task may wait for a given descriptor and filter at a time:
+ * the second registration would replace the first.
+ */
+
+struct coro_sched;
+
+struct coro_sched_stats {
+	uint64_t switches; /* transfers into tasks */
+	uint64_t kevents;  /* kevent(2) calls */
+	uint64_t events;   /* events harvested */
+};
+
+struct coro_sched *coro_sched_create(size_t /* stack_size */);
+void coro_sched_destroy(struct coro_sched * /* sched */);
+
+int coro_sched_spawn(struct coro_sched * /* sched */,
+    void (*/* fun */)(struct coro_sched *, void *), void * /* arg */);
+
+/*
+ * Runs tasks until all of them have returned. Returns 0, or -1 if kevent(2)
+ * or creating a coroutine failed.
+ */
+int coro_sched_run(struct coro_sched * /* sched */);
+
+void coro_sched_stats(struct coro_sched const * /* sched */,
+    struct coro_sched_stats * /* stats */);
+
+/*
+ * The following may only be called from within tasks.
+ *
+ * coro_sched_wait() parks the task until 'fd' triggers 'filter' and stores
+ * the event in 'kev', if not NULL. It returns -1 with errno set if the
+ * registration failed. coro_sched_read() waits until read(2) does not fail
+ * with EAGAIN; coro_sched_write() waits until all of 'buf' is written.
+ */
+void coro_sched_yield(struct coro_sched * /* sched */);
+int coro_sched_wait(struct coro_sched * /* sched */, int /* fd */,
+    short /* filter */, struct kevent * /* kev */);
+ssize_t coro_sched_read(struct coro_sched * /* sched */, int /* fd */,
+    void * /* buf */, size_t /* nbytes */);
+ssize_t coro_sched_write(struct coro_sched * /* sched */, int /* fd */,
+    void const * /* buf */, size_t /* nbytes */);
+
+#endif
@@ -0,0 +1,98 @@
+#include <sys/mman.h>
+
+#include <stdint.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "coro_stack.h"
+
+#define CORO_STACK_POOL_BUCKETS 8
+#define CORO_STACK_POOL_DEPTH 1024
+
+/* Free stacks are chained through their lowest usable word. */
+struct coro_stack_free {
+	struct coro_stack_free *next;
+};
+
+struct coro_stack_bucket {
+	size_t size;
+	size_t count;
+	struct coro_stack_free *head;
+};
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct coro_stack_bucket pool[CORO_STACK_POOL_BUCKETS];
+
+int
+coro_stack_alloc(struct coro_stack *stack, size_t size)
+{
+	size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	char *region;
+
+	if (size < CORO_STACK_MIN) {
+		size = CORO_STACK_MIN;
+	}
+	size = (size + page_size - 1) & ~(page_size - 1);
+
+	pthread_mutex_lock(&pool_mutex);
+	for (size_t i = 0; i < CORO_STACK_POOL_BUCKETS; ++i) {
+		struct coro_stack_bucket *bucket = &pool[i];
+
+		if (bucket->size == size && bucket->head) {
+			stack->base = bucket->head;
+			stack->size = size;
+			bucket->head = bucket->head->next;
+			--bucket->count;
+			pthread_mutex_unlock(&pool_mutex);
+			return (0);
+		}
+	}
+	pthread_mutex_unlock(&pool_mutex);
+
+	region = mmap(NULL, size + page_size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (region == MAP_FAILED) {
+		return (-1);
+	}
+	if (mprotect(region, page_size, PROT_NONE) < 0) {
+		(void)munmap(region, size + page_size);
+		return (-1);
+	}
+
+	stack->base = region + page_size;
+	stack->size = size;
+
+	return (0);
+}
+
+void
+coro_stack_free(struct coro_stack *stack)
+{
+	size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	struct coro_stack_bucket *bucket = NULL;
+
+	pthread_mutex_lock(&pool_mutex);
+	for (size_t i = 0; i < CORO_STACK_POOL_BUCKETS; ++i) {
+		if (pool[i].size == stack->size) {
+			bucket = &pool[i];
+			break;
+		}
+		if (!bucket && pool[i].count == 0) {
+			bucket = &pool[i];
+		}
+	}
+	if (bucket && bucket->count < CORO_STACK_POOL_DEPTH) {
+		struct coro_stack_free *entry = stack->base;
+
+		bucket->size = stack->size;
+		entry->next = bucket->head;
+		bucket->head = entry;
+		++bucket->count;
+		pthread_mutex_unlock(&pool_mutex);
+		return;
+	}
+	pthread_mutex_unlock(&pool_mutex);
+
+	(void)munmap((char *)stack->base - page_size, stack->size + page_size);
+}
@@ -0,0 +1,23 @@
+#ifndef CORO_STACK_H_
+#define CORO_STACK_H_
+
+#include <stddef.h>
+
+/*
+ * Coroutine stacks are mmap(2)'d regions with a PROT_NONE guard page below
+ * the usable area. Freed stacks are kept in a per-size pool and handed out
+ * again by coro_stack_alloc(), so creating many short-lived coroutines does
+ * not cost an mmap(2)/munmap(2) pair each.
+ */
+
+#define CORO_STACK_MIN (16 * 1024)
+
+struct coro_stack {
+	void *base; /* lowest usable address, just above the guard page */
+	size_t size;
+};
+
+int coro_stack_alloc(struct coro_stack * /* stack */, size_t /* size */);
+void coro_stack_free(struct coro_stack * /* stack */);
+
+#endif
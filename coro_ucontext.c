@@ -0,0 +1,231 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <ucontext.h>
+
+#include "coro.h"
+#include "coro_stack.h"
+
+/*
+ * On x86-64 and aarch64 ELF targets, switching is done by a small assembly
+ * routine that only saves and restores the callee-saved registers. This
+ * avoids the sigprocmask(2) system call swapcontext(3) does on every switch.
+ * Other targets fall back to makecontext(3)/swapcontext(3).
+ */
+#if defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__))
+#define CORO_UCONTEXT_ASM
+#endif
+
+struct coro_ucontext {
+#ifdef CORO_UCONTEXT_ASM
+	void *sp;
+#else
+	ucontext_t uc;
+#endif
+	struct coro_stack stack;
+	void (*fun)(Coro, void *);
+	struct coro_ucontext *parent;
+};
+
+static _Thread_local struct coro_ucontext main_coro;
+static _Thread_local struct coro_ucontext *current_coro;
+static _Thread_local void *transfer_arg;
+
+#ifdef CORO_UCONTEXT_ASM
+
+void coro_ucontext_swap(void ** /* save_sp */, void * /* sp */)
+    __attribute__((__visibility__("hidden")));
+
+#if defined(__x86_64__)
+__asm__(".text\n"
+	".globl coro_ucontext_swap\n"
+	".hidden coro_ucontext_swap\n"
+	".type coro_ucontext_swap, @function\n"
+	".p2align 4\n"
+	"coro_ucontext_swap:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size coro_ucontext_swap, .-coro_ucontext_swap\n");
+
+/* r15, r14, r13, r12, rbx, rbp, return address, fake caller address */
+#define CORO_FRAME_WORDS 8
+#define CORO_FRAME_ENTRY 6
+#elif defined(__aarch64__)
+__asm__(".text\n"
+	".globl coro_ucontext_swap\n"
+	".hidden coro_ucontext_swap\n"
+	".type coro_ucontext_swap, %function\n"
+	".p2align 4\n"
+	"coro_ucontext_swap:\n"
+	"	sub sp, sp, #176\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mov x2, sp\n"
+	"	str x2, [x0]\n"
+	"	mov sp, x1\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	add sp, sp, #176\n"
+	"	ret\n"
+	".size coro_ucontext_swap, .-coro_ucontext_swap\n");
+
+/* x19-x28, x29, x30 (return address), d8-d15, padding */
+#define CORO_FRAME_WORDS 22
+#define CORO_FRAME_ENTRY 11
+#endif
+
+#endif
+
+static struct coro_ucontext *
+coro_current(void)
+{
+	if (!current_coro) {
+		current_coro = &main_coro;
+	}
+
+	return (current_coro);
+}
+
+static void
+coro_entry(void)
+{
+	struct coro_ucontext *coro = coro_current();
+
+	coro->fun(coro->parent, transfer_arg);
+
+	/*
+	 * There is no thread to join like in the pthread backend, so a
+	 * coroutine whose function returns just hands control back to its
+	 * parent for good.
+	 */
+	for (;;) {
+		(void)coro_transfer(coro->parent, NULL);
+	}
+}
+
+#ifndef CORO_UCONTEXT_ASM
+static int
+coro_make_context(struct coro_ucontext *coro)
+{
+	if (getcontext(&coro->uc) < 0) {
+		return (-1);
+	}
+	coro->uc.uc_stack.ss_sp = coro->stack.base;
+	coro->uc.uc_stack.ss_size = coro->stack.size;
+	coro->uc.uc_link = NULL;
+	makecontext(&coro->uc, coro_entry, 0);
+
+	return (0);
+}
+#endif
+
+Coro
+coro_create(size_t size, void (*fun)(Coro, void *))
+{
+	struct coro_ucontext *coro;
+
+	coro = calloc(1, sizeof(struct coro_ucontext));
+	if (!coro) {
+		return (NULL);
+	}
+
+	if (coro_stack_alloc(&coro->stack, size) < 0) {
+		free(coro);
+		return (NULL);
+	}
+	coro->fun = fun;
+	coro->parent = coro_current();
+
+#ifdef CORO_UCONTEXT_ASM
+	{
+		uintptr_t *frame = (uintptr_t *)((char *)coro->stack.base +
+		    coro->stack.size);
+
+		frame -= CORO_FRAME_WORDS;
+		for (size_t i = 0; i < CORO_FRAME_WORDS; ++i) {
+			frame[i] = 0;
+		}
+		frame[CORO_FRAME_ENTRY] = (uintptr_t)coro_entry;
+		coro->sp = frame;
+	}
+#else
+	if (coro_make_context(coro) < 0) {
+		coro_stack_free(&coro->stack);
+		free(coro);
+		return (NULL);
+	}
+#endif
+
+	return (coro);
+}
+
+/*
+ * A coroutine may be resumed on another thread than the one it was
+ * suspended on. Reading 'transfer_arg' in a function of its own keeps the
+ * compiler from reusing the address of the old thread's copy computed
+ * before the switch.
+ */
+static __attribute__((__noinline__)) void *
+coro_transfer_arg(void)
+{
+	void **arg = &transfer_arg;
+
+	__asm__ __volatile__("" : "+r"(arg));
+	return (*arg);
+}
+
+void *
+coro_transfer(Coro coro_p, void *arg)
+{
+	struct coro_ucontext *coro = (struct coro_ucontext *)coro_p;
+	struct coro_ucontext *self = coro_current();
+
+	transfer_arg = arg;
+	current_coro = coro;
+
+#ifdef CORO_UCONTEXT_ASM
+	coro_ucontext_swap(&self->sp, coro->sp);
+#else
+	(void)swapcontext(&self->uc, &coro->uc);
+#endif
+
+	return (coro_transfer_arg());
+}
+
+void
+coro_destroy(Coro coro_p)
+{
+	struct coro_ucontext *coro = (struct coro_ucontext *)coro_p;
+
+	coro_stack_free(&coro->stack);
+	free(coro);
+}
@@ -0,0 +1,714 @@
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "explore.h"
+#include "result_sink.h"
+#include "scenario.h"
+
+#define FILTER_READ 0
+#define FILTER_WRITE 1
+
+struct explore_op {
+	enum scenario_op op;
+	int actor;
+	size_t count;
+};
+
+/*
+ * Reference model of a FreeBSD FIFO as seen through non-blocking
+ * descriptors, each with EVFILT_READ and EVFILT_WRITE registered with
+ * EV_CLEAR on a kqueue of its own:
+ *
+ * - Every writer open bumps 'wgen'. A reader sees EOF once there are no
+ *   writers and at least one writer has come and gone since it opened.
+ * - A knote becomes pending when it is activated while its filter is true.
+ *   Registration activates it, reader opens and closes activate the
+ *   writers, writer opens and closes activate the readers, and every read
+ *   or write that moves data activates everyone.
+ * - kevent(2) returns pending knotes whose filter is still true and clears
+ *   them either way.
+ * - The FIFO is emptied when the last descriptor is closed.
+ */
+struct model_actor {
+	bool open;
+	bool reader;
+	unsigned long seq;
+	bool pending[2];
+};
+
+struct model {
+	long cap;
+	bool check_poll;
+	size_t cnt;
+	int nreaders;
+	int nwriters;
+	unsigned long wgen;
+	int nactors;
+	/* The last slot is reserved for probes. */
+	struct model_actor actors[SCENARIO_MAX_ACTORS + 1];
+};
+
+#define PROBE_ACTOR SCENARIO_MAX_ACTORS
+
+static void
+model_init(struct model *m, struct explore_options const *options)
+{
+	*m = (struct model) {
+		.cap = options->pipe_capacity,
+		.check_poll = options->check_poll,
+		.nactors = options->nreaders + options->nwriters,
+	};
+	for (int i = 0; i < m->nactors; ++i) {
+		m->actors[i].reader = i < options->nreaders;
+	}
+}
+
+static bool
+model_eof(struct model const *m, struct model_actor const *a)
+{
+	return (m->nwriters == 0 && m->wgen != a->seq);
+}
+
+static size_t
+model_space(struct model const *m)
+{
+	return ((size_t)m->cap - m->cnt);
+}
+
+/* Evaluates a filter; fills in what kevent(2) would return for it. */
+static bool
+model_filter(struct model const *m, struct model_actor const *a, int filter,
+    struct scenario_kevent *kev)
+{
+	if (filter == FILTER_READ && a->reader) {
+		bool eof = model_eof(m, a);
+
+		*kev = (struct scenario_kevent) {
+			.filter = EVFILT_READ,
+			.flags = eof ? EV_EOF : 0,
+			.data = (long)m->cnt,
+		};
+		return (m->cnt > 0 || eof);
+	}
+	if (filter == FILTER_WRITE && !a->reader) {
+		*kev = (struct scenario_kevent) {
+			.filter = EVFILT_WRITE,
+			.flags = m->nreaders == 0 ? EV_EOF : 0,
+			.data_relative = true,
+			.data = -(long)m->cnt,
+		};
+		return (m->nreaders == 0 || model_space(m) >= PIPE_BUF);
+	}
+
+	return (false);
+}
+
+static void
+model_activate(struct model *m, struct model_actor *a)
+{
+	struct scenario_kevent kev;
+
+	for (int f = FILTER_READ; f <= FILTER_WRITE; ++f) {
+		if (model_filter(m, a, f, &kev)) {
+			a->pending[f] = true;
+		}
+	}
+}
+
+/* Activates the open readers and/or the open writers. */
+static void
+model_activate_all(struct model *m, bool readers, bool writers)
+{
+	for (int i = 0; i <= PROBE_ACTOR; ++i) {
+		struct model_actor *a = &m->actors[i];
+
+		if (a->open && (a->reader ? readers : writers)) {
+			model_activate(m, a);
+		}
+	}
+}
+
+/*
+ * Like FreeBSD's fifo_open() and fifo_close(), opens and closes only
+ * activate the other side's knotes when the first reader or writer comes
+ * or the last one goes.
+ */
+static int
+model_open(struct model *m, struct model_actor *a)
+{
+	if (a->reader) {
+		a->seq = m->wgen - (unsigned long)m->nwriters;
+		if (++m->nreaders == 1) {
+			model_activate_all(m, false, true);
+		}
+	} else {
+		if (m->nreaders == 0) {
+			return (ENXIO);
+		}
+		++m->wgen;
+		if (++m->nwriters == 1) {
+			model_activate_all(m, true, false);
+		}
+	}
+
+	a->open = true;
+	a->pending[FILTER_READ] = a->pending[FILTER_WRITE] = false;
+	model_activate(m, a);
+
+	return (0);
+}
+
+static void
+model_close(struct model *m, struct model_actor *a)
+{
+	a->open = false;
+	if (a->reader) {
+		if (--m->nreaders == 0) {
+			model_activate_all(m, false, true);
+		}
+	} else {
+		if (--m->nwriters == 0) {
+			model_activate_all(m, true, false);
+		}
+	}
+	if (m->nreaders == 0 && m->nwriters == 0) {
+		m->cnt = 0;
+	}
+}
+
+static ssize_t
+model_read(struct model *m, size_t count, int *error)
+{
+	size_t n;
+
+	if (m->cnt == 0) {
+		if (m->nwriters == 0) {
+			return (0);
+		}
+		*error = EAGAIN;
+		return (-1);
+	}
+
+	n = count < m->cnt ? count : m->cnt;
+	m->cnt -= n;
+	model_activate_all(m, true, true);
+
+	return ((ssize_t)n);
+}
+
+static ssize_t
+model_write(struct model *m, size_t count, int *error)
+{
+	size_t n;
+
+	if (m->nreaders == 0) {
+		*error = EPIPE;
+		return (-1);
+	}
+	/* Writes of up to PIPE_BUF bytes are atomic. */
+	if (model_space(m) == 0 ||
+	    (count <= PIPE_BUF && model_space(m) < count)) {
+		*error = EAGAIN;
+		return (-1);
+	}
+
+	n = count < model_space(m) ? count : model_space(m);
+	m->cnt += n;
+	model_activate_all(m, true, true);
+
+	return ((ssize_t)n);
+}
+
+/* Harvests the actor's kqueue and fills in what a check must see. */
+static void
+model_check(struct model *m, struct model_actor *a,
+    struct scenario_expect *expect)
+{
+	*expect = (struct scenario_expect) {
+		.any_revents = !m->check_poll,
+	};
+
+	if (a->reader) {
+		if (m->cnt > 0 || model_eof(m, a)) {
+			expect->revents |= POLLIN;
+		}
+		if (model_eof(m, a)) {
+			expect->revents |= POLLHUP;
+		}
+	} else if (m->nreaders == 0) {
+		expect->revents = POLLHUP;
+	} else if (model_space(m) >= PIPE_BUF) {
+		expect->revents = POLLOUT;
+	}
+
+	for (int f = FILTER_READ; f <= FILTER_WRITE; ++f) {
+		struct scenario_kevent kev;
+
+		if (a->pending[f] && model_filter(m, a, f, &kev)) {
+			expect->kevents[expect->nkevents++] = kev;
+		}
+		a->pending[f] = false;
+	}
+}
+
+/*
+ * Applies 'op' to the model and fills in 'step' with the expected results.
+ * Returns false if 'op' is not possible in the current state, so that
+ * any subsequence of a walk is a walk as well.
+ */
+static bool
+model_step(struct model *m, struct explore_op const *op,
+    struct scenario_step *step)
+{
+	struct model_actor *a = &m->actors[op->actor];
+
+	*step = (struct scenario_step) {
+		.op = op->op,
+		.actor = op->actor,
+		.open_flags = a->reader ? O_RDONLY : O_WRONLY,
+		.count = op->count,
+	};
+
+	if ((op->op == SCENARIO_OPEN) == a->open ||
+	    (op->op == SCENARIO_READ && !a->reader) ||
+	    (op->op == SCENARIO_WRITE && a->reader)) {
+		return (false);
+	}
+
+	switch (op->op) {
+	case SCENARIO_OPEN:
+		step->check_result = true;
+		step->error = model_open(m, a);
+		step->result = step->error ? -1 : 0;
+		break;
+	case SCENARIO_CLOSE:
+		model_close(m, a);
+		break;
+	case SCENARIO_REOPEN:
+		return (false);
+	case SCENARIO_READ:
+		step->check_result = true;
+		step->result = model_read(m, op->count, &step->error);
+		break;
+	case SCENARIO_WRITE:
+		step->check_result = true;
+		step->result = model_write(m, op->count, &step->error);
+		break;
+	case SCENARIO_CHECK: {
+		struct model_actor *probe = &m->actors[PROBE_ACTOR];
+
+		model_check(m, a, &step->expect);
+
+		/* Opening a probe writer without readers would fail. */
+		probe->reader = a->reader;
+		if (!probe->reader && m->nreaders == 0) {
+			break;
+		}
+		step->probe = true;
+		(void)model_open(m, probe);
+		model_check(m, probe, &step->probe_expect);
+		model_close(m, probe);
+		break;
+	}
+	}
+
+	return (true);
+}
+
+/**/
+
+struct worker {
+	struct explore_options const *options;
+	unsigned index;
+	uint64_t rng;
+	pthread_t thread;
+	char tmpdir[PATH_MAX];
+	char fifo_path[PATH_MAX];
+	struct scenario_ctx ctx;
+	struct result_sink sink;
+	char name[64];
+	char actor_names[SCENARIO_MAX_ACTORS][16];
+	struct explore_op *ops;
+	struct scenario_step *steps;
+	unsigned long walks;
+	int failed;
+};
+
+static pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* splitmix64 */
+static uint64_t
+next_random(uint64_t *state)
+{
+	uint64_t z = (*state += UINT64_C(0x9e3779b97f4a7c15));
+
+	z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+	z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+	return (z ^ (z >> 31));
+}
+
+static size_t
+random_below(uint64_t *state, size_t n)
+{
+	return ((size_t)(next_random(state) % n));
+}
+
+/* Sizes around PIPE_BUF and the capacity are the interesting ones. */
+static size_t
+random_count(uint64_t *state, size_t max)
+{
+	switch (random_below(state, 4)) {
+	case 0:
+		return (1);
+	case 1:
+		return (PIPE_BUF);
+	default:
+		return (1 + random_below(state, max));
+	}
+}
+
+static void
+generate(struct worker *w, size_t nops)
+{
+	struct model m;
+
+	model_init(&m, w->options);
+
+	for (size_t i = 0; i < nops; ++i) {
+		struct explore_op *op = &w->ops[i];
+		struct scenario_step step;
+		size_t roll;
+
+		op->actor = (int)random_below(&w->rng, (size_t)m.nactors);
+		op->count = 0;
+		roll = random_below(&w->rng, 100);
+
+		if (!m.actors[op->actor].open) {
+			op->op = SCENARIO_OPEN;
+		} else if (roll < 15) {
+			op->op = SCENARIO_CLOSE;
+		} else if (roll < 55 && m.actors[op->actor].reader) {
+			op->op = SCENARIO_READ;
+			op->count = random_count(&w->rng, 2 * PIPE_BUF);
+		} else if (roll < 55) {
+			op->op = SCENARIO_WRITE;
+			op->count = random_count(&w->rng, PIPE_BUF);
+		} else {
+			op->op = SCENARIO_CHECK;
+		}
+
+		(void)model_step(&m, op, &step);
+	}
+}
+
+/* Turns the ops not masked out by 'skip' into a scenario. */
+static void
+build(struct worker *w, size_t nops, bool const *skip,
+    struct scenario *scenario)
+{
+	struct model m;
+
+	model_init(&m, w->options);
+
+	*scenario = (struct scenario) {
+		.name = w->name,
+		.source = w->name,
+		.nactors = m.nactors,
+		.steps = w->steps,
+	};
+	for (int i = 0; i < m.nactors; ++i) {
+		scenario->actor_names[i] = w->actor_names[i];
+	}
+
+	for (size_t i = 0; i < nops; ++i) {
+		struct scenario_step *step = &w->steps[scenario->nsteps];
+
+		if (skip && skip[i]) {
+			continue;
+		}
+		if (model_step(&m, &w->ops[i], step)) {
+			/* Line numbers as printed by scenario_print(). */
+			step->line = (int)scenario->nsteps + 2;
+			++scenario->nsteps;
+		}
+	}
+}
+
+static bool
+fails(struct worker *w, size_t nops, bool const *skip)
+{
+	struct scenario_ctx ctx = w->ctx;
+	struct scenario scenario;
+
+	ctx.quiet = true;
+	ctx.verbose = false;
+	ctx.measure_latency = false;
+	ctx.sink = NULL;
+	build(w, nops, skip, &scenario);
+
+	return (scenario_run(&ctx, &scenario) < 0);
+}
+
+/*
+ * Removes ever smaller chunks of operations from a failing walk for as long
+ * as it keeps failing. Returns the number of remaining operations.
+ */
+static size_t
+shrink(struct worker *w, size_t nops)
+{
+	bool *skip, *trial;
+	size_t n = 0;
+
+	skip = calloc(nops, sizeof(bool));
+	trial = calloc(nops, sizeof(bool));
+	if (!skip || !trial) {
+		err(1, "calloc");
+	}
+
+	for (size_t chunk = nops / 2; chunk > 0; chunk /= 2) {
+		bool progress;
+
+		do {
+			progress = false;
+			for (size_t start = 0; start < nops; start += chunk) {
+				size_t end = start + chunk < nops
+				    ? start + chunk
+				    : nops;
+				bool removed = false;
+
+				memcpy(trial, skip, nops * sizeof(bool));
+				for (size_t i = start; i < end; ++i) {
+					removed |= !trial[i];
+					trial[i] = true;
+				}
+				if (removed && fails(w, nops, trial)) {
+					memcpy(skip, trial,
+					    nops * sizeof(bool));
+					progress = true;
+				}
+			}
+		} while (progress);
+	}
+
+	for (size_t i = 0; i < nops; ++i) {
+		if (!skip[i]) {
+			w->ops[n++] = w->ops[i];
+		}
+	}
+	free(trial);
+	free(skip);
+
+	return (n);
+}
+
+static void *
+worker_run(void *arg)
+{
+	struct worker *w = arg;
+	size_t length = w->options->length;
+
+	for (unsigned long walk = 0; walk < w->options->walks; ++walk) {
+		struct scenario scenario;
+
+		(void)snprintf(w->name, sizeof(w->name), "explore-%u-%lu",
+		    w->index, walk);
+		generate(w, length);
+		build(w, length, NULL, &scenario);
+
+		++w->walks;
+		w->ctx.quiet = true;
+		if (scenario_run(&w->ctx, &scenario) == 0) {
+			continue;
+		}
+
+		size_t nops = shrink(w, length);
+
+		pthread_mutex_lock(&output_mutex);
+		printf("# job %u, walk %lu: %zu operations, shrunk to %zu\n",
+		    w->index, walk, length, nops);
+		build(w, nops, NULL, &scenario);
+		scenario_print(stdout, &scenario);
+		fflush(stdout);
+		w->ctx.quiet = false;
+		(void)scenario_run(&w->ctx, &scenario);
+		pthread_mutex_unlock(&output_mutex);
+
+		++w->failed;
+		break;
+	}
+
+	if (w->ctx.sink && result_sink_flush(w->ctx.sink) < 0) {
+		warn("results");
+	}
+
+	return (NULL);
+}
+
+static int
+worker_init(struct worker *w, struct explore_options const *options,
+    unsigned index, char const *dir)
+{
+	uint64_t seed = options->seed;
+	uint64_t rng = 0;
+
+	/*
+	 * Job 'index' starts from the index-th output of the seed's stream,
+	 * so that no job of one seed replays a job of another.
+	 */
+	for (unsigned i = 0; i <= index; ++i) {
+		rng = next_random(&seed);
+	}
+
+	*w = (struct worker) {
+		.options = options,
+		.index = index,
+		.rng = rng,
+		.ctx = {
+			.pipe_capacity = options->pipe_capacity,
+			.verbose = options->verbose,
+			.measure_latency = options->measure_latency,
+		},
+	};
+
+	for (int i = 0; i < options->nreaders + options->nwriters; ++i) {
+		if (i < options->nreaders) {
+			(void)snprintf(w->actor_names[i],
+			    sizeof(w->actor_names[i]), "r%d", i);
+		} else {
+			(void)snprintf(w->actor_names[i],
+			    sizeof(w->actor_names[i]), "w%d",
+			    i - options->nreaders);
+		}
+	}
+
+	w->ops = calloc(options->length, sizeof(struct explore_op));
+	w->steps = calloc(options->length, sizeof(struct scenario_step));
+	if (!w->ops || !w->steps) {
+		warn("calloc");
+		return (-1);
+	}
+
+	(void)snprintf(w->tmpdir, sizeof(w->tmpdir),
+	    "%s/fifo-kqueue.XXXXXX", dir);
+	if (!mkdtemp(w->tmpdir)) {
+		warn("mkdtemp");
+		w->tmpdir[0] = '\0';
+		return (-1);
+	}
+	if ((size_t)snprintf(w->fifo_path, sizeof(w->fifo_path), "%s/fifo",
+		w->tmpdir) >= sizeof(w->fifo_path)) {
+		warnx("%s: path too long", w->tmpdir);
+		return (-1);
+	}
+	if (mkfifo(w->fifo_path, 0600) < 0) {
+		warn("mkfifo");
+		return (-1);
+	}
+	w->ctx.fifo_path = w->fifo_path;
+	if (options->results_fd >= 0) {
+		result_sink_init(&w->sink, options->results_fd);
+		w->ctx.sink = &w->sink;
+	}
+
+	return (0);
+}
+
+static void
+worker_fini(struct worker *w)
+{
+	if (w->tmpdir[0] != '\0') {
+		(void)unlink(w->fifo_path);
+		(void)rmdir(w->tmpdir);
+	}
+	free(w->ops);
+	free(w->steps);
+	result_sink_fini(&w->sink);
+}
+
+bool
+explore_options_valid(struct explore_options const *options)
+{
+	return (options->nreaders >= 1 && options->nwriters >= 1 &&
+	    options->nreaders + options->nwriters <= SCENARIO_MAX_ACTORS &&
+	    options->length > 0 && options->jobs > 0 &&
+	    options->pipe_capacity >= PIPE_BUF);
+}
+
+int
+explore(struct explore_options const *options)
+{
+	struct worker *workers;
+	char const *dir = options->dir;
+	unsigned long walks = 0, steps = 0;
+	int failed = 0;
+	unsigned started;
+	int error;
+
+	if (!explore_options_valid(options)) {
+		warnx("explore: bad options");
+		return (-1);
+	}
+	if (!dir) {
+		dir = getenv("TMPDIR");
+	}
+	if (!dir) {
+		dir = "/tmp";
+	}
+
+	workers = calloc(options->jobs, sizeof(struct worker));
+	if (!workers) {
+		warn("calloc");
+		return (-1);
+	}
+
+	for (started = 0; started < options->jobs; ++started) {
+		struct worker *w = &workers[started];
+
+		if (worker_init(w, options, started, dir) < 0) {
+			worker_fini(w);
+			failed = -1;
+			break;
+		}
+		if ((error = pthread_create(&w->thread, NULL, worker_run,
+			 w)) != 0) {
+			errno = error;
+			warn("pthread_create");
+			worker_fini(w);
+			failed = -1;
+			break;
+		}
+	}
+
+	for (unsigned i = 0; i < started; ++i) {
+		struct worker *w = &workers[i];
+
+		(void)pthread_join(w->thread, NULL);
+		walks += w->walks;
+		steps += w->ctx.steps;
+		if (failed >= 0) {
+			failed += w->failed;
+		}
+		worker_fini(w);
+	}
+	free(workers);
+
+	fprintf(stderr, "%u jobs, %lu walks, %lu steps, %d failed\n", started,
+	    walks, steps, failed < 0 ? 0 : failed);
+
+	return (failed);
+}
@@ -0,0 +1,46 @@
+#ifndef EXPLORE_H_
+#define EXPLORE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Randomly walks open/close/read/write/check sequences over 'nreaders'
+ * readers and 'nwriters' writers of a FIFO and checks every step against a
+ * reference model of FreeBSD FIFO semantics. Every job runs 'walks' walks of
+ * 'length' operations on its own FIFO in 'dir'. Failing walks are shrunk
+ * and printed to stdout as scenarios that fifo-kqueue can replay.
+ *
+ * If 'results_fd' is not -1, every job records the steps of its walks there
+ * as JSON lines, see result_sink.h.
+ *
+ * Unless 'check_poll' is set, poll(2) results are not checked, as they
+ * differ between systems far more than kevent(2) results do.
+ */
+
+struct explore_options {
+	int nreaders;
+	int nwriters;
+	size_t length;
+	unsigned long walks;
+	unsigned jobs;
+	uint64_t seed;
+	long pipe_capacity;
+	bool check_poll;
+	bool verbose;
+	bool measure_latency;
+	int results_fd;
+	char const *dir;
+};
+
+/* Returns whether explore() accepts 'options'. */
+bool explore_options_valid(struct explore_options const *options);
+
+/*
+ * Returns the number of failed walks, or -1 if the options are invalid or
+ * setting up the walks failed.
+ */
+int explore(struct explore_options const *options);
+
+#endif
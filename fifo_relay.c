@@ -0,0 +1,520 @@
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pipe_size.h"
+
+/*
+ * fifo-relay copies everything written to a FIFO (or to a pipe on standard
+ * input) to one or more outputs, which may be FIFOs, pipes or regular
+ * files, until the input reaches EOF.
+ *
+ * Data moves in rounds: a round takes what is in the input and hands it to
+ * every output, and the next round starts once all outputs have written
+ * their share. Outputs are non-blocking and registered for EVFILT_WRITE
+ * with EV_CLEAR, the input for EVFILT_READ with EV_CLEAR, so the relay does
+ * I/O until EAGAIN before it waits.
+ *
+ * On Linux, a round tee(2)s the input into a staging pipe per output and
+ * splice(2)s it into the last one, and every output drains its staging
+ * pipe with splice(2): the data never passes through user space. The
+ * staging pipes are as large as the input pipe, so each round fits in one
+ * tee(2) call. An output that splice(2) refuses drains its staging pipe
+ * with read(2) and write(2) instead. Elsewhere, or with -b, a round is
+ * read(2) into a buffer and written to every output.
+ */
+
+#if defined(SPLICE_F_NONBLOCK) && defined(F_GETPIPE_SZ)
+#define RELAY_SPLICE
+#endif
+
+#define RELAY_BUFFER_SIZE (64 * 1024)
+
+struct output {
+	char const *path;
+	int fd;
+	bool pollable;	/* registered with the kqueue, may block */
+	bool blocked;	/* waiting for EVFILT_WRITE */
+	bool closed;	/* the reader went away */
+	size_t pending; /* bytes of the current round not yet written */
+	int stage[2];	/* splice mode: staging pipe */
+	bool copy;	/* splice mode: splice(2) refused, copy the stage */
+	char *buf;	/* copy and buffered mode: 'pending' starts at 'off' */
+	size_t off;
+	size_t len;
+};
+
+struct relay {
+	int in;
+	bool in_pollable;
+	bool in_eof; /* splice mode: EVFILT_READ reported EV_EOF */
+	bool done;   /* the input is at EOF and drained */
+	bool splice;
+	struct output *outputs;
+	size_t noutputs;
+	size_t nlive;
+	char *chunk; /* buffered mode */
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t copied;  /* bytes copied from or to user space */
+	uint64_t avoided; /* bytes moved without such a copy */
+	uint64_t wakeups;
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec);
+}
+
+static void
+set_nonblock(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		err(1, "fcntl");
+	}
+}
+
+/* Opening a FIFO blocks until the other end is opened, too. */
+static int
+open_input(char const *path)
+{
+	int fd;
+
+	if (strcmp(path, "-") == 0) {
+		fd = STDIN_FILENO;
+	} else if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		err(1, "%s", path);
+	}
+	set_nonblock(fd);
+	return (fd);
+}
+
+static void
+open_output(struct output *o, char const *path)
+{
+	struct stat st;
+
+	o->path = path;
+	o->stage[0] = o->stage[1] = -1;
+	if (strcmp(path, "-") == 0) {
+		o->fd = STDOUT_FILENO;
+	} else if (stat(path, &st) == 0 && S_ISFIFO(st.st_mode)) {
+		o->fd = open(path, O_WRONLY | O_CLOEXEC);
+	} else {
+		o->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		    0666);
+	}
+	if (o->fd < 0 || fstat(o->fd, &st) < 0) {
+		err(1, "%s", path);
+	}
+
+	/* Writes to files and devices do not fail with EAGAIN. */
+	o->pollable = !S_ISREG(st.st_mode) && !S_ISCHR(st.st_mode) &&
+	    !S_ISBLK(st.st_mode);
+	if (o->pollable) {
+		set_nonblock(o->fd);
+	}
+}
+
+static void
+close_output(struct relay *r, struct output *o)
+{
+	warnx("%s: reader went away", o->path);
+	close(o->fd);
+	if (o->stage[0] >= 0) {
+		close(o->stage[0]);
+		close(o->stage[1]);
+	}
+	o->closed = true;
+	o->pending = 0;
+	--r->nlive;
+}
+
+#ifdef RELAY_SPLICE
+static void
+open_stages(struct relay *r)
+{
+	long size = fcntl(r->in, F_GETPIPE_SZ), n;
+
+	if (size < 0) {
+		err(1, "fcntl");
+	}
+	for (size_t i = 0; i < r->noutputs; ++i) {
+		struct output *o = &r->outputs[i];
+
+		if (pipe2(o->stage, O_CLOEXEC | O_NONBLOCK) < 0) {
+			err(1, "pipe2");
+		}
+		if ((n = pipe_size_set(o->stage[1], size)) < 0) {
+			err(1, "fcntl");
+		}
+		if (n < size) {
+			errx(1, "staging pipe of %ld bytes is too small", n);
+		}
+	}
+}
+
+/*
+ * Stages the data in the input for every output. Returns the number of
+ * bytes, 0 if the input is empty.
+ */
+static size_t
+distribute_splice(struct relay *r)
+{
+	struct output *prev = NULL;
+	int avail;
+	ssize_t n;
+
+	if (ioctl(r->in, FIONREAD, &avail) < 0) {
+		err(1, "ioctl");
+	}
+	if (avail == 0) {
+		r->done = r->in_eof;
+		return (0);
+	}
+	if (r->nlive == 0) {
+		return (0);
+	}
+
+	/* Every output but the last gets a copy, the last one the data. */
+	for (size_t i = 0; i < r->noutputs; ++i) {
+		struct output *o = &r->outputs[i];
+
+		if (o->closed) {
+			continue;
+		}
+		if (prev) {
+			if ((n = tee(r->in, prev->stage[1], (size_t)avail,
+				 SPLICE_F_NONBLOCK)) < 0) {
+				err(1, "tee");
+			}
+			if (n != avail) {
+				errx(1, "tee: short transfer");
+			}
+			prev->pending = (size_t)avail;
+		}
+		prev = o;
+	}
+	if ((n = splice(r->in, NULL, prev->stage[1], NULL, (size_t)avail,
+		 SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) < 0) {
+		err(1, "splice");
+	}
+	if (n != avail) {
+		errx(1, "splice: short transfer");
+	}
+	prev->pending = (size_t)avail;
+
+	r->avoided += (uint64_t)avail;
+	return ((size_t)avail);
+}
+#endif
+
+static size_t
+distribute(struct relay *r)
+{
+	ssize_t n;
+
+#ifdef RELAY_SPLICE
+	if (r->splice) {
+		return (distribute_splice(r));
+	}
+#endif
+	if ((n = read(r->in, r->chunk, RELAY_BUFFER_SIZE)) < 0) {
+		if (errno == EAGAIN) {
+			return (0);
+		}
+		err(1, "read");
+	}
+	if (n == 0) {
+		r->done = true;
+		return (0);
+	}
+	r->copied += (uint64_t)n;
+
+	for (size_t i = 0; i < r->noutputs; ++i) {
+		struct output *o = &r->outputs[i];
+
+		if (!o->closed) {
+			o->buf = r->chunk;
+			o->off = 0;
+			o->len = o->pending = (size_t)n;
+		}
+	}
+	return ((size_t)n);
+}
+
+/* Refills the buffer of an output in copy mode from its staging pipe. */
+static void
+refill(struct relay *r, struct output *o)
+{
+	ssize_t n;
+
+	if (!o->buf && !(o->buf = malloc(RELAY_BUFFER_SIZE))) {
+		err(1, "malloc");
+	}
+	n = read(o->stage[0], o->buf,
+	    o->pending < RELAY_BUFFER_SIZE ? o->pending : RELAY_BUFFER_SIZE);
+	if (n <= 0) {
+		err(1, "read");
+	}
+	o->off = 0;
+	o->len = (size_t)n;
+	r->copied += (uint64_t)n;
+}
+
+/* Writes as much of the current round to 'o' as it takes. */
+static void
+drain(struct relay *r, struct output *o)
+{
+	while (o->pending > 0 && !o->blocked) {
+		ssize_t n;
+
+#ifdef RELAY_SPLICE
+		if (r->splice && !o->copy) {
+			n = splice(o->stage[0], NULL, o->fd, NULL, o->pending,
+			    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n < 0 && errno == EINVAL) {
+				warnx("%s: cannot splice, copying", o->path);
+				o->copy = true;
+				continue;
+			}
+			if (n > 0) {
+				r->avoided += (uint64_t)n;
+			}
+		} else
+#endif
+		{
+			if (r->splice && o->off == o->len) {
+				refill(r, o);
+			}
+			n = write(o->fd, o->buf + o->off, o->len - o->off);
+			if (n > 0) {
+				o->off += (size_t)n;
+				r->copied += (uint64_t)n;
+			}
+		}
+
+		if (n < 0) {
+			if (errno == EAGAIN && o->pollable) {
+				o->blocked = true;
+			} else if (errno == EPIPE) {
+				close_output(r, o);
+			} else {
+				err(1, "%s", o->path);
+			}
+			return;
+		}
+		o->pending -= (size_t)n;
+		r->bytes_out += (uint64_t)n;
+	}
+}
+
+static bool
+round_done(struct relay const *r)
+{
+	for (size_t i = 0; i < r->noutputs; ++i) {
+		if (r->outputs[i].pending > 0) {
+			return (false);
+		}
+	}
+	return (true);
+}
+
+static void
+relay(struct relay *r)
+{
+	struct kevent *events;
+	size_t nevents = r->noutputs + 1;
+	int kq;
+
+	if (!(events = calloc(nevents, sizeof(struct kevent)))) {
+		err(1, "calloc");
+	}
+	if ((kq = kqueue()) < 0) {
+		err(1, "kqueue");
+	}
+	EV_SET(&events[0], r->in, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0,
+	    NULL);
+	if (r->in_pollable && kevent(kq, &events[0], 1, NULL, 0, NULL) < 0) {
+		err(1, "kevent");
+	}
+	for (size_t i = 0; i < r->noutputs; ++i) {
+		struct output *o = &r->outputs[i];
+
+		if (!o->pollable) {
+			continue;
+		}
+		EV_SET(&events[0], o->fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0,
+		    0, o);
+		if (kevent(kq, &events[0], 1, NULL, 0, NULL) < 0) {
+			err(1, "kevent");
+		}
+	}
+
+	for (;;) {
+		bool progress;
+		int n;
+
+		do {
+			size_t in = 0;
+
+			progress = false;
+			if (r->nlive == 0) {
+				break;
+			}
+			if (round_done(r) && !r->done &&
+			    (in = distribute(r)) > 0) {
+				r->bytes_in += in;
+				progress = true;
+			}
+			for (size_t i = 0; i < r->noutputs; ++i) {
+				struct output *o = &r->outputs[i];
+				size_t pending = o->pending;
+
+				drain(r, o);
+				progress |= o->pending != pending;
+			}
+		} while (progress);
+
+		if (r->nlive == 0) {
+			errx(1, "all outputs went away");
+		}
+		if (r->done && round_done(r)) {
+			break;
+		}
+
+		if ((n = kevent(kq, NULL, 0, events, (int)nevents, NULL)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			err(1, "kevent");
+		}
+		++r->wakeups;
+		for (int i = 0; i < n; ++i) {
+			struct output *o = events[i].udata;
+
+			if (o) {
+				o->blocked = false;
+			} else if (events[i].flags & EV_EOF) {
+				r->in_eof = true;
+			}
+		}
+	}
+
+	close(kq);
+	free(events);
+}
+
+static void
+usage(char const *progname)
+{
+	fprintf(stderr, "usage: %s [-b] input output...\n", progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	char const *progname = argv[0];
+	struct relay r = { .splice = true };
+	struct stat st;
+	uint64_t start, elapsed;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "b")) != -1) {
+		switch (ch) {
+		case 'b':
+			r.splice = false;
+			break;
+		default:
+			usage(progname);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 2) {
+		usage(progname);
+	}
+
+	/* A reader going away shows up as EPIPE. */
+	(void)signal(SIGPIPE, SIG_IGN);
+
+	r.in = open_input(argv[0]);
+	r.noutputs = r.nlive = (size_t)argc - 1;
+	if (!(r.outputs = calloc(r.noutputs, sizeof(struct output)))) {
+		err(1, "calloc");
+	}
+	for (size_t i = 0; i < r.noutputs; ++i) {
+		open_output(&r.outputs[i], argv[i + 1]);
+	}
+
+	if (fstat(r.in, &st) < 0) {
+		err(1, "fstat");
+	}
+	r.in_pollable = !S_ISREG(st.st_mode) && !S_ISCHR(st.st_mode) &&
+	    !S_ISBLK(st.st_mode);
+#ifdef RELAY_SPLICE
+	if (r.splice && !S_ISFIFO(st.st_mode)) {
+		warnx("%s: not a FIFO or pipe, copying", argv[0]);
+		r.splice = false;
+	}
+	if (r.splice) {
+		open_stages(&r);
+	}
+#else
+	r.splice = false;
+#endif
+	if (!r.splice && !(r.chunk = malloc(RELAY_BUFFER_SIZE))) {
+		err(1, "malloc");
+	}
+
+	start = now_ns();
+	relay(&r);
+	elapsed = now_ns() - start;
+
+	fprintf(stderr,
+	    "%s: %llu bytes in, %llu bytes out, %llu bytes copied, "
+	    "%llu bytes of copies avoided, %llu wakeups, %.3f seconds\n",
+	    r.splice ? "splice" : "buffered", (unsigned long long)r.bytes_in,
+	    (unsigned long long)r.bytes_out, (unsigned long long)r.copied,
+	    (unsigned long long)r.avoided, (unsigned long long)r.wakeups,
+	    (double)elapsed / 1e9);
+
+	for (size_t i = 0; i < r.noutputs; ++i) {
+		struct output *o = &r.outputs[i];
+
+		if (!o->closed) {
+			close(o->fd);
+			if (o->stage[0] >= 0) {
+				close(o->stage[0]);
+				close(o->stage[1]);
+			}
+		}
+		if (o->buf != r.chunk) {
+			free(o->buf);
+		}
+	}
+	free(r.outputs);
+	free(r.chunk);
+	return (0);
+}
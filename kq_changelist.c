@@ -0,0 +1,71 @@
+#include <sys/types.h>
+#include <sys/event.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "kq_changelist.h"
+
+int
+kq_changelist_init(struct kq_changelist *cl, int kq, int capacity)
+{
+	if (capacity <= 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	cl->changes = calloc((size_t)capacity, sizeof(struct kevent));
+	if (!cl->changes) {
+		return (-1);
+	}
+	cl->kq = kq;
+	cl->nchanges = 0;
+	cl->capacity = capacity;
+
+	return (0);
+}
+
+void
+kq_changelist_fini(struct kq_changelist *cl)
+{
+	free(cl->changes);
+	cl->changes = NULL;
+	cl->nchanges = cl->capacity = 0;
+}
+
+int
+kq_changelist_add(struct kq_changelist *cl, uintptr_t ident, short filter,
+    unsigned short flags, unsigned fflags, intptr_t data, void *udata)
+{
+	if (cl->nchanges == cl->capacity &&
+	    kq_changelist_submit(cl, NULL, 0, NULL) < 0) {
+		return (-1);
+	}
+
+	EV_SET(&cl->changes[cl->nchanges], ident, filter, flags, fflags, data,
+	    udata);
+	++cl->nchanges;
+
+	return (0);
+}
+
+/*
+ * Submits all pending changes and harvests up to 'nevents' events in the
+ * same kevent(2) call. Returns the number of events, or -1 on error. The
+ * pending changes are gone either way.
+ */
+int
+kq_changelist_submit(struct kq_changelist *cl, struct kevent *eventlist,
+    int nevents, struct timespec const *timeout)
+{
+	int nchanges = cl->nchanges;
+
+	cl->nchanges = 0;
+	if (nchanges == 0 && nevents == 0) {
+		return (0);
+	}
+
+	return (kevent(cl->kq, cl->changes, nchanges, eventlist, nevents,
+	    timeout));
+}
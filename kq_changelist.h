@@ -0,0 +1,41 @@
+#ifndef KQ_CHANGELIST_H_
+#define KQ_CHANGELIST_H_
+
+#include <sys/types.h>
+#include <sys/event.h>
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * A changelist collects kevent(2) changes and hands them to the kernel in
+ * as few calls as possible. Changes are only submitted when the list is
+ * full or when kq_changelist_submit() harvests events anyway, so that
+ * registering thousands of descriptors costs a handful of syscalls instead
+ * of one per descriptor.
+ *
+ * Like kevent(2) itself, kq_changelist_submit() reports a change that
+ * cannot be applied as an EV_ERROR event when there is room in the event
+ * list and fails otherwise. Changes flushed because the list is full have
+ * no event list, so their first error fails kq_changelist_add().
+ */
+
+struct kq_changelist {
+	int kq;
+	int nchanges;
+	int capacity;
+	struct kevent *changes;
+};
+
+int kq_changelist_init(struct kq_changelist * /* cl */, int /* kq */,
+    int /* capacity */);
+void kq_changelist_fini(struct kq_changelist * /* cl */);
+
+int kq_changelist_add(struct kq_changelist * /* cl */, uintptr_t /* ident */,
+    short /* filter */, unsigned short /* flags */, unsigned /* fflags */,
+    intptr_t /* data */, void * /* udata */);
+int kq_changelist_submit(struct kq_changelist * /* cl */,
+    struct kevent * /* eventlist */, int /* nevents */,
+    struct timespec const * /* timeout */);
+
+#endif
@@ -0,0 +1,194 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "latency.h"
+
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+struct latency_histogram {
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	uint64_t sum;
+	uint64_t buckets[LATENCY_BUCKETS];
+};
+
+struct latency_thread {
+	struct latency_thread *next;
+	struct latency_histogram histograms[LATENCY_NCALLS][LATENCY_NSTATES];
+};
+
+static char const *const call_names[] = {
+	[LATENCY_POLL] = "poll",
+	[LATENCY_KEVENT] = "kevent",
+};
+
+static char const *const state_names[] = {
+	[LATENCY_NO_WRITER] = "no-writer",
+	[LATENCY_WRITER] = "writer",
+	[LATENCY_EOF] = "eof",
+	[LATENCY_REOPENED] = "reopened",
+};
+
+static pthread_mutex_t threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct latency_thread *threads;
+static _Thread_local struct latency_thread *self;
+
+static unsigned
+bucket_index(uint64_t value)
+{
+	unsigned msb;
+
+	if (value < LATENCY_SUB_BUCKETS) {
+		return ((unsigned)value);
+	}
+
+	msb = 63 - (unsigned)__builtin_clzll(value);
+	return ((msb - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS +
+	    (unsigned)(value >> (msb - LATENCY_SUB_BITS)) -
+	    LATENCY_SUB_BUCKETS);
+}
+
+/* Returns the highest value that falls into bucket 'index'. */
+static uint64_t
+bucket_value(unsigned index)
+{
+	unsigned group = index / LATENCY_SUB_BUCKETS;
+	uint64_t sub = index % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS;
+	unsigned shift;
+
+	if (group == 0) {
+		return (index);
+	}
+
+	shift = group - 1;
+	return (((sub + 1) << shift) - 1);
+}
+
+uint64_t
+latency_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec);
+}
+
+void
+latency_record(enum latency_call call, enum latency_state state,
+    uint64_t ns)
+{
+	struct latency_histogram *h;
+
+	if (!self) {
+		self = calloc(1, sizeof(*self));
+		if (!self) {
+			err(1, "calloc");
+		}
+		pthread_mutex_lock(&threads_mutex);
+		self->next = threads;
+		threads = self;
+		pthread_mutex_unlock(&threads_mutex);
+	}
+
+	h = &self->histograms[call][state];
+	if (h->count == 0 || ns < h->min) {
+		h->min = ns;
+	}
+	if (ns > h->max) {
+		h->max = ns;
+	}
+	++h->count;
+	h->sum += ns;
+	++h->buckets[bucket_index(ns)];
+}
+
+static uint64_t
+percentile(struct latency_histogram const *h, double p)
+{
+	uint64_t rank = (uint64_t)(p * (double)h->count);
+	uint64_t seen = 0;
+
+	if (rank >= h->count) {
+		rank = h->count - 1;
+	}
+	for (unsigned i = 0; i < LATENCY_BUCKETS; ++i) {
+		seen += h->buckets[i];
+		if (seen > rank) {
+			return (bucket_value(i) < h->max ? bucket_value(i)
+							 : h->max);
+		}
+	}
+
+	return (h->max);
+}
+
+static void
+merge(struct latency_histogram *to, struct latency_histogram const *from)
+{
+	if (from->count == 0) {
+		return;
+	}
+	if (to->count == 0 || from->min < to->min) {
+		to->min = from->min;
+	}
+	if (from->max > to->max) {
+		to->max = from->max;
+	}
+	to->count += from->count;
+	to->sum += from->sum;
+	for (unsigned i = 0; i < LATENCY_BUCKETS; ++i) {
+		to->buckets[i] += from->buckets[i];
+	}
+}
+
+void
+latency_print(FILE *fp)
+{
+	struct latency_histogram *total;
+
+	total = calloc(1, sizeof(*total));
+	if (!total) {
+		err(1, "calloc");
+	}
+
+	fprintf(fp, "%-6s %-9s %10s %8s %8s %8s %8s %8s %8s %8s\n", "call",
+	    "state", "count", "min_ns", "mean_ns", "p50_ns", "p90_ns",
+	    "p99_ns", "p999_ns", "max_ns");
+
+	pthread_mutex_lock(&threads_mutex);
+	for (int call = 0; call < LATENCY_NCALLS; ++call) {
+		for (int state = 0; state < LATENCY_NSTATES; ++state) {
+			*total = (struct latency_histogram) { 0 };
+			for (struct latency_thread *t = threads; t;
+			     t = t->next) {
+				merge(total, &t->histograms[call][state]);
+			}
+			if (total->count == 0) {
+				continue;
+			}
+
+			fprintf(fp,
+			    "%-6s %-9s %10llu %8llu %8.0f %8llu %8llu %8llu "
+			    "%8llu %8llu\n",
+			    call_names[call], state_names[state],
+			    (unsigned long long)total->count,
+			    (unsigned long long)total->min,
+			    (double)total->sum / (double)total->count,
+			    (unsigned long long)percentile(total, 0.5),
+			    (unsigned long long)percentile(total, 0.9),
+			    (unsigned long long)percentile(total, 0.99),
+			    (unsigned long long)percentile(total, 0.999),
+			    (unsigned long long)total->max);
+		}
+	}
+	pthread_mutex_unlock(&threads_mutex);
+
+	free(total);
+}
@@ -0,0 +1,38 @@
+#ifndef LATENCY_H_
+#define LATENCY_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Latency histograms for the readiness checks of scenario runs. Every
+ * thread records into histograms of its own, so recording takes no locks
+ * and no atomic operations. Buckets are log-linear like in HdrHistogram:
+ * 32 linear sub-buckets per power of two keep the relative error of every
+ * reported value below about 3%.
+ *
+ * latency_print() merges the histograms of all threads that ever recorded
+ * anything, so it must only be called once they are done.
+ */
+
+enum latency_call {
+	LATENCY_POLL,
+	LATENCY_KEVENT,
+	LATENCY_NCALLS,
+};
+
+/* The state of the FIFO, as far as its writers are concerned. */
+enum latency_state {
+	LATENCY_NO_WRITER, /* no writer has been opened yet */
+	LATENCY_WRITER,	   /* the first writers are attached */
+	LATENCY_EOF,	   /* all writers have been closed again */
+	LATENCY_REOPENED,  /* writers are attached again after EOF */
+	LATENCY_NSTATES,
+};
+
+uint64_t latency_now(void);
+void latency_record(enum latency_call /* call */,
+    enum latency_state /* state */, uint64_t /* ns */);
+void latency_print(FILE * /* fp */);
+
+#endif
@@ -1,488 +1,582 @@
 #include <sys/types.h>
-#include <sys/event.h>
 #include <sys/stat.h>
 
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <poll.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <time.h>
 #include <unistd.h>
 
-#include "coro.h"
-
-#define FIFONAME "fifo.tmp"
-#define PIPE_SIZE (16384)
-
-static void
-pollfd(
-    /* two return values: first for the long running kqueue, one for newly
-       connecting reader/writer. */
-    int *pr, int *pr2,
-
-    /* fifo fd, a long running kqueue and a flag to open(2) if a new
-       reader/writer should be tested. */
-    int fd, int kq, bool recursion, int recursion_open_flag,
-
-    /* poll events which are expected */
-    int expected_nr_poll_events, int expected_revents,
-    /* kevents from long running kqueue which are expected */
-    int expected_nr_kq_events, int expected_kq_filter, int expected_kq_data,
-    int expected_kq_flags,
-
-    /* same as above, but for newly connected readers/writers */
-    int new_expected_nr_poll_events, int new_expected_revents,
-    int new_expected_nr_kq_events, int new_expected_kq_filter,
-    int new_expected_kq_data, int new_expected_kq_flags)
+#include "explore.h"
+#include "latency.h"
+#include "pipe_size.h"
+#include "result_sink.h"
+#include "scenario.h"
+#include "soak.h"
+
+/* Every job replays the scenarios on a FIFO of its own. */
+struct job {
+	struct scenario_ctx *ctx;
+	struct scenario const *scenarios;
+	size_t nscenarios;
+	unsigned long repeat;
+	struct result_sink sink;
+	char tmpdir[PATH_MAX];
+	char fifo_path[PATH_MAX];
+	pthread_t thread;
+};
+
+static struct job *jobs;
+static unsigned njobs;
+
+/*
+ * The reader/writer choreography this program has always checked: a FIFO
+ * reader stays open while a writer comes and goes, and vice versa.
+ */
+static char const default_scenario[] =
+    "scenario reader-writer\n"
+    "open r r\n"
+    "check r probe\n"
+    "# first reader opened\n"
+    "open w w\n"
+    "check w poll=OUT kev=WRITE/cap probe poll=OUT kev=WRITE/cap\n"
+    "# FIFO opened\n"
+    "check r probe\n"
+    "# writer connected, poll still returns 0\n"
+    "write w 1 =1\n"
+    "check w poll=OUT kev=WRITE/cap-1 probe poll=OUT kev=WRITE/cap-1\n"
+    "# one byte written\n"
+    "check r poll=IN kev=READ/1 probe poll=IN kev=READ/1\n"
+    "# writer wrote first byte, POLLIN expected\n"
+    "close w\n"
+    "# writer closed\n"
+    "check r poll=IN|HUP kev=READ/1/EOF probe poll=IN kev=READ/1\n"
+    "# writer closed, POLLIN|POLLHUP expected\n"
+    "open w w\n"
+    "check w poll=OUT kev=WRITE/cap-1 probe poll=OUT kev=WRITE/cap-1\n"
+    "# writer reopened\n"
+    "check r poll=IN kev=READ/1 probe poll=IN kev=READ/1\n"
+    "# new writer connected, POLLIN expected, a kevent with data 1\n"
+    "write w 1 =1\n"
+    "check w poll=OUT kev=WRITE/cap-2 probe poll=OUT kev=WRITE/cap-2\n"
+    "# one byte written\n"
+    "check r poll=IN kev=READ/2 probe poll=IN kev=READ/2\n"
+    "# writer wrote a byte, POLLIN expected, a kevent with data 2\n"
+    "close w\n"
+    "# writer closed\n"
+    "check r poll=IN|HUP kev=READ/2/EOF probe poll=IN kev=READ/2\n"
+    "# a read of length one retriggers EVFILT_READ\n"
+    "read r 1 =1\n"
+    "check r poll=IN|HUP kev=READ/1/EOF probe poll=IN kev=READ/1\n"
+    "# another read of length one retriggers EVFILT_READ\n"
+    "read r 16 =1\n"
+    "check r poll=IN|HUP kev=READ/0/EOF probe\n"
+    "# another read does not retrigger EVFILT_READ at EOF\n"
+    "read r 16 =0\n"
+    "check r poll=IN|HUP probe\n"
+    "open w w\n"
+    "check w poll=OUT kev=WRITE/cap probe poll=OUT kev=WRITE/cap\n"
+    "# writer reopened\n"
+    "close r\n"
+    "# reader closed; connecting as a new writer would fail now\n"
+    "check w poll=HUP kev=WRITE/cap/EOF\n"
+    "# get EOF when reader closes\n"
+    "open r r\n"
+    "# reader reopened\n"
+    "check w poll=OUT kev=WRITE/cap probe poll=OUT kev=WRITE/cap\n"
+    "write w 1 =1\n"
+    "check w poll=OUT kev=WRITE/cap-1 probe poll=OUT kev=WRITE/cap-1\n"
+    "# reconnected reader should trigger notification\n";
+
+static char *
+read_file(char const *path)
 {
-	int r = 0;
-	int r2 = 0;
-	struct pollfd pfd = { .fd = fd, /**/
-		.events = POLLIN | POLLPRI | POLLOUT };
-	bool is_in_recursion = !pr2;
-
-#define WARN_STR (is_in_recursion ? "new r/w" : "old r/w")
-
-	if (poll(&pfd, 1, 0) != expected_nr_poll_events) {
-		warnx("ERROR - %s: poll failed", WARN_STR);
-		r = -1;
-	}
-	if (pfd.revents != expected_revents) {
-		warnx("ERROR - %s: expected %d, got %d", WARN_STR,
-		    expected_revents, pfd.revents);
-		r = -1;
-	}
-
-	struct kevent kev[16];
-
-	int n;
-	struct timespec ts = { 0, 0 };
-	if ((n = kevent(kq, NULL, 0, kev, 16, &ts)) < 0) {
-		err(1, "kevent");
-	}
-#if 0
-	if (n == 0) {
-		fprintf(stderr, "got no events\n");
-	}
-#endif
-	for (int i = 0; i < n; ++i) {
-#if 0
-		fprintf(stderr, "got event: %d\n", (int)kev[i].filter);
-		fprintf(stderr, " fd: %d\n", (int)kev[i].ident);
-		fprintf(stderr, " data: %d\n", (int)kev[i].data);
-		fprintf(stderr, " flags: %x\n", (unsigned)kev[i].flags);
-		fprintf(stderr, " fflags: %x\n", (unsigned)kev[i].fflags);
-#endif
-
-		if ((int)kev[i].filter != expected_kq_filter) {
-			warnx("ERROR - %s: expected_kq_filter %d, received %d",
-			    WARN_STR, expected_kq_filter, (int)kev[i].filter);
-			r = -1;
-		}
-		if ((int)kev[i].data != expected_kq_data) {
-			warnx("ERROR - %s: expected_kq_data %d, received %d",
-			    WARN_STR, expected_kq_data, (int)kev[i].data);
-			r = -1;
-		}
-		if ((int)kev[i].flags != (expected_kq_flags | EV_CLEAR)) {
-			warnx("ERROR - %s: expected_kq_flags %x, received %x",
-			    WARN_STR, (unsigned)(expected_kq_flags | EV_CLEAR),
-			    (unsigned)kev[i].flags);
-			r = -1;
+	FILE *fp;
+	char *text = NULL;
+	size_t size = 0;
+	size_t len = 0;
+	size_t n;
+
+	fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+	if (!fp) {
+		err(1, "%s", path);
+	}
+
+	do {
+		if (len + 1 >= size) {
+			size = size ? size * 2 : 4096;
+			text = realloc(text, size);
+			if (!text) {
+				err(1, "realloc");
+			}
 		}
+		n = fread(text + len, 1, size - len - 1, fp);
+		len += n;
+	} while (n > 0);
+	if (ferror(fp)) {
+		err(1, "%s", path);
 	}
+	text[len] = '\0';
 
-	if (n != expected_nr_kq_events) {
-		warnx("ERROR - %s: expected_nr_kq_events %d, received %d",
-		    WARN_STR, expected_nr_kq_events, n);
-		r = -1;
-	}
-
-	if (recursion) {
-		int fd2;
-		int kq2;
-		struct kevent kev2[2];
-
-		fd2 = open(FIFONAME, recursion_open_flag | O_NONBLOCK);
-		if (fd2 < 0) {
-			err(1, "open");
-		}
-
-		kq2 = kqueue();
-		if (kq2 < 0) {
-			err(1, "kqueue");
-		}
-
-		EV_SET(&kev2[0], fd2, EVFILT_READ, /**/
-		    EV_ADD | EV_CLEAR, 0, 0, NULL);
-		EV_SET(&kev2[1], fd2, EVFILT_WRITE, /**/
-		    EV_ADD | EV_CLEAR, 0, 0, NULL);
-		if (kevent(kq2, kev2, 2, NULL, 0, NULL) < 0) {
-			err(1, "kevent");
-		}
-
-		pollfd(&r2, NULL, fd2, kq2, false, 0,
-		    new_expected_nr_poll_events, new_expected_revents,
-		    new_expected_nr_kq_events, new_expected_kq_filter,
-		    new_expected_kq_data, new_expected_kq_flags, 0, 0, 0, 0, 0,
-		    0);
-
-		close(kq2);
-		close(fd2);
+	if (fp != stdin) {
+		fclose(fp);
 	}
 
-	*pr = r;
-	if (!is_in_recursion) {
-		*pr2 = r2;
-	}
+	return (text);
 }
 
-static int test_counter;
-
-#define PRINT_TESTRESULT                                          \
-	do {                                                      \
-		++test_counter;                                   \
-		fprintf(stderr, "test %2d %s/%s\n", test_counter, \
-		    r < 0 ? "FAILED" : "SUCCESSFUL",              \
-		    r2 < 0 ? "FAILED" : "SUCCESSFUL");            \
-	} while (0);
-
 static void
-coro1(Coro c, void *arg)
+job_init(struct job *job, struct scenario_ctx *ctx, char const *dir)
 {
-	int fd;
-	int kq;
-	struct kevent kev[2];
-	int r, r2;
-	uint8_t buf[16];
-
-	(void)arg;
-
-	fd = open(FIFONAME, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
-	if (fd < 0) {
-		err(1, "open");
-	}
-
-	kq = kqueue();
-	if (kq < 0) {
-		err(1, "kqueue");
-	}
-
-	EV_SET(&kev[0], fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
-	EV_SET(&kev[1], fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, NULL);
-	if (kevent(kq, kev, 2, NULL, 0, NULL) < 0) {
-		err(1, "kevent");
+	job->ctx = ctx;
+	(void)snprintf(job->tmpdir, sizeof(job->tmpdir),
+	    "%s/fifo-kqueue.XXXXXX", dir);
+	if (!mkdtemp(job->tmpdir)) {
+		job->tmpdir[0] = '\0';
+		err(1, "mkdtemp");
+	}
+	if ((size_t)snprintf(job->fifo_path, sizeof(job->fifo_path),
+		"%s/fifo", job->tmpdir) >= sizeof(job->fifo_path)) {
+		errx(1, "%s: path too long", job->tmpdir);
+	}
+	if (mkfifo(job->fifo_path, 0666) < 0) {
+		err(1, "mkfifo");
 	}
+	ctx->fifo_path = job->fifo_path;
+}
 
-	pollfd(&r, &r2, fd, kq, true, O_RDONLY, /**/
-	    0, 0, 0, 0, 0, 0, /**/
-	    0, 0, 0, 0, 0, 0);
-	PRINT_TESTRESULT;
-
-	(void)coro_transfer(c, /**/
-	    (void *)"first reader opened");
-
-	pollfd(&r, &r2, fd, kq, true, O_RDONLY, /**/
-	    0, 0, 0, 0, 0, 0, /**/
-	    0, 0, 0, 0, 0, 0);
-	PRINT_TESTRESULT;
-
-	(void)coro_transfer(c, /**/
-	    (void *)"writer connected, poll still returns 0");
-
-	pollfd(&r, &r2, fd, kq, true, O_RDONLY, /**/
-	    1, POLLIN, 1, EVFILT_READ, 1, 0, /**/
-	    1, POLLIN, 1, EVFILT_READ, 1, 0);
-	PRINT_TESTRESULT;
-
-	(void)coro_transfer(c, /**/
-	    (void *)"writer wrote first byte, POLLIN expected");
-
-	pollfd(&r, &r2, fd, kq, true, O_RDONLY, /**/
-	    1, POLLIN | POLLHUP, 1, EVFILT_READ, 1, EV_EOF, /**/
-	    1, POLLIN, 1, EVFILT_READ, 1, 0);
-	PRINT_TESTRESULT;
-
-	(void)coro_transfer(c, /**/
-	    (void *)"writer closed, POLLIN|POLLHUP expected");
-
-	pollfd(&r, &r2, fd, kq, true, O_RDONLY, /**/
-	    1, POLLIN, 1, EVFILT_READ, 1, 0, /**/
-	    1, POLLIN, 1, EVFILT_READ, 1, 0);
-	PRINT_TESTRESULT;
-
-	(void)coro_transfer(c, /**/
-	    (void *)"new writer connected, POLLIN expected, a kevent with data 1");
-
-	pollfd(&r, &r2, fd, kq, true, O_RDONLY, /**/
-	    1, POLLIN, 1, EVFILT_READ, 2, 0, /**/
-	    1, POLLIN, 1, EVFILT_READ, 2, 0);
-	PRINT_TESTRESULT;
-
-	(void)coro_transfer(c, /**/
-	    (void *)"writer wrote a byte, POLLIN expected, a kevent with data 2");
-
-	pollfd(&r, &r2, fd, kq, true, O_RDONLY, /**/
-	    1, POLLIN | POLLHUP, 1, EVFILT_READ, 2, EV_EOF, /**/
-	    1, POLLIN, 1, EVFILT_READ, 2, 0);
-	PRINT_TESTRESULT;
-
-	fprintf(stderr, "writer closed connection\n");
-
-	fprintf(stderr,
-	    "now test that read of length one retriggers EVFILT_READ:\n");
-
-	if (read(fd, buf, 1) != 1) {
-		warnx("ERROR - read != 1");
+static void
+atexit_cleanup(void)
+{
+	for (unsigned i = 0; i < njobs; ++i) {
+		if (jobs[i].tmpdir[0] != '\0') {
+			(void)unlink(jobs[i].fifo_path);
+			(void)rmdir(jobs[i].tmpdir);
+		}
 	}
+}
 
-	pollfd(&r, &r2, fd, kq, true, O_RDONLY, /**/
-	    1, POLLIN | POLLHUP, 1, EVFILT_READ, 1, EV_EOF, /**/
-	    1, POLLIN, 1, EVFILT_READ, 1, 0);
-	PRINT_TESTRESULT;
-
-	fprintf(stderr,
-	    "test that another read of length one retriggers EVFILT_READ:\n");
+static void *
+job_run(void *arg)
+{
+	struct job *job = arg;
 
-	if (read(fd, buf, sizeof(buf)) != 1) {
-		warnx("ERROR - read != 1");
+	for (unsigned long n = 0; n < job->repeat; ++n) {
+		for (size_t i = 0; i < job->nscenarios; ++i) {
+			(void)scenario_run(job->ctx, &job->scenarios[i]);
+		}
 	}
 
-	pollfd(&r, &r2, fd, kq, true, O_RDONLY, /**/
-	    1, POLLIN | POLLHUP, 1, EVFILT_READ, 0, EV_EOF, /**/
-	    0, 0, 0, 0, 0, 0);
-	PRINT_TESTRESULT;
-
-	fprintf(stderr,
-	    "test that another read does not retrigger EVFILT_READ at EOF:\n");
+	return (NULL);
+}
 
-	if (read(fd, buf, sizeof(buf)) != 0) {
-		warnx("ERROR - read != 0");
+/* Replays the scenarios 'repeat' times in every job, all in parallel. */
+static void
+run_jobs(struct scenario const *scenarios, size_t nscenarios,
+    unsigned long repeat)
+{
+	int error;
+
+	for (unsigned i = 0; i < njobs; ++i) {
+		jobs[i].scenarios = scenarios;
+		jobs[i].nscenarios = nscenarios;
+		jobs[i].repeat = repeat;
+		if ((error = pthread_create(&jobs[i].thread, NULL, job_run,
+			 &jobs[i])) != 0) {
+			errno = error;
+			err(1, "pthread_create");
+		}
 	}
-
-	pollfd(&r, &r2, fd, kq, true, O_RDONLY, /**/
-	    1, POLLIN | POLLHUP, 0, 0, 0, 0, /**/
-	    0, 0, 0, 0, 0, 0);
-	PRINT_TESTRESULT;
-
-	(void)coro_transfer(c, /**/
-	    (void *)"writer closed, POLLIN|POLLHUP expected");
-
-	EV_SET(&kev[0], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
-	EV_SET(&kev[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
-	if (kevent(kq, kev, 2, NULL, 0, NULL) < 0) {
-		err(1, "kevent");
+	for (unsigned i = 0; i < njobs; ++i) {
+		(void)pthread_join(jobs[i].thread, NULL);
 	}
+}
 
-	(void)close(fd);
-
-	(void)coro_transfer(c, /**/
-	    (void *)"reader closed");
+/*
+ * Returns the capacity of a pipe resized to 'size' bytes, or -1 if pipes
+ * cannot be resized to that size.
+ */
+static long
+resized_capacity(long size)
+{
+	long capacity;
+	int p[2];
 
-	fd = open(FIFONAME, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
-	if (fd < 0) {
-		err(1, "open");
+	if (pipe2(p, O_CLOEXEC | O_NONBLOCK) < 0) {
+		err(1, "pipe2");
 	}
+	capacity = pipe_size_set(p[1], size);
+	(void)close(p[0]);
+	(void)close(p[1]);
 
-	EV_SET(&kev[0], fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
-	EV_SET(&kev[1], fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, NULL);
-	if (kevent(kq, kev, 2, NULL, 0, NULL) < 0) {
-		err(1, "kevent");
-	}
+	return (capacity);
+}
 
-	(void)coro_transfer(c, /**/
-	    (void *)"reader reopened");
+static double
+now_s(void)
+{
+	struct timespec ts;
 
-	(void)coro_transfer(c, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((double)ts.tv_sec + (double)ts.tv_nsec * 1e-9);
 }
 
+/*
+ * Replays the scenarios once per pipe size from PIPE_SIZE_MIN to
+ * PIPE_SIZE_MAX. Expectations relative to the capacity follow the size and
+ * the PIPE_BUF low-water mark, so every row checks readiness at that size
+ * and shows what the buffers cost against how fast the scenarios run.
+ */
 static void
-coro2(Coro c, void *arg)
+sweep(struct scenario_ctx *ctxs, struct scenario const *scenarios,
+    size_t nscenarios, unsigned long repeat)
 {
-	int fd;
-	int kq;
-	struct kevent kev[2];
-	int r, r2;
-
-	(void)arg;
-
-	fd = open(FIFONAME, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
-	if (fd < 0) {
-		err(1, "open");
+	if (resized_capacity(PIPE_SIZE_MIN) < 0 && errno == EOPNOTSUPP) {
+		errx(1, "pipes cannot be resized on this system");
 	}
 
-	kq = kqueue();
-	if (kq < 0) {
-		err(1, "kqueue");
-	}
+	fprintf(stderr, "%10s %10s %10s %10s %12s %10s\n", "pipe_size",
+	    "capacity", "memory_kb", "rounds/s", "steps", "failed");
 
-	EV_SET(&kev[0], fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
-	EV_SET(&kev[1], fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, NULL);
-	if (kevent(kq, kev, 2, NULL, 0, NULL) < 0) {
-		err(1, "kevent");
-	}
+	for (long size = PIPE_SIZE_MIN; size <= PIPE_SIZE_MAX; size *= 2) {
+		long capacity = resized_capacity(size);
+		unsigned long steps = 0, failed = 0;
+		double start;
 
-	pollfd(&r, &r2, fd, kq, true, O_WRONLY, /**/
-	    1, POLLOUT, 1, EVFILT_WRITE, PIPE_SIZE, 0, /**/
-	    1, POLLOUT, 1, EVFILT_WRITE, PIPE_SIZE, 0);
-	PRINT_TESTRESULT;
+		if (capacity < 0) {
+			warn("%ld bytes", size);
+			continue;
+		}
+		for (unsigned i = 0; i < njobs; ++i) {
+			ctxs[i].pipe_size = size;
+			ctxs[i].pipe_capacity = capacity;
+			steps -= ctxs[i].steps;
+			failed -= ctxs[i].failed_steps;
+		}
 
-	(void)coro_transfer(c, /**/
-	    (void *)"FIFO opened");
+		start = now_s();
+		run_jobs(scenarios, nscenarios, repeat);
+		double elapsed = now_s() - start;
 
-	if (write(fd, "", 1) != 1) {
-		errx(1, "write failed");
+		for (unsigned i = 0; i < njobs; ++i) {
+			steps += ctxs[i].steps;
+			failed += ctxs[i].failed_steps;
+		}
+		fprintf(stderr, "%10ld %10ld %10ld %10.1f %12lu %10lu\n", size,
+		    capacity, capacity * (long)njobs / 1024,
+		    (double)(repeat * njobs) / elapsed, steps, failed);
 	}
+}
 
-	pollfd(&r, &r2, fd, kq, true, O_WRONLY, /**/
-	    1, POLLOUT, 1, EVFILT_WRITE, PIPE_SIZE - 1, 0, /**/
-	    1, POLLOUT, 1, EVFILT_WRITE, PIPE_SIZE - 1, 0);
-	PRINT_TESTRESULT;
+static struct option const long_options[] = {
+	{ "capacity", required_argument, NULL, 'c' },
+	{ "pipe-size", required_argument, NULL, 'p' },
+	{ "sweep", no_argument, NULL, 'S' },
+	{ "recreate", no_argument, NULL, 'C' },
+	{ "dir", required_argument, NULL, 'd' },
+	{ "duration", required_argument, NULL, 'D' },
+	{ "interval", required_argument, NULL, 'i' },
+	{ "iterations", required_argument, NULL, 'I' },
+	{ "jobs", required_argument, NULL, 'j' },
+	{ "latency", no_argument, NULL, 'l' },
+	{ "length", required_argument, NULL, 'L' },
+	{ "repeat", required_argument, NULL, 'n' },
+	{ "results", required_argument, NULL, 'o' },
+	{ "no-poll", no_argument, NULL, 'P' },
+	{ "readers", required_argument, NULL, 'R' },
+	{ "seed", required_argument, NULL, 's' },
+	{ "verbose", no_argument, NULL, 'v' },
+	{ "writers", required_argument, NULL, 'W' },
+	{ "explore", no_argument, NULL, 'z' },
+	{ NULL, 0, NULL, 0 },
+};
 
-	(void)coro_transfer(c, /**/
-	    (void *)"one byte written");
+static void
+usage(char const *progname)
+{
+	fprintf(stderr,
+	    "usage: %s [-lSv] [-c pipe_capacity] [-d dir] [-j jobs] [-n repeat]"
+	    "\n"
+	    "          [-o results] [-p pipe_size] [scenario_file...]\n"
+	    "       %s --duration seconds | --iterations n [--interval seconds]"
+	    "\n"
+	    "          [--recreate] [-lv] [-c pipe_capacity] [-d dir] [-j jobs]"
+	    "\n"
+	    "          [-o results] [-p pipe_size] [scenario_file...]\n"
+	    "       %s -z [-lPv] [-c pipe_capacity] [-d dir] [-j jobs] "
+	    "[-L length]\n"
+	    "          [-n walks] [-o results] [-R readers] [-s seed] "
+	    "[-W writers]\n",
+	    progname, progname, progname);
+	exit(1);
+}
 
-	EV_SET(&kev[0], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
-	EV_SET(&kev[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
-	if (kevent(kq, kev, 2, NULL, 0, NULL) < 0) {
-		err(1, "kevent");
+int
+main(int argc, char **argv)
+{
+	struct scenario_ctx ctx = { 0 };
+	struct scenario_ctx *ctxs;
+	struct scenario *scenarios = NULL;
+	size_t nscenarios = 0;
+	struct explore_options explore_options = {
+		.nreaders = 2,
+		.nwriters = 2,
+		.length = 64,
+		.walks = 1000,
+		.jobs = 1,
+		.seed = (uint64_t)time(NULL) ^ (uint64_t)getpid(),
+		.check_poll = true,
+	};
+	struct soak_options soak_options = { .interval = 10 };
+	bool soak_mode = false;
+	bool sweep_mode = false;
+	char const *results_path = NULL;
+	char const *dir = NULL;
+	unsigned jobs_option = 0;
+	unsigned long scenarios_run = 0, steps = 0, failed_steps = 0;
+	int results_fd = -1;
+	unsigned long repeat = 1;
+	bool explore_mode = false;
+	bool repeat_set = false;
+	char const *progname = argv[0];
+	long ncpus;
+	int ch;
+
+	while ((ch = getopt_long(argc, argv, "c:Cd:D:i:I:j:lL:n:o:p:PR:s:SvW:z",
+		    long_options, NULL)) != -1) {
+		switch (ch) {
+		case 'c':
+			ctx.pipe_capacity = strtol(optarg, NULL, 10);
+			break;
+		case 'C':
+			soak_options.recreate = true;
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 'D':
+			soak_options.duration = strtod(optarg, NULL);
+			soak_mode = true;
+			break;
+		case 'i':
+			soak_options.interval = strtod(optarg, NULL);
+			if (!(soak_options.interval > 0)) {
+				usage(progname);
+			}
+			break;
+		case 'I':
+			soak_options.iterations = strtoul(optarg, NULL, 10);
+			soak_mode = true;
+			break;
+		case 'j':
+			jobs_option = (unsigned)strtoul(optarg, NULL, 10);
+			if (jobs_option == 0) {
+				usage(progname);
+			}
+			break;
+		case 'l':
+			ctx.measure_latency = true;
+			break;
+		case 'L':
+			explore_options.length = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			repeat = strtoul(optarg, NULL, 10);
+			repeat_set = true;
+			break;
+		case 'o':
+			results_path = optarg;
+			break;
+		case 'p':
+			ctx.pipe_size = strtol(optarg, NULL, 10);
+			if (ctx.pipe_size <= 0) {
+				usage(progname);
+			}
+			break;
+		case 'P':
+			explore_options.check_poll = false;
+			break;
+		case 'R':
+			explore_options.nreaders = (int)strtol(optarg, NULL,
+			    10);
+			break;
+		case 's':
+			explore_options.seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'S':
+			sweep_mode = true;
+			break;
+		case 'v':
+			ctx.verbose = true;
+			break;
+		case 'W':
+			explore_options.nwriters = (int)strtol(optarg, NULL,
+			    10);
+			break;
+		case 'z':
+			explore_mode = true;
+			break;
+		default:
+			usage(progname);
+		}
 	}
+	argc -= optind;
+	argv += optind;
 
-	(void)close(fd);
-
-	(void)coro_transfer(c, /**/
-	    (void *)"writer closed");
+	/* Writing to a FIFO without readers must fail with EPIPE. */
+	(void)signal(SIGPIPE, SIG_IGN);
 
-	fd = open(FIFONAME, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
-	if (fd < 0) {
-		err(1, "open");
+	if (!dir) {
+		dir = getenv("TMPDIR");
 	}
-
-	EV_SET(&kev[0], fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
-	EV_SET(&kev[1], fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, NULL);
-	if (kevent(kq, kev, 2, NULL, 0, NULL) < 0) {
-		err(1, "kevent");
+	if (!dir) {
+		dir = "/tmp";
 	}
 
-	pollfd(&r, &r2, fd, kq, true, O_WRONLY, /**/
-	    1, POLLOUT, 1, EVFILT_WRITE, PIPE_SIZE - 1, 0, /**/
-	    1, POLLOUT, 1, EVFILT_WRITE, PIPE_SIZE - 1, 0);
-	PRINT_TESTRESULT;
-
-	(void)coro_transfer(c, /**/
-	    (void *)"writer reopened");
-
-	if (write(fd, "", 1) != 1) {
-		errx(1, "write failed");
+	/* Results replace the mismatch messages on stderr. */
+	if (results_path) {
+		results_fd = strcmp(results_path, "-") == 0
+		    ? STDOUT_FILENO
+		    : open(results_path,
+			  O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+		if (results_fd < 0) {
+			err(1, "%s", results_path);
+		}
+		ctx.quiet = true;
 	}
 
-	pollfd(&r, &r2, fd, kq, true, O_WRONLY, /**/
-	    1, POLLOUT, 1, EVFILT_WRITE, PIPE_SIZE - 2, 0, /**/
-	    1, POLLOUT, 1, EVFILT_WRITE, PIPE_SIZE - 2, 0);
-	PRINT_TESTRESULT;
-
-	(void)coro_transfer(c, /**/
-	    (void *)"one byte written");
-
-	EV_SET(&kev[0], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
-	EV_SET(&kev[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
-	if (kevent(kq, kev, 2, NULL, 0, NULL) < 0) {
-		err(1, "kevent");
+	/* Expectations are relative to what the kernel actually provides. */
+	if (ctx.pipe_capacity == 0) {
+		ctx.pipe_capacity = ctx.pipe_size > 0
+		    ? resized_capacity(ctx.pipe_size)
+		    : pipe_size_default();
+		if (ctx.pipe_capacity < 0) {
+			err(1, "pipe capacity");
+		}
 	}
 
-	(void)close(fd);
+	if (explore_mode) {
+		int failed;
 
-	(void)coro_transfer(c, /**/
-	    (void *)"writer closed");
+		if (argc > 0 || soak_mode || sweep_mode || ctx.pipe_size > 0) {
+			usage(progname);
+		}
+		if (repeat_set) {
+			explore_options.walks = repeat;
+		}
+		explore_options.jobs = jobs_option;
+		if (explore_options.jobs == 0) {
+			ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+			explore_options.jobs = ncpus > 0 ? (unsigned)ncpus : 1;
+		}
+		explore_options.dir = dir;
+		explore_options.results_fd = results_fd;
+		explore_options.pipe_capacity = ctx.pipe_capacity;
+		explore_options.verbose = ctx.verbose;
+		explore_options.measure_latency = ctx.measure_latency;
+
+		if (!explore_options_valid(&explore_options)) {
+			usage(progname);
+		}
 
-	fd = open(FIFONAME, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
-	if (fd < 0) {
-		err(1, "open");
+		fprintf(stderr, "exploring with seed %llu\n",
+		    (unsigned long long)explore_options.seed);
+		failed = explore(&explore_options);
+		if (failed < 0) {
+			return (EXIT_FAILURE);
+		}
+		if (ctx.measure_latency) {
+			latency_print(stderr);
+		}
+		return (failed > 0 ? 1 : 0);
 	}
 
-	EV_SET(&kev[0], fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
-	EV_SET(&kev[1], fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, NULL);
-	if (kevent(kq, kev, 2, NULL, 0, NULL) < 0) {
-		err(1, "kevent");
+	if (soak_mode && sweep_mode) {
+		usage(progname);
 	}
 
-	pollfd(&r, &r2, fd, kq, true, O_WRONLY, /**/
-	    1, POLLOUT, 1, EVFILT_WRITE, PIPE_SIZE, 0, /**/
-	    1, POLLOUT, 1, EVFILT_WRITE, PIPE_SIZE, 0);
-	PRINT_TESTRESULT;
-
-	(void)coro_transfer(c, /**/
-	    (void *)"writer reopened");
-
-	pollfd(&r, &r2, fd, kq,
-	    false, /* connecting as a new writer would fail,
-		    * as no readers are currently connected */
-	    0, /**/
-	    1, POLLHUP, 1, EVFILT_WRITE, PIPE_SIZE, EV_EOF, /**/
-	    0, 0, 0, 0, 0, 0);
-	PRINT_TESTRESULT;
-
-	(void)coro_transfer(c, /**/
-	    (void *)"get EOF when reader closes");
-
-	pollfd(&r, &r2, fd, kq, true, O_WRONLY, /**/
-	    1, POLLOUT, 1, EVFILT_WRITE, PIPE_SIZE, 0, /**/
-	    1, POLLOUT, 1, EVFILT_WRITE, PIPE_SIZE, 0);
-	PRINT_TESTRESULT;
-
-	if (write(fd, "", 1) != 1) {
-		errx(1, "write failed");
+	if (argc == 0) {
+		if (scenario_parse(default_scenario, "<builtin>", &scenarios,
+			&nscenarios) < 0) {
+			errx(1, "cannot parse the builtin scenario");
+		}
 	}
+	for (int i = 0; i < argc; ++i) {
+		struct scenario *file_scenarios;
+		size_t file_nscenarios;
+		char *text = read_file(argv[i]);
 
-	pollfd(&r, &r2, fd, kq, true, O_WRONLY, /**/
-	    1, POLLOUT, 1, EVFILT_WRITE, PIPE_SIZE - 1, 0, /**/
-	    1, POLLOUT, 1, EVFILT_WRITE, PIPE_SIZE - 1, 0);
-	PRINT_TESTRESULT;
-
-	(void)coro_transfer(c, /**/
-	    (void *)"reconnected reader should trigger notification");
-
-	(void)coro_transfer(c, NULL);
-}
-
-static void
-atexit_unlink()
-{
-
-	(void)unlink(FIFONAME);
-}
-
-int
-main()
-{
+		if (scenario_parse(text, argv[i], &file_scenarios,
+			&file_nscenarios) < 0) {
+			exit(1);
+		}
+		free(text);
 
-	atexit_unlink();
-	if (mkfifo(FIFONAME, 0666) < 0) {
-		err(1, "mkfifo");
+		scenarios = realloc(scenarios,
+		    (nscenarios + file_nscenarios) * sizeof(struct scenario));
+		if (!scenarios) {
+			err(1, "realloc");
+		}
+		memcpy(scenarios + nscenarios, file_scenarios,
+		    file_nscenarios * sizeof(struct scenario));
+		nscenarios += file_nscenarios;
+		free(file_scenarios);
+	}
+
+	njobs = jobs_option > 0 ? jobs_option : 1;
+	jobs = calloc(njobs, sizeof(struct job));
+	ctxs = calloc(njobs, sizeof(struct scenario_ctx));
+	if (!jobs || !ctxs) {
+		err(1, "calloc");
+	}
+	atexit(atexit_cleanup);
+	for (unsigned i = 0; i < njobs; ++i) {
+		ctxs[i] = ctx;
+		job_init(&jobs[i], &ctxs[i], dir);
+		if (results_fd >= 0) {
+			result_sink_init(&jobs[i].sink, results_fd);
+			ctxs[i].sink = &jobs[i].sink;
+		}
 	}
-	atexit(atexit_unlink);
 
-	Coro c1 = coro_create(4096, coro1);
-	Coro c2 = coro_create(4096, coro2);
-	if (!c1 || !c2) {
-		errx(1, "coro_create failed");
+	if (soak_mode) {
+		soak(ctxs, njobs, scenarios, nscenarios, &soak_options);
+	} else if (sweep_mode) {
+		sweep(ctxs, scenarios, nscenarios, repeat);
+	} else {
+		run_jobs(scenarios, nscenarios, repeat);
 	}
 
-	for (;;) {
-		void *nr;
-
-		if (!(nr = coro_transfer(c1, NULL))) {
-			break;
+	for (unsigned i = 0; i < njobs; ++i) {
+		if (ctxs[i].sink) {
+			if (result_sink_flush(ctxs[i].sink) < 0) {
+				err(1, "%s", results_path);
+			}
+			result_sink_fini(ctxs[i].sink);
 		}
-		fprintf(stderr, "reader: %s\n\n", (char const *)nr);
+		scenarios_run += ctxs[i].scenarios;
+		steps += ctxs[i].steps;
+		failed_steps += ctxs[i].failed_steps;
+	}
 
-		if (!(nr = coro_transfer(c2, NULL))) {
-			break;
-		}
-		fprintf(stderr, "writer: %s\n\n", (char const *)nr);
+	fprintf(stderr, "%lu scenarios, %lu steps, %lu failed\n",
+	    scenarios_run, steps, failed_steps);
+	if (ctx.measure_latency) {
+		latency_print(stderr);
 	}
+
+	scenario_free(scenarios, nscenarios);
+	free(ctxs);
+
+	return (failed_steps > 0 ? 1 : 0);
 }
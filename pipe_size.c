@@ -0,0 +1,55 @@
+#include <sys/types.h>
+#include <sys/event.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "pipe_size.h"
+
+long
+pipe_size_default(void)
+{
+	struct kevent kev;
+	long size = -1;
+	int p[2], kq;
+
+	if (pipe2(p, O_CLOEXEC | O_NONBLOCK) < 0) {
+		return (-1);
+	}
+	if ((kq = kqueue()) >= 0) {
+		EV_SET(&kev, p[1], EVFILT_WRITE, EV_ADD, 0, 0, 0);
+		if (kevent(kq, &kev, 1, &kev, 1, NULL) == 1) {
+			if (kev.flags & EV_ERROR) {
+				errno = (int)kev.data;
+			} else {
+				size = (long)kev.data;
+			}
+		}
+		(void)close(kq);
+	}
+
+	(void)close(p[0]);
+	(void)close(p[1]);
+
+	return (size);
+}
+
+long
+pipe_size_set(int fd, long size)
+{
+#ifdef F_SETPIPE_SZ
+	if (size > INT_MAX) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	return (fcntl(fd, F_SETPIPE_SZ, (int)size));
+#else
+	(void)fd;
+	(void)size;
+	errno = EOPNOTSUPP;
+	return (-1);
+#endif
+}
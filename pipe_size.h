@@ -0,0 +1,24 @@
+#ifndef PIPE_SIZE_H_
+#define PIPE_SIZE_H_
+
+/*
+ * Pipe buffer sizes differ between kernels: FreeBSD starts pipes with 16
+ * KiB and grows them to 64 KiB on large writes, Linux uses 64 KiB and lets
+ * every pipe be resized with F_SETPIPE_SZ. Instead of hard-coding either,
+ * pipe_size_default() returns the space EVFILT_WRITE reports for a fresh,
+ * unwritten pipe, which is what a new writer sees. Filling a pipe may make
+ * room for more than that.
+ *
+ * pipe_size_set() resizes the pipe behind 'fd' and returns its new
+ * capacity, which the kernel may have rounded up. It fails with EOPNOTSUPP
+ * where pipes cannot be resized. Sweeps cover PIPE_SIZE_MIN to
+ * PIPE_SIZE_MAX in powers of two.
+ */
+
+#define PIPE_SIZE_MIN (4 * 1024)
+#define PIPE_SIZE_MAX (1024 * 1024)
+
+long pipe_size_default(void);
+long pipe_size_set(int /* fd */, long /* size */);
+
+#endif
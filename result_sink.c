@@ -0,0 +1,160 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "result_sink.h"
+
+static pthread_mutex_t write_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void
+result_sink_init(struct result_sink *sink, int fd)
+{
+	*sink = (struct result_sink) { .fd = fd };
+}
+
+void
+result_sink_fini(struct result_sink *sink)
+{
+	free(sink->buf);
+	sink->buf = NULL;
+	sink->len = sink->size = 0;
+}
+
+/* Remembers the first error, to be reported by every later flush. */
+static void
+fail(struct result_sink *sink, int error)
+{
+	if (!sink->error) {
+		sink->error = error ? error : EIO;
+	}
+}
+
+/* Makes room for 'n' more bytes. A sink that runs out of memory fails. */
+static bool
+reserve(struct result_sink *sink, size_t n)
+{
+	size_t size = sink->size ? sink->size : 64 * 1024;
+	char *buf;
+
+	if (sink->error) {
+		return (false);
+	}
+	if (sink->len + n <= sink->size) {
+		return (true);
+	}
+
+	while (size < sink->len + n) {
+		size *= 2;
+	}
+	buf = realloc(sink->buf, size);
+	if (!buf) {
+		fail(sink, ENOMEM);
+		return (false);
+	}
+	sink->buf = buf;
+	sink->size = size;
+
+	return (true);
+}
+
+void
+result_sink_printf(struct result_sink *sink, char const *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(sink->buf ? sink->buf + sink->len : NULL,
+	    sink->size - sink->len, fmt, ap);
+	va_end(ap);
+	if (n < 0) {
+		fail(sink, errno);
+		return;
+	}
+	if (sink->len + (size_t)n < sink->size) {
+		sink->len += (size_t)n;
+		return;
+	}
+
+	if (!reserve(sink, (size_t)n + 1)) {
+		return;
+	}
+	va_start(ap, fmt);
+	(void)vsnprintf(sink->buf + sink->len, sink->size - sink->len, fmt,
+	    ap);
+	va_end(ap);
+	sink->len += (size_t)n;
+}
+
+/* Appends 's' as a JSON string. */
+void
+result_sink_string(struct result_sink *sink, char const *s)
+{
+	if (!reserve(sink, 2)) {
+		return;
+	}
+	sink->buf[sink->len++] = '"';
+
+	for (; *s; ++s) {
+		unsigned char c = (unsigned char)*s;
+
+		if (c == '"' || c == '\\') {
+			result_sink_printf(sink, "\\%c", c);
+		} else if (c < 0x20) {
+			result_sink_printf(sink, "\\u%04x", c);
+		} else if (reserve(sink, 1)) {
+			sink->buf[sink->len++] = (char)c;
+		}
+	}
+
+	if (reserve(sink, 1)) {
+		sink->buf[sink->len++] = '"';
+	}
+}
+
+/* Terminates a record with a newline and flushes a sink that grew large. */
+void
+result_sink_end_record(struct result_sink *sink)
+{
+	if (reserve(sink, 1)) {
+		sink->buf[sink->len++] = '\n';
+	}
+	if (sink->len >= RESULT_SINK_LIMIT) {
+		(void)result_sink_flush(sink);
+	}
+}
+
+int
+result_sink_flush(struct result_sink *sink)
+{
+	size_t written = 0;
+
+	pthread_mutex_lock(&write_mutex);
+	while (written < sink->len) {
+		ssize_t r = write(sink->fd, sink->buf + written,
+		    sink->len - written);
+
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fail(sink, errno);
+			break;
+		}
+		written += (size_t)r;
+	}
+	pthread_mutex_unlock(&write_mutex);
+
+	sink->len = 0;
+	if (sink->error) {
+		errno = sink->error;
+		return (-1);
+	}
+
+	return (0);
+}
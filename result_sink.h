@@ -0,0 +1,37 @@
+#ifndef RESULT_SINK_H_
+#define RESULT_SINK_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A result sink collects machine-readable records in memory and writes
+ * them to a file descriptor in one go, so that tight scenario loops do not
+ * spend their time in stdio. Records are only written by
+ * result_sink_flush(), or when the buffer grows beyond RESULT_SINK_LIMIT.
+ * Sinks of different threads may share a descriptor; every flush is
+ * written as a whole. Errors stick: once a record was lost, every later
+ * result_sink_flush() fails with the first error.
+ */
+
+#define RESULT_SINK_LIMIT (64 * 1024 * 1024)
+
+struct result_sink {
+	int fd;
+	int error;	/* the first error, or 0 */
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+void result_sink_init(struct result_sink * /* sink */, int /* fd */);
+void result_sink_fini(struct result_sink * /* sink */);
+
+void result_sink_printf(struct result_sink * /* sink */,
+    char const * /* fmt */, ...) __attribute__((format(printf, 2, 3)));
+void result_sink_string(struct result_sink * /* sink */, char const * /* s */);
+void result_sink_end_record(struct result_sink * /* sink */);
+
+int result_sink_flush(struct result_sink * /* sink */);
+
+#endif
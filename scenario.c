@@ -0,0 +1,1249 @@
+#include <sys/types.h>
+#include <sys/event.h>
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "latency.h"
+#include "pipe_size.h"
+#include "result_sink.h"
+#include "scenario.h"
+
+#define SCENARIO_MAX_IO (1024 * 1024)
+
+struct name_value {
+	char const *name;
+	int value;
+};
+
+static struct name_value const revents_names[] = {
+	{ "IN", POLLIN },
+	{ "PRI", POLLPRI },
+	{ "OUT", POLLOUT },
+	{ "HUP", POLLHUP },
+	{ "ERR", POLLERR },
+	{ "NVAL", POLLNVAL },
+};
+
+static struct name_value const filter_names[] = {
+	{ "READ", EVFILT_READ },
+	{ "WRITE", EVFILT_WRITE },
+};
+
+static struct name_value const flag_names[] = {
+	{ "EOF", EV_EOF },
+	{ "ONESHOT", EV_ONESHOT },
+	{ "ERROR", EV_ERROR },
+};
+
+static struct name_value const errno_names[] = {
+	{ "EAGAIN", EAGAIN },
+	{ "EBADF", EBADF },
+	{ "EINTR", EINTR },
+	{ "EINVAL", EINVAL },
+	{ "ENOENT", ENOENT },
+	{ "ENXIO", ENXIO },
+	{ "EPIPE", EPIPE },
+};
+
+static char const *const op_names[] = {
+	[SCENARIO_OPEN] = "open",
+	[SCENARIO_CLOSE] = "close",
+	[SCENARIO_REOPEN] = "reopen",
+	[SCENARIO_READ] = "read",
+	[SCENARIO_WRITE] = "write",
+	[SCENARIO_CHECK] = "check",
+};
+
+#define NITEMS(x) (sizeof(x) / sizeof((x)[0]))
+
+static int
+lookup_name(struct name_value const *table, size_t n, char const *name,
+    int *value)
+{
+	for (size_t i = 0; i < n; ++i) {
+		if (strcmp(table[i].name, name) == 0) {
+			*value = table[i].value;
+			return (0);
+		}
+	}
+
+	return (-1);
+}
+
+static int
+parse_long(char const *s, long *value)
+{
+	char *end;
+
+	if (*s == '\0') {
+		return (-1);
+	}
+	errno = 0;
+	*value = strtol(s, &end, 10);
+	if (errno != 0 || *end != '\0') {
+		return (-1);
+	}
+
+	return (0);
+}
+
+/* Parses a '|' separated list of names from 'table' into a bit mask. */
+static int
+parse_mask(struct name_value const *table, size_t n, char *s, int *mask)
+{
+	char *saveptr;
+	char *tok;
+	int value;
+
+	*mask = 0;
+	if (strcmp(s, "-") == 0) {
+		return (0);
+	}
+
+	for (tok = strtok_r(s, "|", &saveptr); tok;
+	     tok = strtok_r(NULL, "|", &saveptr)) {
+		if (lookup_name(table, n, tok, &value) < 0) {
+			return (-1);
+		}
+		*mask |= value;
+	}
+
+	return (0);
+}
+
+static int
+parse_kevent(char *s, struct scenario_kevent *kev)
+{
+	char *saveptr;
+	char *filter = strtok_r(s, "/", &saveptr);
+	char *data = strtok_r(NULL, "/", &saveptr);
+	char *flags = strtok_r(NULL, "/", &saveptr);
+	int value;
+
+	if (!filter || !data || strtok_r(NULL, "/", &saveptr)) {
+		return (-1);
+	}
+
+	if (lookup_name(filter_names, NITEMS(filter_names), filter, &value) <
+	    0) {
+		return (-1);
+	}
+	kev->filter = (short)value;
+
+	if (strncmp(data, "cap", 3) == 0) {
+		kev->data_relative = true;
+		if (data[3] == '\0') {
+			kev->data = 0;
+		} else if ((data[3] != '-' && data[3] != '+') ||
+		    parse_long(data + 3, &kev->data) < 0) {
+			return (-1);
+		}
+	} else {
+		kev->data_relative = false;
+		if (parse_long(data, &kev->data) < 0) {
+			return (-1);
+		}
+	}
+
+	value = 0;
+	if (flags &&
+	    parse_mask(flag_names, NITEMS(flag_names), flags, &value) < 0) {
+		return (-1);
+	}
+	kev->flags = (unsigned short)value;
+
+	return (0);
+}
+
+static int
+parse_kevents(char *s, struct scenario_expect *expect)
+{
+	char *saveptr;
+	char *tok;
+
+	expect->nkevents = 0;
+	if (strcmp(s, "-") == 0) {
+		return (0);
+	}
+
+	for (tok = strtok_r(s, ",", &saveptr); tok;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		if (expect->nkevents == SCENARIO_MAX_KEVENTS ||
+		    parse_kevent(tok, &expect->kevents[expect->nkevents]) <
+			0) {
+			return (-1);
+		}
+		++expect->nkevents;
+	}
+
+	return (0);
+}
+
+/* Parses "=<count>" or "=<errno name>". */
+static int
+parse_result(char const *s, ssize_t *result, int *error)
+{
+	long value;
+	int e;
+
+	if (s[0] != '=') {
+		return (-1);
+	}
+	++s;
+
+	if (lookup_name(errno_names, NITEMS(errno_names), s, &e) == 0) {
+		*result = -1;
+		*error = e;
+		return (0);
+	}
+	if (parse_long(s, &value) < 0 || value < 0) {
+		return (-1);
+	}
+	*result = (ssize_t)value;
+	*error = 0;
+
+	return (0);
+}
+
+/**/
+
+struct parser {
+	char const *source;
+	int line;
+	struct scenario *scenarios;
+	size_t nscenarios;
+	int open_flags[SCENARIO_MAX_ACTORS];
+};
+
+static int
+parse_error(struct parser *parser, char const *fmt, ...)
+{
+	char msg[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	(void)vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+
+	warnx("%s:%d: %s", parser->source, parser->line, msg);
+
+	return (-1);
+}
+
+static struct scenario *
+parser_begin(struct parser *parser, char const *name)
+{
+	struct scenario *scenarios;
+	struct scenario *scenario;
+
+	scenarios = realloc(parser->scenarios,
+	    (parser->nscenarios + 1) * sizeof(struct scenario));
+	if (!scenarios) {
+		return (NULL);
+	}
+	parser->scenarios = scenarios;
+
+	scenario = &scenarios[parser->nscenarios];
+	*scenario = (struct scenario) { .source = parser->source };
+	scenario->name = strdup(name);
+	if (!scenario->name) {
+		return (NULL);
+	}
+	++parser->nscenarios;
+
+	for (int i = 0; i < SCENARIO_MAX_ACTORS; ++i) {
+		parser->open_flags[i] = -1;
+	}
+
+	return (scenario);
+}
+
+static int
+find_actor(struct parser *parser, struct scenario *scenario,
+    char const *name)
+{
+	for (int i = 0; i < scenario->nactors; ++i) {
+		if (strcmp(scenario->actor_names[i], name) == 0) {
+			return (i);
+		}
+	}
+
+	if (scenario->nactors == SCENARIO_MAX_ACTORS) {
+		return (parse_error(parser, "too many actors"));
+	}
+	scenario->actor_names[scenario->nactors] = strdup(name);
+	if (!scenario->actor_names[scenario->nactors]) {
+		return (parse_error(parser, "out of memory"));
+	}
+
+	return (scenario->nactors++);
+}
+
+static int
+parse_step(struct parser *parser, struct scenario *scenario, char *op,
+    char **saveptr)
+{
+	struct scenario_step step = { .line = parser->line };
+	struct scenario_expect *expect = &step.expect;
+	char *actor;
+	char *tok;
+	int i;
+
+	for (i = 0; i < (int)NITEMS(op_names); ++i) {
+		if (strcmp(op_names[i], op) == 0) {
+			break;
+		}
+	}
+	if (i == (int)NITEMS(op_names)) {
+		return (parse_error(parser, "unknown step '%s'", op));
+	}
+	step.op = (enum scenario_op)i;
+
+	actor = strtok_r(NULL, " \t", saveptr);
+	if (!actor) {
+		return (parse_error(parser, "missing actor"));
+	}
+	step.actor = find_actor(parser, scenario, actor);
+	if (step.actor < 0) {
+		return (-1);
+	}
+
+	switch (step.op) {
+	case SCENARIO_OPEN:
+		tok = strtok_r(NULL, " \t", saveptr);
+		if (tok && strcmp(tok, "r") == 0) {
+			step.open_flags = O_RDONLY;
+		} else if (tok && strcmp(tok, "w") == 0) {
+			step.open_flags = O_WRONLY;
+		} else {
+			return (parse_error(parser, "expected 'r' or 'w'"));
+		}
+		parser->open_flags[step.actor] = step.open_flags;
+		step.check_result = true;
+		tok = strtok_r(NULL, " \t", saveptr);
+		if (tok && (parse_result(tok, &step.result, &step.error) < 0 ||
+				step.result != -1)) {
+			return (parse_error(parser, "bad result '%s'", tok));
+		}
+		break;
+	case SCENARIO_CLOSE:
+	case SCENARIO_REOPEN:
+	case SCENARIO_CHECK:
+		if (parser->open_flags[step.actor] < 0) {
+			return (parse_error(parser, "actor '%s' never opened",
+			    actor));
+		}
+		step.open_flags = parser->open_flags[step.actor];
+		if (step.op != SCENARIO_CHECK) {
+			break;
+		}
+		while ((tok = strtok_r(NULL, " \t", saveptr))) {
+			int revents;
+
+			if (strcmp(tok, "probe") == 0) {
+				if (step.probe) {
+					return (parse_error(parser,
+					    "duplicate probe"));
+				}
+				step.probe = true;
+				expect = &step.probe_expect;
+			} else if (strcmp(tok, "poll=*") == 0) {
+				expect->any_revents = true;
+			} else if (strncmp(tok, "poll=", 5) == 0) {
+				if (parse_mask(revents_names,
+					NITEMS(revents_names), tok + 5,
+					&revents) < 0) {
+					return (parse_error(parser,
+					    "bad poll expectation"));
+				}
+				expect->revents = (short)revents;
+			} else if (strncmp(tok, "kev=", 4) == 0) {
+				if (parse_kevents(tok + 4, expect) < 0) {
+					return (parse_error(parser,
+					    "bad kev expectation"));
+				}
+			} else {
+				return (parse_error(parser,
+				    "unexpected '%s'", tok));
+			}
+		}
+		break;
+	case SCENARIO_READ:
+	case SCENARIO_WRITE: {
+		long count;
+
+		tok = strtok_r(NULL, " \t", saveptr);
+		if (!tok || parse_long(tok, &count) < 0 || count < 0 ||
+		    count > SCENARIO_MAX_IO) {
+			return (parse_error(parser, "bad count"));
+		}
+		step.count = (size_t)count;
+		tok = strtok_r(NULL, " \t", saveptr);
+		if (tok) {
+			if (parse_result(tok, &step.result, &step.error) < 0) {
+				return (parse_error(parser, "bad result '%s'",
+				    tok));
+			}
+			step.check_result = true;
+		}
+		break;
+	}
+	}
+
+	if ((tok = strtok_r(NULL, " \t", saveptr))) {
+		return (parse_error(parser, "unexpected '%s'", tok));
+	}
+
+	struct scenario_step *steps = realloc(scenario->steps,
+	    (scenario->nsteps + 1) * sizeof(struct scenario_step));
+	if (!steps) {
+		return (parse_error(parser, "out of memory"));
+	}
+	scenario->steps = steps;
+	scenario->steps[scenario->nsteps++] = step;
+
+	return (0);
+}
+
+int
+scenario_parse(char const *text, char const *source,
+    struct scenario **scenarios, size_t *nscenarios)
+{
+	struct parser parser = { .source = source };
+	struct scenario *scenario = NULL;
+	char *copy, *line, *next;
+
+	copy = strdup(text);
+	if (!copy) {
+		return (-1);
+	}
+
+	for (line = copy; line; line = next) {
+		char *saveptr;
+		char *tok;
+
+		next = strchr(line, '\n');
+		if (next) {
+			*next++ = '\0';
+		}
+		++parser.line;
+
+		char *comment = strchr(line, '#');
+		if (comment) {
+			*comment = '\0';
+		}
+
+		tok = strtok_r(line, " \t", &saveptr);
+		if (!tok) {
+			continue;
+		}
+
+		if (strcmp(tok, "scenario") == 0) {
+			char *name = strtok_r(NULL, " \t", &saveptr);
+			if (!name || strtok_r(NULL, " \t", &saveptr)) {
+				parse_error(&parser, "expected a name");
+				goto fail;
+			}
+			scenario = parser_begin(&parser, name);
+			if (!scenario) {
+				parse_error(&parser, "out of memory");
+				goto fail;
+			}
+			continue;
+		}
+
+		if (!scenario) {
+			scenario = parser_begin(&parser, source);
+			if (!scenario) {
+				parse_error(&parser, "out of memory");
+				goto fail;
+			}
+		}
+
+		if (parse_step(&parser, scenario, tok, &saveptr) < 0) {
+			goto fail;
+		}
+	}
+
+	free(copy);
+	*scenarios = parser.scenarios;
+	*nscenarios = parser.nscenarios;
+	return (0);
+
+fail:
+	free(copy);
+	scenario_free(parser.scenarios, parser.nscenarios);
+	return (-1);
+}
+
+void
+scenario_free(struct scenario *scenarios, size_t nscenarios)
+{
+	for (size_t i = 0; i < nscenarios; ++i) {
+		for (int j = 0; j < scenarios[i].nactors; ++j) {
+			free(scenarios[i].actor_names[j]);
+		}
+		free(scenarios[i].steps);
+		free(scenarios[i].name);
+	}
+	free(scenarios);
+}
+
+/**/
+
+static char const *
+lookup_value(struct name_value const *table, size_t n, int value)
+{
+	for (size_t i = 0; i < n; ++i) {
+		if (table[i].value == value) {
+			return (table[i].name);
+		}
+	}
+
+	return (NULL);
+}
+
+static void
+print_mask(FILE *fp, struct name_value const *table, size_t n, int mask)
+{
+	char const *sep = "";
+
+	if (mask == 0) {
+		fputc('-', fp);
+		return;
+	}
+	for (size_t i = 0; i < n; ++i) {
+		if (mask & table[i].value) {
+			fprintf(fp, "%s%s", sep, table[i].name);
+			sep = "|";
+		}
+	}
+}
+
+static void
+print_expect(FILE *fp, struct scenario_expect const *expect)
+{
+	if (expect->any_revents) {
+		fprintf(fp, " poll=*");
+	} else if (expect->revents != 0) {
+		fprintf(fp, " poll=");
+		print_mask(fp, revents_names, NITEMS(revents_names),
+		    expect->revents);
+	}
+
+	for (int i = 0; i < expect->nkevents; ++i) {
+		struct scenario_kevent const *kev = &expect->kevents[i];
+
+		fprintf(fp, "%s%s/", i == 0 ? " kev=" : ",",
+		    lookup_value(filter_names, NITEMS(filter_names),
+			kev->filter));
+		if (kev->data_relative) {
+			fprintf(fp, kev->data ? "cap%+ld" : "cap", kev->data);
+		} else {
+			fprintf(fp, "%ld", kev->data);
+		}
+		if (kev->flags != 0) {
+			fputc('/', fp);
+			print_mask(fp, flag_names, NITEMS(flag_names),
+			    kev->flags);
+		}
+	}
+}
+
+static void
+print_result(FILE *fp, struct scenario_step const *step)
+{
+	if (!step->check_result) {
+		return;
+	}
+	if (step->result < 0) {
+		fprintf(fp, " =%s",
+		    lookup_value(errno_names, NITEMS(errno_names),
+			step->error));
+	} else if (step->op != SCENARIO_OPEN) {
+		fprintf(fp, " =%zd", step->result);
+	}
+}
+
+/* Prints 'scenario' in the format scenario_parse() reads. */
+void
+scenario_print(FILE *fp, struct scenario const *scenario)
+{
+	fprintf(fp, "scenario %s\n", scenario->name);
+
+	for (size_t i = 0; i < scenario->nsteps; ++i) {
+		struct scenario_step const *step = &scenario->steps[i];
+
+		fprintf(fp, "%s %s", op_names[step->op],
+		    scenario->actor_names[step->actor]);
+
+		switch (step->op) {
+		case SCENARIO_OPEN:
+			fprintf(fp, " %s",
+			    step->open_flags == O_RDONLY ? "r" : "w");
+			print_result(fp, step);
+			break;
+		case SCENARIO_CLOSE:
+		case SCENARIO_REOPEN:
+			break;
+		case SCENARIO_READ:
+		case SCENARIO_WRITE:
+			fprintf(fp, " %zu", step->count);
+			print_result(fp, step);
+			break;
+		case SCENARIO_CHECK:
+			print_expect(fp, &step->expect);
+			if (step->probe) {
+				fprintf(fp, " probe");
+				print_expect(fp, &step->probe_expect);
+			}
+			break;
+		}
+
+		fputc('\n', fp);
+	}
+}
+
+/* Reports a mismatch between a scenario and what the kernel did. */
+static void
+report(struct scenario_ctx const *ctx, struct scenario const *scenario,
+    struct scenario_step const *step, char const *fmt, ...)
+{
+	char msg[768];
+	va_list ap;
+
+	if (ctx->quiet) {
+		return;
+	}
+
+	va_start(ap, fmt);
+	(void)vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+
+	/*
+	 * warnx() may print the program name and the message separately;
+	 * keep lines of parallel jobs from interleaving.
+	 */
+	flockfile(stderr);
+	warnx("%s:%d: %s", scenario->source, step->line, msg);
+	funlockfile(stderr);
+}
+
+static void
+format_mask(struct name_value const *table, size_t n, int mask, char *buf,
+    size_t size)
+{
+	size_t len = 0;
+
+	buf[0] = '\0';
+	for (size_t i = 0; i < n; ++i) {
+		if (mask & table[i].value) {
+			len += (size_t)snprintf(buf + len,
+			    len < size ? size - len : 0, "%s%s",
+			    len > 0 ? "|" : "", table[i].name);
+			mask &= ~table[i].value;
+		}
+	}
+	if (mask != 0) {
+		len += (size_t)snprintf(buf + len,
+		    len < size ? size - len : 0, "%s%#x", len > 0 ? "|" : "",
+		    (unsigned)mask);
+	}
+	if (len == 0) {
+		(void)snprintf(buf, size, "-");
+	}
+}
+
+static void
+format_kevent(short filter, long data, unsigned short flags, char *buf,
+    size_t size)
+{
+	char filter_buf[16];
+	char flags_buf[64];
+	char const *filter_name = NULL;
+
+	for (size_t i = 0; i < NITEMS(filter_names); ++i) {
+		if (filter_names[i].value == filter) {
+			filter_name = filter_names[i].name;
+		}
+	}
+	if (!filter_name) {
+		(void)snprintf(filter_buf, sizeof(filter_buf), "%d", filter);
+		filter_name = filter_buf;
+	}
+
+	format_mask(flag_names, NITEMS(flag_names), flags, flags_buf,
+	    sizeof(flags_buf));
+	if (flags != 0) {
+		(void)snprintf(buf, size, "%s/%ld/%s", filter_name, data,
+		    flags_buf);
+	} else {
+		(void)snprintf(buf, size, "%s/%ld", filter_name, data);
+	}
+}
+
+static long
+expected_data(struct scenario_ctx const *ctx, struct scenario_kevent const *kev)
+{
+	return (kev->data_relative ? ctx->pipe_capacity + kev->data
+				   : kev->data);
+}
+
+/*
+ * Resolves the expectations relative to the pipe capacity in 'expect'.
+ * Like poll(2), EVFILT_WRITE only reports a writer once PIPE_BUF bytes fit,
+ * so a "cap-<n>" write event below that low-water mark is not expected, and
+ * neither is POLLOUT then. This keeps scenarios valid down to the smallest
+ * pipe sizes.
+ */
+static void
+resolve_expect(struct scenario_ctx const *ctx,
+    struct scenario_expect const *expect, struct scenario_expect *resolved)
+{
+	*resolved = *expect;
+	resolved->nkevents = 0;
+	for (int i = 0; i < expect->nkevents; ++i) {
+		struct scenario_kevent kev = expect->kevents[i];
+
+		kev.data = expected_data(ctx, &kev);
+		if (kev.data_relative && kev.filter == EVFILT_WRITE &&
+		    !(kev.flags & EV_EOF) && kev.data < PIPE_BUF) {
+			resolved->revents &= ~POLLOUT;
+			continue;
+		}
+		kev.data_relative = false;
+		resolved->kevents[resolved->nkevents++] = kev;
+	}
+}
+
+/* What the kernel actually did in a step, for the result sink. */
+struct observed_check {
+	short revents;
+	int nkevents;
+	struct kevent kevents[16];
+};
+
+struct observed {
+	ssize_t result;
+	int error;
+	struct observed_check check;
+	struct observed_check probe;
+};
+
+/*
+ * Checks what poll(2) and the already set up kqueue 'kq' report for 'fd'
+ * against 'expect'. Mismatches are reported with report(), what was
+ * observed is stored in 'seen'.
+ */
+static bool
+pollfd(struct scenario_ctx *ctx, struct scenario const *scenario,
+    struct scenario_step const *step, char const *who, int fd, int kq,
+    struct scenario_expect const *relative_expect, enum latency_state state,
+    struct observed_check *seen)
+{
+	struct scenario_expect resolved;
+	struct scenario_expect const *expect = &resolved;
+	struct pollfd pfd = { .fd = fd, /**/
+		.events = POLLIN | POLLPRI | POLLOUT };
+	struct kevent *kev = seen->kevents;
+	bool matched[SCENARIO_MAX_KEVENTS] = { false };
+	bool ok = true;
+	uint64_t start = 0;
+	int n;
+
+	resolve_expect(ctx, relative_expect, &resolved);
+
+	if (ctx->measure_latency) {
+		start = latency_now();
+	}
+	n = poll(&pfd, 1, 0);
+	if (n < 0) {
+		err(1, "poll");
+	}
+	if (ctx->measure_latency) {
+		latency_record(LATENCY_POLL, state, latency_now() - start);
+	}
+	seen->revents = pfd.revents;
+	if (!expect->any_revents &&
+	    (n != (expect->revents != 0) || pfd.revents != expect->revents)) {
+		char want[64], got[64];
+
+		format_mask(revents_names, NITEMS(revents_names),
+		    expect->revents, want, sizeof(want));
+		format_mask(revents_names, NITEMS(revents_names), pfd.revents,
+		    got, sizeof(got));
+		report(ctx, scenario, step, "%s%s: poll expected %s, got %s",
+		    scenario->actor_names[step->actor], who, want, got);
+		ok = false;
+	}
+
+	if (ctx->measure_latency) {
+		start = latency_now();
+	}
+	n = kevent(kq, NULL, 0, kev, (int)NITEMS(seen->kevents),
+	    &(struct timespec) { 0, 0 });
+	if (n < 0) {
+		err(1, "kevent");
+	}
+	if (ctx->measure_latency) {
+		latency_record(LATENCY_KEVENT, state, latency_now() - start);
+	}
+	seen->nkevents = n;
+
+	/* The order in which kevent(2) returns events does not matter. */
+	bool kevents_ok = n == expect->nkevents;
+	for (int i = 0; kevents_ok && i < n; ++i) {
+		int j;
+
+		for (j = 0; j < expect->nkevents; ++j) {
+			struct scenario_kevent const *e = &expect->kevents[j];
+
+			if (!matched[j] && kev[i].filter == e->filter &&
+			    (long)kev[i].data == expected_data(ctx, e) &&
+			    kev[i].flags == (e->flags | EV_CLEAR)) {
+				matched[j] = true;
+				break;
+			}
+		}
+		kevents_ok = j < expect->nkevents;
+	}
+
+	if (!kevents_ok) {
+		char want[256] = "-", got[256] = "-";
+		size_t len = 0;
+
+		for (int i = 0; i < expect->nkevents; ++i) {
+			struct scenario_kevent const *e = &expect->kevents[i];
+
+			if (len < sizeof(want) && i > 0) {
+				want[len++] = ',';
+			}
+			format_kevent(e->filter, expected_data(ctx, e),
+			    e->flags, want + len,
+			    len < sizeof(want) ? sizeof(want) - len : 0);
+			len += strlen(want + len);
+		}
+		len = 0;
+		for (int i = 0; i < n; ++i) {
+			if (len < sizeof(got) && i > 0) {
+				got[len++] = ',';
+			}
+			format_kevent(kev[i].filter, (long)kev[i].data,
+			    (unsigned short)(kev[i].flags & ~EV_CLEAR),
+			    got + len,
+			    len < sizeof(got) ? sizeof(got) - len : 0);
+			len += strlen(got + len);
+		}
+		report(ctx, scenario, step, "%s%s: kevent expected %s, got %s",
+		    scenario->actor_names[step->actor], who, want, got);
+		ok = false;
+	}
+
+	return (ok);
+}
+
+static int
+actor_open(struct scenario_ctx *ctx, int open_flags, int *fd, int *kq)
+{
+	struct kevent kev[2];
+
+	*fd = open(ctx->fifo_path, open_flags | O_NONBLOCK | O_CLOEXEC);
+	if (*fd < 0) {
+		return (-1);
+	}
+	if (ctx->pipe_size > 0 && pipe_size_set(*fd, ctx->pipe_size) < 0) {
+		err(1, "%s: cannot resize to %ld bytes", ctx->fifo_path,
+		    ctx->pipe_size);
+	}
+
+	if (*kq < 0) {
+		*kq = kqueue();
+		if (*kq < 0) {
+			err(1, "kqueue");
+		}
+	}
+
+	EV_SET(&kev[0], *fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
+	EV_SET(&kev[1], *fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, NULL);
+	if (kevent(*kq, kev, 2, NULL, 0, NULL) < 0) {
+		err(1, "kevent");
+	}
+
+	return (0);
+}
+
+static void
+actor_close(int *fd, int kq)
+{
+	struct kevent kev[2];
+
+	EV_SET(&kev[0], *fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+	EV_SET(&kev[1], *fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+	if (kevent(kq, kev, 2, NULL, 0, NULL) < 0) {
+		err(1, "kevent");
+	}
+
+	(void)close(*fd);
+	*fd = -1;
+}
+
+static bool
+check_result(struct scenario_ctx const *ctx, struct scenario const *scenario,
+    struct scenario_step const *step, ssize_t result, int error)
+{
+	if (!step->check_result) {
+		return (true);
+	}
+
+	if (result != step->result ||
+	    (result < 0 && error != step->error)) {
+		char want[64], got[64];
+
+		if (step->result < 0) {
+			(void)snprintf(want, sizeof(want), "%s",
+			    strerror(step->error));
+		} else {
+			(void)snprintf(want, sizeof(want), "%zd",
+			    step->result);
+		}
+		if (result < 0) {
+			(void)snprintf(got, sizeof(got), "%s",
+			    strerror(error));
+		} else {
+			(void)snprintf(got, sizeof(got), "%zd", result);
+		}
+		report(ctx, scenario, step, "%s %s: expected %s, got %s",
+		    op_names[step->op], scenario->actor_names[step->actor],
+		    want, got);
+		return (false);
+	}
+
+	return (true);
+}
+
+/* What the writers of the FIFO have done so far, for latency_record(). */
+struct writers {
+	int open;
+	bool closed_all;
+};
+
+static void
+writers_update(struct writers *writers, int open_flags, int delta)
+{
+	if (open_flags != O_WRONLY) {
+		return;
+	}
+	writers->open += delta;
+	if (writers->open == 0) {
+		writers->closed_all = true;
+	}
+}
+
+static enum latency_state
+writers_state(struct writers const *writers)
+{
+	if (writers->open == 0) {
+		return (writers->closed_all ? LATENCY_EOF : LATENCY_NO_WRITER);
+	}
+
+	return (writers->closed_all ? LATENCY_REOPENED : LATENCY_WRITER);
+}
+
+static bool
+run_step(struct scenario_ctx *ctx, struct scenario const *scenario,
+    struct scenario_step const *step, int *fds, int *kqs,
+    struct writers *writers, char *buf, struct observed *seen)
+{
+	int *fd = &fds[step->actor];
+	int *kq = &kqs[step->actor];
+	ssize_t r;
+
+	if (step->op != SCENARIO_OPEN && *fd < 0) {
+		report(ctx, scenario, step, "%s %s: not open",
+		    op_names[step->op], scenario->actor_names[step->actor]);
+		return (false);
+	}
+
+	switch (step->op) {
+	case SCENARIO_OPEN:
+		if (*fd >= 0) {
+			report(ctx, scenario, step, "open %s: already open",
+			    scenario->actor_names[step->actor]);
+			return (false);
+		}
+		r = actor_open(ctx, step->open_flags, fd, kq);
+		if (r == 0) {
+			writers_update(writers, step->open_flags, 1);
+		}
+		seen->result = r;
+		seen->error = errno;
+		return (check_result(ctx, scenario, step, r, errno));
+	case SCENARIO_CLOSE:
+		actor_close(fd, *kq);
+		writers_update(writers, step->open_flags, -1);
+		return (true);
+	case SCENARIO_REOPEN:
+		actor_close(fd, *kq);
+		writers_update(writers, step->open_flags, -1);
+		if (actor_open(ctx, step->open_flags, fd, kq) < 0) {
+			report(ctx, scenario, step, "reopen %s: %s",
+			    scenario->actor_names[step->actor],
+			    strerror(errno));
+			return (false);
+		}
+		writers_update(writers, step->open_flags, 1);
+		return (true);
+	case SCENARIO_READ:
+		r = read(*fd, buf, step->count);
+		seen->result = r;
+		seen->error = errno;
+		return (check_result(ctx, scenario, step, r, errno));
+	case SCENARIO_WRITE:
+		r = write(*fd, buf, step->count);
+		seen->result = r;
+		seen->error = errno;
+		return (check_result(ctx, scenario, step, r, errno));
+	case SCENARIO_CHECK: {
+		enum latency_state state = writers_state(writers);
+		bool ok = pollfd(ctx, scenario, step, "", *fd, *kq,
+		    &step->expect, state, &seen->check);
+
+		if (step->probe) {
+			int probe_fd;
+			int probe_kq = -1;
+
+			if (actor_open(ctx, step->open_flags, &probe_fd,
+				&probe_kq) < 0) {
+				report(ctx, scenario, step,
+				    "%s probe: open: %s",
+				    scenario->actor_names[step->actor],
+				    strerror(errno));
+				return (false);
+			}
+			ok &= pollfd(ctx, scenario, step, " probe", probe_fd,
+			    probe_kq, &step->probe_expect, state,
+			    &seen->probe);
+			(void)close(probe_kq);
+			(void)close(probe_fd);
+		}
+
+		return (ok);
+	}
+	}
+
+	return (false);
+}
+
+static void
+sink_mask(struct result_sink *sink, struct name_value const *table, size_t n,
+    int mask)
+{
+	char buf[64];
+
+	format_mask(table, n, mask, buf, sizeof(buf));
+	result_sink_string(sink, buf);
+}
+
+static void
+sink_kevent(struct result_sink *sink, short filter, long data,
+    unsigned short flags)
+{
+	char const *name = lookup_value(filter_names, NITEMS(filter_names),
+	    filter);
+
+	if (name) {
+		result_sink_printf(sink, "{\"filter\":\"%s\"", name);
+	} else {
+		result_sink_printf(sink, "{\"filter\":%d", filter);
+	}
+	result_sink_printf(sink, ",\"data\":%ld,\"flags\":", data);
+	sink_mask(sink, flag_names, NITEMS(flag_names), flags);
+	result_sink_printf(sink, "}");
+}
+
+static void
+sink_check(struct scenario_ctx const *ctx,
+    struct scenario_expect const *relative_expect,
+    struct observed_check const *seen)
+{
+	struct result_sink *sink = ctx->sink;
+	struct scenario_expect resolved;
+	struct scenario_expect const *expect = &resolved;
+
+	resolve_expect(ctx, relative_expect, &resolved);
+
+	result_sink_printf(sink, "{\"poll\":{\"expected\":");
+	if (expect->any_revents) {
+		result_sink_string(sink, "*");
+	} else {
+		sink_mask(sink, revents_names, NITEMS(revents_names),
+		    expect->revents);
+	}
+	result_sink_printf(sink, ",\"actual\":");
+	sink_mask(sink, revents_names, NITEMS(revents_names), seen->revents);
+
+	result_sink_printf(sink, "},\"kevents\":{\"expected\":[");
+	for (int i = 0; i < expect->nkevents; ++i) {
+		struct scenario_kevent const *e = &expect->kevents[i];
+
+		if (i > 0) {
+			result_sink_printf(sink, ",");
+		}
+		sink_kevent(sink, e->filter, expected_data(ctx, e), e->flags);
+	}
+	result_sink_printf(sink, "],\"actual\":[");
+	for (int i = 0; i < seen->nkevents; ++i) {
+		struct kevent const *kev = &seen->kevents[i];
+
+		if (i > 0) {
+			result_sink_printf(sink, ",");
+		}
+		sink_kevent(sink, kev->filter, (long)kev->data,
+		    (unsigned short)(kev->flags & ~EV_CLEAR));
+	}
+	result_sink_printf(sink, "]}}");
+}
+
+static void
+sink_result(struct result_sink *sink, ssize_t result, int error)
+{
+	char const *name;
+
+	if (result >= 0) {
+		result_sink_printf(sink, "{\"result\":%zd}", result);
+		return;
+	}
+
+	name = lookup_value(errno_names, NITEMS(errno_names), error);
+	if (name) {
+		result_sink_printf(sink, "{\"errno\":\"%s\"}", name);
+	} else {
+		result_sink_printf(sink, "{\"errno\":%d}", error);
+	}
+}
+
+/* Appends one JSON record for 'step' to the context's result sink. */
+static void
+sink_step(struct scenario_ctx const *ctx, struct scenario const *scenario,
+    size_t index, struct scenario_step const *step, bool ok, uint64_t ns,
+    struct observed const *seen)
+{
+	struct result_sink *sink = ctx->sink;
+
+	result_sink_printf(sink, "{\"scenario\":");
+	result_sink_string(sink, scenario->name);
+	result_sink_printf(sink, ",\"source\":");
+	result_sink_string(sink, scenario->source);
+	result_sink_printf(sink,
+	    ",\"run\":%lu,\"step\":%zu,\"line\":%d,\"op\":\"%s\","
+	    "\"actor\":",
+	    ctx->scenarios, index, step->line, op_names[step->op]);
+	result_sink_string(sink, scenario->actor_names[step->actor]);
+	result_sink_printf(sink, ",\"ok\":%s,\"ns\":%llu",
+	    ok ? "true" : "false", (unsigned long long)ns);
+
+	switch (step->op) {
+	case SCENARIO_OPEN:
+	case SCENARIO_READ:
+	case SCENARIO_WRITE:
+		if (step->check_result) {
+			result_sink_printf(sink, ",\"expected\":");
+			sink_result(sink, step->result, step->error);
+		}
+		result_sink_printf(sink, ",\"actual\":");
+		sink_result(sink, seen->result, seen->error);
+		break;
+	case SCENARIO_CHECK:
+		result_sink_printf(sink, ",\"check\":");
+		sink_check(ctx, &step->expect, &seen->check);
+		if (step->probe) {
+			result_sink_printf(sink, ",\"probe\":");
+			sink_check(ctx, &step->probe_expect, &seen->probe);
+		}
+		break;
+	case SCENARIO_CLOSE:
+	case SCENARIO_REOPEN:
+		break;
+	}
+
+	result_sink_printf(sink, "}");
+	result_sink_end_record(sink);
+}
+
+int
+scenario_run(struct scenario_ctx *ctx, struct scenario const *scenario)
+{
+	int fds[SCENARIO_MAX_ACTORS];
+	int kqs[SCENARIO_MAX_ACTORS];
+	struct writers writers = { 0 };
+	size_t buf_size = 1;
+	char *buf;
+	int failed = 0;
+
+	for (size_t i = 0; i < scenario->nsteps; ++i) {
+		if (scenario->steps[i].count > buf_size) {
+			buf_size = scenario->steps[i].count;
+		}
+	}
+	buf = calloc(1, buf_size);
+	if (!buf) {
+		err(1, "calloc");
+	}
+
+	for (int i = 0; i < SCENARIO_MAX_ACTORS; ++i) {
+		fds[i] = -1;
+		kqs[i] = -1;
+	}
+
+	for (size_t i = 0; i < scenario->nsteps; ++i) {
+		struct scenario_step const *step = &scenario->steps[i];
+		struct observed seen = { .result = -1 };
+		uint64_t start = ctx->sink ? latency_now() : 0;
+		bool ok = run_step(ctx, scenario, step, fds, kqs, &writers,
+		    buf, &seen);
+
+		if (ctx->sink) {
+			sink_step(ctx, scenario, i, step, ok,
+			    latency_now() - start, &seen);
+		}
+		++ctx->steps;
+		if (!ok) {
+			++ctx->failed_steps;
+			++failed;
+		}
+		if (ctx->verbose) {
+			fprintf(stderr, "%s:%d: %s %s %s\n", scenario->source,
+			    step->line, op_names[step->op],
+			    scenario->actor_names[step->actor],
+			    ok ? "SUCCESSFUL" : "FAILED");
+		}
+	}
+
+	/* Closing every descriptor also discards the FIFO's contents. */
+	for (int i = 0; i < scenario->nactors; ++i) {
+		if (fds[i] >= 0) {
+			(void)close(fds[i]);
+		}
+		if (kqs[i] >= 0) {
+			(void)close(kqs[i]);
+		}
+	}
+	free(buf);
+
+	++ctx->scenarios;
+
+	return (failed ? -1 : 0);
+}
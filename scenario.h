@@ -0,0 +1,114 @@
+#ifndef SCENARIO_H_
+#define SCENARIO_H_
+
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * A scenario is a sequence of steps that open, close, read and write FIFO
+ * file descriptors ("actors") and check what poll(2) and kevent(2) report
+ * for them. Scenarios are usually parsed from text:
+ *
+ *	# comment
+ *	scenario <name>
+ *	open <actor> r|w [=<errno>]
+ *	close <actor>
+ *	reopen <actor>
+ *	read <actor> <count> [=<result>|=<errno>]
+ *	write <actor> <count> [=<result>|=<errno>]
+ *	check <actor> [poll=<revents>] [kev=<kevents>] [probe [poll=...] [kev=...]]
+ *
+ * <revents> is '-' or a '|' separated list of IN, PRI, OUT, HUP, ERR and
+ * NVAL, or '*' to not check poll(2) at all. <kevents> is '-' or a ','
+ * separated list of <filter>/<data>[/EOF] where <filter> is READ or WRITE
+ * and <data> is a number, "cap" or "cap-<n>", relative to the pipe capacity
+ * of the scenario context. A relative WRITE event without EOF that falls
+ * below PIPE_BUF is not expected, and neither is POLLOUT, as writers are
+ * only reported once PIPE_BUF bytes fit. EV_CLEAR is implied. Missing
+ * expectations mean that nothing must be reported.
+ *
+ * Every actor has its own kqueue with EVFILT_READ and EVFILT_WRITE
+ * registered on its descriptor. A "probe" opens a fresh descriptor in the
+ * actor's mode with a fresh kqueue and checks it as well.
+ */
+
+#define SCENARIO_MAX_ACTORS 16
+#define SCENARIO_MAX_KEVENTS 4
+
+enum scenario_op {
+	SCENARIO_OPEN,
+	SCENARIO_CLOSE,
+	SCENARIO_REOPEN,
+	SCENARIO_READ,
+	SCENARIO_WRITE,
+	SCENARIO_CHECK,
+};
+
+struct scenario_kevent {
+	short filter;
+	unsigned short flags;
+	bool data_relative;
+	long data;
+};
+
+struct scenario_expect {
+	bool any_revents;
+	short revents;
+	int nkevents;
+	struct scenario_kevent kevents[SCENARIO_MAX_KEVENTS];
+};
+
+struct scenario_step {
+	enum scenario_op op;
+	int actor;
+	int line;
+	int open_flags;
+	size_t count;
+	bool check_result;
+	ssize_t result;
+	int error;
+	struct scenario_expect expect;
+	bool probe;
+	struct scenario_expect probe_expect;
+};
+
+struct scenario {
+	char *name;
+	char const *source;
+	int nactors;
+	char *actor_names[SCENARIO_MAX_ACTORS];
+	size_t nsteps;
+	struct scenario_step *steps;
+};
+
+struct result_sink;
+
+struct scenario_ctx {
+	char const *fifo_path;
+	long pipe_capacity;
+	/* If set, every FIFO is resized when opened, see pipe_size.h. */
+	long pipe_size;
+	bool verbose;
+	bool quiet;
+	/* Record the cost of every poll(2) and kevent(2), see latency.h. */
+	bool measure_latency;
+	/* If set, every step is recorded as a JSON line, see result_sink.h. */
+	struct result_sink *sink;
+
+	unsigned long scenarios;
+	unsigned long steps;
+	unsigned long failed_steps;
+};
+
+int scenario_parse(char const *text, char const *source,
+    struct scenario **scenarios, size_t *nscenarios);
+void scenario_free(struct scenario *scenarios, size_t nscenarios);
+
+void scenario_print(FILE *fp, struct scenario const *scenario);
+
+int scenario_run(struct scenario_ctx *ctx, struct scenario const *scenario);
+
+#endif
@@ -0,0 +1,372 @@
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "soak.h"
+
+struct sample {
+	int fds;
+	int kqueues;
+	long rss_kb;
+};
+
+static double
+now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((double)ts.tv_sec + (double)ts.tv_nsec * 1e-9);
+}
+
+#ifdef __linux__
+/* kqueue emulations on Linux are built on epoll. */
+static void
+count_descriptors(int *fds, int *kqueues)
+{
+	char target[64];
+	struct dirent *ent;
+	DIR *dir;
+
+	*fds = *kqueues = 0;
+
+	dir = opendir("/proc/self/fd");
+	if (!dir) {
+		return;
+	}
+	while ((ent = readdir(dir))) {
+		ssize_t n;
+
+		if (ent->d_name[0] == '.' ||
+		    strtol(ent->d_name, NULL, 10) == dirfd(dir)) {
+			continue;
+		}
+		++*fds;
+
+		n = readlinkat(dirfd(dir), ent->d_name, target,
+		    sizeof(target) - 1);
+		if (n < 0) {
+			continue;
+		}
+		target[n] = '\0';
+		if (strcmp(target, "anon_inode:[eventpoll]") == 0 ||
+		    strcmp(target, "anon_inode:[kqueue]") == 0) {
+			++*kqueues;
+		}
+	}
+	closedir(dir);
+}
+
+static long
+rss_kb(void)
+{
+	long pages = 0;
+	FILE *fp;
+
+	fp = fopen("/proc/self/statm", "r");
+	if (!fp) {
+		return (0);
+	}
+	if (fscanf(fp, "%*s %ld", &pages) != 1) {
+		pages = 0;
+	}
+	fclose(fp);
+
+	return (pages * (sysconf(_SC_PAGESIZE) / 1024));
+}
+#else
+/* fstat(2) on a kqueue reports a FIFO without inode. */
+static void
+count_descriptors(int *fds, int *kqueues)
+{
+	int max = getdtablesize();
+	struct stat st;
+
+	*fds = *kqueues = 0;
+	for (int fd = 0; fd < max; ++fd) {
+		if (fstat(fd, &st) < 0) {
+			continue;
+		}
+		++*fds;
+		if (S_ISFIFO(st.st_mode) && st.st_ino == 0) {
+			++*kqueues;
+		}
+	}
+}
+
+/* Without /proc, the peak RSS is the best approximation. */
+static long
+rss_kb(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) < 0) {
+		return (0);
+	}
+
+	return (ru.ru_maxrss);
+}
+#endif
+
+static void
+take_sample(struct sample *sample)
+{
+	count_descriptors(&sample->fds, &sample->kqueues);
+	sample->rss_kb = rss_kb();
+}
+
+struct soak {
+	struct scenario_ctx *ctxs;
+	unsigned njobs;
+	struct scenario const *scenarios;
+	size_t nscenarios;
+	struct soak_options const *options;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t resume; /* workers wait for the reporter */
+	pthread_cond_t idle;   /* the reporter waits for workers */
+	unsigned long started;
+	unsigned long finished;
+	unsigned running;
+	unsigned settled;
+	unsigned exited;
+	bool paused;
+	bool stop;
+};
+
+struct soak_job {
+	struct soak *soak;
+	struct scenario_ctx *ctx;
+	pthread_t thread;
+};
+
+static void *
+soak_worker(void *arg)
+{
+	struct soak_job *job = arg;
+	struct soak *s = job->soak;
+	struct soak_options const *options = s->options;
+	unsigned long rounds = 0;
+
+	pthread_mutex_lock(&s->mutex);
+	for (;;) {
+		while (s->paused && !s->stop) {
+			pthread_cond_wait(&s->resume, &s->mutex);
+		}
+		if (s->stop || (options->iterations > 0 &&
+				   s->started == options->iterations)) {
+			break;
+		}
+		++s->started;
+		++s->running;
+		pthread_mutex_unlock(&s->mutex);
+
+		if (options->recreate && rounds > 0) {
+			if (unlink(job->ctx->fifo_path) < 0) {
+				err(1, "unlink");
+			}
+			if (mkfifo(job->ctx->fifo_path, 0666) < 0) {
+				err(1, "mkfifo");
+			}
+		}
+		for (size_t i = 0; i < s->nscenarios; ++i) {
+			(void)scenario_run(job->ctx, &s->scenarios[i]);
+		}
+
+		pthread_mutex_lock(&s->mutex);
+		--s->running;
+		++s->finished;
+		/* The first round settles one-time allocations. */
+		if (++rounds == 1) {
+			++s->settled;
+			pthread_cond_signal(&s->idle);
+		} else if (s->paused && s->running == 0) {
+			pthread_cond_signal(&s->idle);
+		}
+	}
+	++s->exited;
+	pthread_cond_signal(&s->idle);
+	pthread_mutex_unlock(&s->mutex);
+
+	return (NULL);
+}
+
+/* Waits until no round is in progress. Called with the mutex held. */
+static void
+pause_jobs(struct soak *s)
+{
+	s->paused = true;
+	while (s->running > 0) {
+		pthread_cond_wait(&s->idle, &s->mutex);
+	}
+}
+
+static void
+resume_jobs(struct soak *s)
+{
+	s->paused = false;
+	pthread_cond_broadcast(&s->resume);
+}
+
+/*
+ * Prints one row. Until every job finished its first round there is no
+ * 'baseline' to compare against, and the leak columns show '-'.
+ */
+static void
+report(struct soak const *s, double elapsed, double rate,
+    struct sample const *baseline)
+{
+	struct sample sample;
+	unsigned long failed = 0;
+	char leaked_fds[16] = "-", leaked_kqs[16] = "-", growth[24] = "-";
+
+	for (unsigned i = 0; i < s->njobs; ++i) {
+		failed += s->ctxs[i].failed_steps;
+	}
+	take_sample(&sample);
+	if (baseline) {
+		(void)snprintf(leaked_fds, sizeof(leaked_fds), "%+d",
+		    sample.fds - baseline->fds);
+		(void)snprintf(leaked_kqs, sizeof(leaked_kqs), "%+d",
+		    sample.kqueues - baseline->kqueues);
+		(void)snprintf(growth, sizeof(growth), "%+ld",
+		    sample.rss_kb - baseline->rss_kb);
+	}
+	fprintf(stderr,
+	    "%10.1f %12lu %10.1f %10lu %6d %6s %6d %6s %9ld %9s\n",
+	    elapsed, s->finished, rate, failed, sample.fds, leaked_fds,
+	    sample.kqueues, leaked_kqs, sample.rss_kb, growth);
+}
+
+static struct timespec
+deadline(double t)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)t;
+	ts.tv_nsec = (long)((t - (double)ts.tv_sec) * 1e9);
+
+	return (ts);
+}
+
+void
+soak(struct scenario_ctx *ctxs, unsigned njobs,
+    struct scenario const *scenarios, size_t nscenarios,
+    struct soak_options const *options)
+{
+	struct soak s = {
+		.ctxs = ctxs,
+		.njobs = njobs,
+		.scenarios = scenarios,
+		.nscenarios = nscenarios,
+		.options = options,
+	};
+	struct soak_job *jobs;
+	struct sample baseline = { 0 };
+	pthread_condattr_t attr;
+	bool baseline_taken = false;
+	double start, last, next;
+	unsigned long last_finished = 0;
+	unsigned started;
+	int error;
+
+	jobs = calloc(njobs, sizeof(struct soak_job));
+	if (!jobs) {
+		err(1, "calloc");
+	}
+	pthread_mutex_init(&s.mutex, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&s.idle, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&s.resume, NULL);
+
+	fprintf(stderr, "%10s %12s %10s %10s %6s %6s %6s %6s %9s %9s\n",
+	    "elapsed_s", "iterations", "iter/s", "failed", "fds", "leaked",
+	    "kqs", "leaked", "rss_kb", "growth");
+
+	start = last = now_s();
+	next = start + options->interval;
+
+	pthread_mutex_lock(&s.mutex);
+	for (started = 0; started < njobs; ++started) {
+		jobs[started].soak = &s;
+		jobs[started].ctx = &ctxs[started];
+		if ((error = pthread_create(&jobs[started].thread, NULL,
+			 soak_worker, &jobs[started])) != 0) {
+			errno = error;
+			err(1, "pthread_create");
+		}
+	}
+
+	while (s.exited < njobs) {
+		struct timespec ts;
+		double now, wake = next;
+
+		/* Once stopping, there is nothing left to report. */
+		if (s.stop || s.exited > 0) {
+			pthread_cond_wait(&s.idle, &s.mutex);
+			continue;
+		}
+		if (options->duration > 0 && start + options->duration < wake) {
+			wake = start + options->duration;
+		}
+		ts = deadline(wake);
+		(void)pthread_cond_timedwait(&s.idle, &s.mutex, &ts);
+
+		now = now_s();
+		if (options->duration > 0 && now - start >= options->duration) {
+			s.stop = true;
+			pthread_cond_broadcast(&s.resume);
+			continue;
+		}
+		if (s.exited > 0) {
+			continue;
+		}
+		if (!baseline_taken && s.settled == njobs) {
+			pause_jobs(&s);
+			take_sample(&baseline);
+			baseline_taken = true;
+			resume_jobs(&s);
+		}
+		if (now >= next) {
+			pause_jobs(&s);
+			report(&s, now - start,
+			    (double)(s.finished - last_finished) / (now - last),
+			    baseline_taken ? &baseline : NULL);
+			resume_jobs(&s);
+			last = now;
+			last_finished = s.finished;
+			next = now + options->interval;
+		}
+	}
+	pthread_mutex_unlock(&s.mutex);
+
+	for (unsigned i = 0; i < started; ++i) {
+		(void)pthread_join(jobs[i].thread, NULL);
+	}
+
+	double now = now_s();
+
+	report(&s, now - start,
+	    now > last ? (double)(s.finished - last_finished) / (now - last)
+		       : 0,
+	    baseline_taken ? &baseline : NULL);
+
+	pthread_cond_destroy(&s.resume);
+	pthread_cond_destroy(&s.idle);
+	pthread_mutex_destroy(&s.mutex);
+	free(jobs);
+}
@@ -0,0 +1,32 @@
+#ifndef SOAK_H_
+#define SOAK_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "scenario.h"
+
+/*
+ * Soak mode replays scenarios until 'duration' seconds have passed or
+ * 'iterations' rounds have run, whichever comes first; zero means no
+ * limit. Every one of the 'njobs' contexts runs rounds in a thread of its
+ * own, so the contexts must use different FIFOs. Every 'interval' seconds
+ * the jobs are paused between rounds and the iteration rate is reported,
+ * together with how many descriptors, kqueues and resident kilobytes the
+ * process has gained since every job finished its first round. With
+ * 'recreate', each job removes and creates its FIFO again before every
+ * round.
+ */
+
+struct soak_options {
+	double duration;
+	unsigned long iterations;
+	double interval;
+	bool recreate;
+};
+
+void soak(struct scenario_ctx * /* ctxs */, unsigned /* njobs */,
+    struct scenario const * /* scenarios */, size_t /* nscenarios */,
+    struct soak_options const * /* options */);
+
+#endif
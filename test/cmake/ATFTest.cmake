@@ -4,9 +4,20 @@
 
 set(_ATF_SCRIPT_DIR "${CMAKE_CURRENT_LIST_DIR}")
 
+# With ATF_PARALLEL enabled, test programs are not registered one CTest test
+# per test case. Instead, `atf_add_parallel_test()` registers a single test
+# that runs all test cases of all programs concurrently with `atf-run`.
+option(ATF_PARALLEL "Run all ATF test cases from one parallel driver" OFF)
+
 function(atf_discover_tests _target)
   cmake_parse_arguments("" "" "" "PROPERTIES" ${ARGN})
 
+  if(ATF_PARALLEL)
+    set_property(GLOBAL APPEND PROPERTY _ATF_PARALLEL_EXECUTABLES
+                                        "$<TARGET_FILE:${_target}>")
+    return()
+  endif()
+
   set(ctest_file_base "${CMAKE_CURRENT_BINARY_DIR}/${_target}")
   set(ctest_include_file "${ctest_file_base}_include.cmake")
   set(ctest_tests_file "${ctest_file_base}_tests.cmake")
@@ -39,3 +50,12 @@ function(atf_discover_tests _target)
     APPEND
     PROPERTY TEST_INCLUDE_FILES "${ctest_include_file}")
 endfunction()
+
+function(atf_add_parallel_test _name _driver)
+  get_property(_executables GLOBAL PROPERTY _ATF_PARALLEL_EXECUTABLES)
+
+  add_test(
+    NAME "${_name}"
+    COMMAND "$<TARGET_FILE:${_driver}>" -w "${CMAKE_CURRENT_BINARY_DIR}"
+            ${_executables})
+endfunction()
@@ -0,0 +1,234 @@
+#include <sys/types.h>
+#include <sys/event.h>
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atf-c.h>
+
+#include "coro_rt.h"
+
+#define STACK_SIZE (64 * 1024)
+
+/* Enough workers that tasks get stolen, even on a single CPU. */
+#define NWORKERS 4
+#define NTASKS 64
+
+/*
+ * Tasks only record what they see; the test body checks it after
+ * coro_rt_run() returned.
+ */
+
+static void
+yield_task(struct coro_rt_task *task, void *arg)
+{
+	_Atomic unsigned *count = arg;
+
+	for (int i = 0; i < 1000; ++i) {
+		atomic_fetch_add(count, 1);
+		coro_rt_yield(task);
+	}
+}
+
+ATF_TC_WITHOUT_HEAD(coro_rt__yield);
+ATF_TC_BODY(coro_rt__yield, tc)
+{
+	_Atomic unsigned count = 0;
+	struct coro_rt *rt;
+	struct coro_rt_stats stats;
+
+	ATF_REQUIRE((rt = coro_rt_create(NWORKERS, STACK_SIZE)) != NULL);
+	for (int i = 0; i < NTASKS; ++i) {
+		ATF_REQUIRE(coro_rt_spawn(rt, yield_task, &count) == 0);
+	}
+
+	/*
+	 * Yielding tasks are stolen by other workers all the time; none of
+	 * them may be resumed before it has switched out.
+	 */
+
+	ATF_REQUIRE(coro_rt_run(rt) == 0);
+	ATF_REQUIRE(atomic_load(&count) == NTASKS * 1000);
+
+	coro_rt_stats(rt, &stats);
+	ATF_REQUIRE(stats.switches >= NTASKS * 1001);
+
+	coro_rt_destroy(rt);
+}
+
+struct pair {
+	int p[2];
+	size_t size;
+	ssize_t written;
+	size_t read;
+	ssize_t last_read;
+};
+
+static void
+pair_writer(struct coro_rt_task *task, void *arg)
+{
+	struct pair *pair = arg;
+	char *buf;
+
+	if ((buf = calloc(1, pair->size))) {
+		pair->written = coro_rt_write(task, pair->p[1], buf,
+		    pair->size);
+		free(buf);
+	}
+	close(pair->p[1]);
+}
+
+static void
+pair_reader(struct coro_rt_task *task, void *arg)
+{
+	struct pair *pair = arg;
+	char buf[512];
+	ssize_t n;
+
+	while ((n = coro_rt_read(task, pair->p[0], buf, sizeof(buf))) > 0) {
+		pair->read += (size_t)n;
+	}
+	pair->last_read = n;
+}
+
+ATF_TC_WITHOUT_HEAD(coro_rt__wait);
+ATF_TC_BODY(coro_rt__wait, tc)
+{
+	struct pair pairs[NTASKS / 2];
+	struct coro_rt *rt;
+
+	ATF_REQUIRE((rt = coro_rt_create(NWORKERS, STACK_SIZE)) != NULL);
+	for (size_t i = 0; i < NTASKS / 2; ++i) {
+		struct pair *pair = &pairs[i];
+
+		*pair = (struct pair) { .size = 256 * 1024, .last_read = -2 };
+		ATF_REQUIRE(pipe2(pair->p, O_CLOEXEC | O_NONBLOCK) == 0);
+		ATF_REQUIRE(coro_rt_spawn(rt, pair_writer, pair) == 0);
+		ATF_REQUIRE(coro_rt_spawn(rt, pair_reader, pair) == 0);
+	}
+
+	/*
+	 * Writers and readers wait for each other on whatever worker they
+	 * happen to run on.
+	 */
+
+	ATF_REQUIRE(coro_rt_run(rt) == 0);
+	for (size_t i = 0; i < NTASKS / 2; ++i) {
+		ATF_REQUIRE(pairs[i].written == (ssize_t)pairs[i].size);
+		ATF_REQUIRE(pairs[i].read == pairs[i].size);
+		ATF_REQUIRE(pairs[i].last_read == 0);
+		ATF_REQUIRE(close(pairs[i].p[0]) == 0);
+	}
+
+	coro_rt_destroy(rt);
+}
+
+struct wait_arg {
+	int fd;
+	int ret;
+	int error;
+	struct kevent kev;
+};
+
+static void
+wait_task(struct coro_rt_task *task, void *arg)
+{
+	struct wait_arg *wa = arg;
+
+	wa->ret = coro_rt_wait(task, wa->fd, EVFILT_READ, &wa->kev);
+	wa->error = errno;
+}
+
+ATF_TC_WITHOUT_HEAD(coro_rt__wait_error);
+ATF_TC_BODY(coro_rt__wait_error, tc)
+{
+	struct wait_arg wa[NTASKS];
+	struct coro_rt *rt;
+	int p[2] = { -1, -1 };
+
+	/* The workers' kqueues must not take over the closed number. */
+	ATF_REQUIRE((rt = coro_rt_create(NWORKERS, STACK_SIZE)) != NULL);
+	ATF_REQUIRE(pipe2(p, O_CLOEXEC | O_NONBLOCK) == 0);
+	ATF_REQUIRE(close(p[0]) == 0);
+
+	for (int i = 0; i < NTASKS; ++i) {
+		wa[i] = (struct wait_arg) { .fd = p[0] };
+		ATF_REQUIRE(coro_rt_spawn(rt, wait_task, &wa[i]) == 0);
+	}
+
+	/* The failed registration comes back as EV_ERROR for the task. */
+
+	ATF_REQUIRE(coro_rt_run(rt) == 0);
+	for (int i = 0; i < NTASKS; ++i) {
+		ATF_REQUIRE(wa[i].ret == -1);
+		ATF_REQUIRE(wa[i].error == EBADF);
+		ATF_REQUIRE(wa[i].kev.ident == (uintptr_t)p[0]);
+		ATF_REQUIRE(wa[i].kev.filter == EVFILT_READ);
+		ATF_REQUIRE((wa[i].kev.flags & EV_ERROR) != 0);
+		ATF_REQUIRE(wa[i].kev.data == EBADF);
+	}
+
+	coro_rt_destroy(rt);
+	ATF_REQUIRE(close(p[1]) == 0);
+}
+
+struct spawn_arg {
+	struct coro_rt *rt;
+	_Atomic unsigned children;
+	_Atomic unsigned failed;
+};
+
+static void
+child_task(struct coro_rt_task *task, void *arg)
+{
+	struct spawn_arg *sa = arg;
+
+	coro_rt_yield(task);
+	atomic_fetch_add(&sa->children, 1);
+}
+
+static void
+parent_task(struct coro_rt_task *task, void *arg)
+{
+	struct spawn_arg *sa = arg;
+
+	for (int i = 0; i < 16; ++i) {
+		if (coro_rt_spawn(sa->rt, child_task, sa) < 0) {
+			atomic_fetch_add(&sa->failed, 1);
+		}
+		coro_rt_yield(task);
+	}
+}
+
+ATF_TC_WITHOUT_HEAD(coro_rt__spawn_from_task);
+ATF_TC_BODY(coro_rt__spawn_from_task, tc)
+{
+	struct spawn_arg sa = { .children = 0 };
+
+	ATF_REQUIRE((sa.rt = coro_rt_create(NWORKERS, STACK_SIZE)) != NULL);
+	for (int i = 0; i < NTASKS; ++i) {
+		ATF_REQUIRE(coro_rt_spawn(sa.rt, parent_task, &sa) == 0);
+	}
+
+	/* coro_rt_run() also waits for the tasks spawned by tasks. */
+
+	ATF_REQUIRE(coro_rt_run(sa.rt) == 0);
+	ATF_REQUIRE(atomic_load(&sa.failed) == 0);
+	ATF_REQUIRE(atomic_load(&sa.children) == NTASKS * 16);
+
+	coro_rt_destroy(sa.rt);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, coro_rt__yield);
+	ATF_TP_ADD_TC(tp, coro_rt__wait);
+	ATF_TP_ADD_TC(tp, coro_rt__wait_error);
+	ATF_TP_ADD_TC(tp, coro_rt__spawn_from_task);
+
+	return atf_no_error();
+}
@@ -0,0 +1,346 @@
+#include <sys/types.h>
+#include <sys/event.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atf-c.h>
+
+#include "coro_sched.h"
+#include "pipe_size.h"
+
+#define STACK_SIZE (64 * 1024)
+
+/*
+ * Tasks only record what they see; the test body checks it after
+ * coro_sched_run() returned.
+ */
+struct trace {
+	char log[32];
+	size_t len;
+};
+
+static void
+trace_add(struct trace *trace, char c)
+{
+	if (trace->len < sizeof(trace->log) - 1) {
+		trace->log[trace->len++] = c;
+	}
+}
+
+struct yield_arg {
+	struct trace *trace;
+	char name;
+};
+
+static void
+yield_task(struct coro_sched *sched, void *arg)
+{
+	struct yield_arg *ya = arg;
+
+	for (int i = 0; i < 3; ++i) {
+		trace_add(ya->trace, ya->name);
+		coro_sched_yield(sched);
+	}
+}
+
+ATF_TC_WITHOUT_HEAD(coro_sched__yield_order);
+ATF_TC_BODY(coro_sched__yield_order, tc)
+{
+	struct trace trace = { .len = 0 };
+	struct yield_arg args[] = {
+		{ &trace, 'a' },
+		{ &trace, 'b' },
+		{ &trace, 'c' },
+	};
+	struct coro_sched *sched;
+
+	ATF_REQUIRE((sched = coro_sched_create(STACK_SIZE)) != NULL);
+	for (size_t i = 0; i < 3; ++i) {
+		ATF_REQUIRE(coro_sched_spawn(sched, yield_task, /**/
+		    &args[i]) == 0);
+	}
+
+	/* A yielding task goes to the back of the run queue. */
+
+	ATF_REQUIRE(coro_sched_run(sched) == 0);
+	ATF_REQUIRE(strcmp(trace.log, "abcabcabc") == 0);
+
+	coro_sched_destroy(sched);
+}
+
+static void
+child_task(struct coro_sched *sched, void *arg)
+{
+	(void)sched;
+	trace_add(arg, 'c');
+}
+
+static void
+parent_task(struct coro_sched *sched, void *arg)
+{
+	trace_add(arg, 'p');
+	if (coro_sched_spawn(sched, child_task, arg) < 0) {
+		trace_add(arg, 'E');
+	}
+	trace_add(arg, 'q');
+	coro_sched_yield(sched);
+	trace_add(arg, 'r');
+}
+
+ATF_TC_WITHOUT_HEAD(coro_sched__spawn_from_task);
+ATF_TC_BODY(coro_sched__spawn_from_task, tc)
+{
+	struct trace trace = { .len = 0 };
+	struct coro_sched *sched;
+	struct coro_sched_stats stats;
+
+	ATF_REQUIRE((sched = coro_sched_create(STACK_SIZE)) != NULL);
+	ATF_REQUIRE(coro_sched_spawn(sched, parent_task, &trace) == 0);
+
+	/*
+	 * The child is queued behind its parent and runs once the parent
+	 * parks; coro_sched_run() waits for it, too.
+	 */
+
+	ATF_REQUIRE(coro_sched_run(sched) == 0);
+	ATF_REQUIRE(strcmp(trace.log, "pqcr") == 0);
+
+	coro_sched_stats(sched, &stats);
+	ATF_REQUIRE(stats.switches == 3);
+	ATF_REQUIRE(stats.kevents == 0);
+
+	coro_sched_destroy(sched);
+}
+
+struct wait_arg {
+	int fd;
+	int ret;
+	int error;
+	struct kevent kev;
+};
+
+static void
+wait_task(struct coro_sched *sched, void *arg)
+{
+	struct wait_arg *wa = arg;
+
+	wa->ret = coro_sched_wait(sched, wa->fd, EVFILT_READ, &wa->kev);
+	wa->error = errno;
+}
+
+ATF_TC_WITHOUT_HEAD(coro_sched__wait_error);
+ATF_TC_BODY(coro_sched__wait_error, tc)
+{
+	struct wait_arg wa = { .ret = 0 };
+	struct coro_sched *sched;
+	int p[2] = { -1, -1 };
+
+	/* The scheduler's kqueue must not take over the closed number. */
+	ATF_REQUIRE((sched = coro_sched_create(STACK_SIZE)) != NULL);
+	ATF_REQUIRE(pipe2(p, O_CLOEXEC | O_NONBLOCK) == 0);
+	ATF_REQUIRE(close(p[0]) == 0);
+	wa.fd = p[0];
+
+	ATF_REQUIRE(coro_sched_spawn(sched, wait_task, &wa) == 0);
+
+	/* The failed registration comes back as EV_ERROR for the task. */
+
+	ATF_REQUIRE(coro_sched_run(sched) == 0);
+	ATF_REQUIRE(wa.ret == -1);
+	ATF_REQUIRE(wa.error == EBADF);
+	ATF_REQUIRE(wa.kev.ident == (uintptr_t)p[0]);
+	ATF_REQUIRE(wa.kev.filter == EVFILT_READ);
+	ATF_REQUIRE((wa.kev.flags & EV_ERROR) != 0);
+	ATF_REQUIRE(wa.kev.data == EBADF);
+
+	coro_sched_destroy(sched);
+	ATF_REQUIRE(close(p[1]) == 0);
+}
+
+struct eof_arg {
+	int p[2];
+	size_t size;
+	ssize_t written;
+	int write_error;
+	size_t read;
+	ssize_t last_read;
+};
+
+static void
+eof_writer(struct coro_sched *sched, void *arg)
+{
+	struct eof_arg *ea = arg;
+	char *buf;
+
+	if (!(buf = calloc(1, ea->size))) {
+		ea->write_error = ENOMEM;
+		return;
+	}
+	ea->written = coro_sched_write(sched, ea->p[1], buf, ea->size);
+	ea->write_error = ea->written < 0 ? errno : 0;
+	close(ea->p[1]);
+	free(buf);
+}
+
+static void
+eof_reader(struct coro_sched *sched, void *arg)
+{
+	struct eof_arg *ea = arg;
+	char buf[4096];
+	ssize_t n;
+
+	while ((n = coro_sched_read(sched, ea->p[0], buf, /**/
+		    sizeof(buf))) > 0) {
+		ea->read += (size_t)n;
+	}
+	ea->last_read = n;
+}
+
+ATF_TC_WITHOUT_HEAD(coro_sched__read_eof);
+ATF_TC_BODY(coro_sched__read_eof, tc)
+{
+	struct eof_arg ea = { .last_read = -2 };
+	struct coro_sched *sched;
+
+	ATF_REQUIRE(pipe2(ea.p, O_CLOEXEC | O_NONBLOCK) == 0);
+	ea.size = 3 * (size_t)pipe_size_default();
+
+	ATF_REQUIRE((sched = coro_sched_create(STACK_SIZE)) != NULL);
+	ATF_REQUIRE(coro_sched_spawn(sched, eof_writer, &ea) == 0);
+	ATF_REQUIRE(coro_sched_spawn(sched, eof_reader, &ea) == 0);
+
+	/*
+	 * The writer has to wait for the reader to make room, and the reader
+	 * sees EOF after everything once the writer closed its end.
+	 */
+
+	ATF_REQUIRE(coro_sched_run(sched) == 0);
+	ATF_REQUIRE(ea.written == (ssize_t)ea.size);
+	ATF_REQUIRE(ea.write_error == 0);
+	ATF_REQUIRE(ea.read == ea.size);
+	ATF_REQUIRE(ea.last_read == 0);
+
+	coro_sched_destroy(sched);
+	ATF_REQUIRE(close(ea.p[0]) == 0);
+}
+
+static void
+closing_reader(struct coro_sched *sched, void *arg)
+{
+	struct eof_arg *ea = arg;
+	char byte;
+
+	ea->last_read = coro_sched_read(sched, ea->p[0], &byte, 1);
+	close(ea->p[0]);
+}
+
+ATF_TC_WITHOUT_HEAD(coro_sched__write_eof);
+ATF_TC_BODY(coro_sched__write_eof, tc)
+{
+	struct eof_arg ea = { .last_read = -2 };
+	struct coro_sched *sched;
+
+	ATF_REQUIRE(signal(SIGPIPE, SIG_IGN) != SIG_ERR);
+	ATF_REQUIRE(pipe2(ea.p, O_CLOEXEC | O_NONBLOCK) == 0);
+	ea.size = 3 * (size_t)pipe_size_default();
+
+	ATF_REQUIRE((sched = coro_sched_create(STACK_SIZE)) != NULL);
+	ATF_REQUIRE(coro_sched_spawn(sched, eof_writer, &ea) == 0);
+	ATF_REQUIRE(coro_sched_spawn(sched, closing_reader, &ea) == 0);
+
+	/*
+	 * The writer waits with a full pipe when the reader goes away, and
+	 * then fails with EPIPE instead of waiting forever.
+	 */
+
+	ATF_REQUIRE(coro_sched_run(sched) == 0);
+	ATF_REQUIRE(ea.last_read == 1);
+	ATF_REQUIRE(ea.written == -1);
+	ATF_REQUIRE(ea.write_error == EPIPE);
+
+	coro_sched_destroy(sched);
+}
+
+struct spin_arg {
+	int p[2];
+	int got;
+	int yields;
+};
+
+static void
+spin_reader(struct coro_sched *sched, void *arg)
+{
+	struct spin_arg *sa = arg;
+	char byte;
+
+	if (coro_sched_read(sched, sa->p[0], &byte, 1) == 1) {
+		sa->got = 1;
+	}
+}
+
+static void
+spin_writer(struct coro_sched *sched, void *arg)
+{
+	struct spin_arg *sa = arg;
+
+	(void)sched;
+	(void)write(sa->p[1], "x", 1);
+}
+
+static void
+spin_yielder(struct coro_sched *sched, void *arg)
+{
+	struct spin_arg *sa = arg;
+
+	while (!sa->got && sa->yields < 1000) {
+		++sa->yields;
+		coro_sched_yield(sched);
+	}
+}
+
+ATF_TC_WITHOUT_HEAD(coro_sched__yield_vs_wait);
+ATF_TC_BODY(coro_sched__yield_vs_wait, tc)
+{
+	struct spin_arg sa = { .got = 0 };
+	struct coro_sched *sched;
+
+	ATF_REQUIRE(pipe2(sa.p, O_CLOEXEC | O_NONBLOCK) == 0);
+
+	ATF_REQUIRE((sched = coro_sched_create(STACK_SIZE)) != NULL);
+	ATF_REQUIRE(coro_sched_spawn(sched, spin_reader, &sa) == 0);
+	ATF_REQUIRE(coro_sched_spawn(sched, spin_writer, &sa) == 0);
+	ATF_REQUIRE(coro_sched_spawn(sched, spin_yielder, &sa) == 0);
+
+	/*
+	 * The reader parks on the empty pipe before the writer fills it. A
+	 * task yielding until the reader got its byte must not keep the
+	 * scheduler from submitting the registration and harvesting the
+	 * event.
+	 */
+
+	ATF_REQUIRE(coro_sched_run(sched) == 0);
+	ATF_REQUIRE(sa.got == 1);
+	ATF_REQUIRE(sa.yields == 2);
+
+	coro_sched_destroy(sched);
+	ATF_REQUIRE(close(sa.p[0]) == 0);
+	ATF_REQUIRE(close(sa.p[1]) == 0);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, coro_sched__yield_order);
+	ATF_TP_ADD_TC(tp, coro_sched__spawn_from_task);
+	ATF_TP_ADD_TC(tp, coro_sched__wait_error);
+	ATF_TP_ADD_TC(tp, coro_sched__read_eof);
+	ATF_TP_ADD_TC(tp, coro_sched__write_eof);
+	ATF_TP_ADD_TC(tp, coro_sched__yield_vs_wait);
+
+	return atf_no_error();
+}
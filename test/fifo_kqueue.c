@@ -14,6 +14,8 @@
 
 #include <atf-c.h>
 
+#include "pipe_util.h"
+
 ATF_TC_WITHOUT_HEAD(fifo_kqueue__writes);
 ATF_TC_BODY(fifo_kqueue__writes, tc)
 {
@@ -43,33 +45,26 @@ ATF_TC_BODY(fifo_kqueue__writes, tc)
 	ATF_REQUIRE(kev[0].filter == EVFILT_WRITE);
 	ATF_REQUIRE(kev[0].flags == EV_CLEAR);
 	ATF_REQUIRE(kev[0].fflags == 0);
-	ATF_REQUIRE(kev[0].data == 16384);
+	ATF_REQUIRE(kev[0].data == pipe_util_size(p[1]));
 	ATF_REQUIRE(kev[0].udata == 0);
 
 	/* Filling up the pipe should make the EVFILT_WRITE disappear. */
 
-	char c = 0;
-	ssize_t r;
-	while ((r = write(p[1], &c, 1)) == 1) {
-	}
-	ATF_REQUIRE(r < 0);
-	ATF_REQUIRE(errno == EAGAIN || errno == EWOULDBLOCK);
+	ATF_REQUIRE(pipe_util_fill(p[1]) > 0);
 
 	ATF_REQUIRE(kevent(kq, NULL, 0, kev, nitems(kev),
 			&(struct timespec) { 0, 0 }) == 0);
 
 	/* Reading (PIPE_BUF - 1) bytes will not trigger a EVFILT_WRITE yet. */
 
-	for (int i = 0; i < PIPE_BUF - 1; ++i) {
-		ATF_REQUIRE(read(p[0], &c, 1) == 1);
-	}
+	ATF_REQUIRE(pipe_util_read_exact(p[0], PIPE_BUF - 1) == 0);
 
 	ATF_REQUIRE(kevent(kq, NULL, 0, kev, nitems(kev),
 			&(struct timespec) { 0, 0 }) == 0);
 
 	/* Reading one additional byte triggers the EVFILT_WRITE. */
 
-	ATF_REQUIRE(read(p[0], &c, 1) == 1);
+	ATF_REQUIRE(pipe_util_read_exact(p[0], 1) == 0);
 
 	ATF_REQUIRE(kevent(kq, NULL, 0, kev, nitems(kev),
 			&(struct timespec) { 0, 0 }) == 1);
@@ -85,7 +80,7 @@ ATF_TC_BODY(fifo_kqueue__writes, tc)
 	 * 'data' field.
 	 */
 
-	ATF_REQUIRE(read(p[0], &c, 1) == 1);
+	ATF_REQUIRE(pipe_util_read_exact(p[0], 1) == 0);
 
 	ATF_REQUIRE(kevent(kq, NULL, 0, kev, nitems(kev),
 			&(struct timespec) { 0, 0 }) == 1);
@@ -150,16 +145,9 @@ ATF_TC_BODY(fifo_kqueue__connecting_reader, tc)
 	 * read end leads to a EVFILT_WRITE with EV_EOF set.
 	 */
 
-	char c = 0;
-	ssize_t r;
-	while ((r = write(p[1], &c, 1)) == 1) {
-	}
-	ATF_REQUIRE(r < 0);
-	ATF_REQUIRE(errno == EAGAIN || errno == EWOULDBLOCK);
+	ATF_REQUIRE(pipe_util_fill(p[1]) > 0);
 
-	for (int i = 0; i < PIPE_BUF + 1; ++i) {
-		ATF_REQUIRE(read(p[0], &c, 1) == 1);
-	}
+	ATF_REQUIRE(pipe_util_read_exact(p[0], PIPE_BUF + 1) == 0);
 
 	ATF_REQUIRE(close(p[0]) == 0);
 
@@ -174,7 +162,8 @@ ATF_TC_BODY(fifo_kqueue__connecting_reader, tc)
 	ATF_REQUIRE((p[0] = open("testfifo",
 			 O_RDONLY | O_CLOEXEC | O_NONBLOCK)) >= 0);
 
-	r = kevent(kq, NULL, 0, kev, nitems(kev), &(struct timespec) { 1, 0 });
+	int r = kevent(kq, NULL, 0, kev, nitems(kev),
+			&(struct timespec) { 1, 0 });
 	ATF_REQUIRE(r == 1);
 	ATF_REQUIRE(kev[0].ident == (uintptr_t)p[1]);
 	ATF_REQUIRE(kev[0].filter == EVFILT_WRITE);
@@ -204,16 +193,10 @@ ATF_TC_BODY(fifo_kqueue__reads, tc)
 
 	/* Check that EVFILT_READ behaves sensibly on a FIFO reader. */
 
-	char c = 0;
-	ssize_t r;
-	while ((r = write(p[1], &c, 1)) == 1) {
-	}
-	ATF_REQUIRE(r < 0);
-	ATF_REQUIRE(errno == EAGAIN || errno == EWOULDBLOCK);
+	ssize_t filled = pipe_util_fill(p[1]);
+	ATF_REQUIRE(filled > PIPE_BUF + 1);
 
-	for (int i = 0; i < PIPE_BUF + 1; ++i) {
-		ATF_REQUIRE(read(p[0], &c, 1) == 1);
-	}
+	ATF_REQUIRE(pipe_util_read_exact(p[0], PIPE_BUF + 1) == 0);
 
 	int kq = kqueue();
 	ATF_REQUIRE(kq >= 0);
@@ -229,13 +212,10 @@ ATF_TC_BODY(fifo_kqueue__reads, tc)
 	ATF_REQUIRE(kev[0].filter == EVFILT_READ);
 	ATF_REQUIRE(kev[0].flags == EV_CLEAR);
 	ATF_REQUIRE(kev[0].fflags == 0);
-	ATF_REQUIRE(kev[0].data == 65023);
+	ATF_REQUIRE(kev[0].data == filled - (PIPE_BUF + 1));
 	ATF_REQUIRE(kev[0].udata == 0);
 
-	while ((r = read(p[0], &c, 1)) == 1) {
-	}
-	ATF_REQUIRE(r < 0);
-	ATF_REQUIRE(errno == EAGAIN || errno == EWOULDBLOCK);
+	ATF_REQUIRE(pipe_util_drain(p[0]) == filled - (PIPE_BUF + 1));
 
 	ATF_REQUIRE(kevent(kq, NULL, 0, kev, nitems(kev),
 			&(struct timespec) { 0, 0 }) == 0);
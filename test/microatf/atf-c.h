@@ -2,8 +2,13 @@
 #define MICROATF_ATF_C_H_
 
 #include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -36,7 +41,8 @@ enum microatf_error_code {
 	MICROATF_ERROR_ARGUMENT_PARSING,
 	MICROATF_ERROR_NO_MATCHING_TEST_CASE,
 	MICROATF_ERROR_RESULT_FILE,
-	MICROATF_ERROR_TOO_MANY_VARIABLES,
+	MICROATF_ERROR_NO_MEMORY,
+	MICROATF_ERROR_BATCH_FAILED,
 };
 
 enum microatf_expect_type {
@@ -50,57 +56,168 @@ enum microatf_expect_type {
 
 /**/
 
+/*
+ * Key/value store used for test case metadata and configuration variables.
+ * Entries are kept in insertion order (so "ident" is listed first) and
+ * found through an open addressing index with linear probing. The index
+ * stores positions plus one, so a zero slot is empty.
+ */
+typedef struct {
+	char const **keys;
+	char const **values;
+	size_t size;
+	size_t capacity;
+	size_t *index;
+	size_t index_capacity;
+} microatf_vars_t;
+
+static inline size_t
+microatf_vars_hash(char const *key)
+{
+	size_t hash = (size_t)14695981039346656037ULL;
+
+	for (; *key; ++key) {
+		hash ^= (unsigned char)*key;
+		hash *= (size_t)1099511628211ULL;
+	}
+
+	return hash;
+}
+
+static inline size_t *
+microatf_vars_slot(microatf_vars_t const *vars, char const *key)
+{
+	size_t mask = vars->index_capacity - 1;
+	size_t i = microatf_vars_hash(key) & mask;
+
+	while (vars->index[i] != 0 &&
+	    strcmp(vars->keys[vars->index[i] - 1], key) != 0) {
+		i = (i + 1) & mask;
+	}
+
+	return &vars->index[i];
+}
+
+static inline char const *
+microatf_vars_get(microatf_vars_t const *vars, char const *key)
+{
+	size_t const *slot;
+
+	if (vars->size == 0) {
+		return NULL;
+	}
+
+	slot = microatf_vars_slot(vars, key);
+	return *slot != 0 ? vars->values[*slot - 1] : NULL;
+}
+
+static inline atf_error_t
+microatf_vars_set(microatf_vars_t *vars, char const *key, char const *value)
+{
+	size_t *slot;
+
+	/* Keep the load factor of the index at or below one half. */
+	if ((vars->size + 1) * 2 > vars->index_capacity) {
+		size_t index_capacity = vars->index_capacity
+		    ? vars->index_capacity * 2
+		    : 16;
+		size_t *index = calloc(index_capacity, sizeof(size_t));
+		if (!index) {
+			return MICROATF_ERROR_NO_MEMORY;
+		}
+
+		free(vars->index);
+		vars->index = index;
+		vars->index_capacity = index_capacity;
+
+		for (size_t i = 0; i < vars->size; ++i) {
+			*microatf_vars_slot(vars, vars->keys[i]) = i + 1;
+		}
+	}
+
+	slot = microatf_vars_slot(vars, key);
+	if (*slot != 0) {
+		vars->values[*slot - 1] = value;
+		return MICROATF_SUCCESS;
+	}
+
+	if (vars->size == vars->capacity) {
+		size_t capacity = vars->capacity ? vars->capacity * 2 : 8;
+		char const **keys = realloc(vars->keys,
+		    capacity * sizeof(char const *));
+		if (!keys) {
+			return MICROATF_ERROR_NO_MEMORY;
+		}
+		vars->keys = keys;
+
+		char const **values = realloc(vars->values,
+		    capacity * sizeof(char const *));
+		if (!values) {
+			return MICROATF_ERROR_NO_MEMORY;
+		}
+		vars->values = values;
+
+		vars->capacity = capacity;
+	}
+
+	vars->keys[vars->size] = key;
+	vars->values[vars->size] = value;
+	++vars->size;
+	*slot = vars->size;
+
+	return MICROATF_SUCCESS;
+}
+
+/**/
+
 struct atf_tc_s;
 typedef struct atf_tc_s atf_tc_t;
 struct atf_tc_s {
 	char const *name;
 	void (*head)(atf_tc_t *);
 	void (*body)(atf_tc_t const *);
-	char const *variables_key[128];
-	char const *variables_value[128];
-	size_t variables_size;
-	char const *config_variables_key[128];
-	char const *config_variables_value[128];
-	size_t config_variables_size;
+	microatf_vars_t variables;
+	microatf_vars_t config_variables;
 	STAILQ_ENTRY(atf_tc_s) entries;
 };
 
 static inline atf_error_t
 atf_tc_set_md_var(atf_tc_t *tc, char const *key, char const *value, ...)
 {
-	size_t key_length = strlen(key);
-
-	for (size_t i = 0; i < tc->variables_size; ++i) {
-		if (strncmp(tc->variables_key[i], key, key_length) == 0) {
-			tc->variables_value[i] = value;
-			return MICROATF_SUCCESS;
-		}
-	}
-
-	if (tc->variables_size == 128) {
-		return MICROATF_ERROR_TOO_MANY_VARIABLES;
-	}
+	return microatf_vars_set(&tc->variables, key, value);
+}
 
-	tc->variables_key[tc->variables_size] = key;
-	tc->variables_value[tc->variables_size] = value;
+static inline const char *
+atf_tc_get_md_var(atf_tc_t const *tc, const char *key)
+{
+	return microatf_vars_get(&tc->variables, key);
+}
 
-	++tc->variables_size;
+static inline bool
+atf_tc_has_md_var(atf_tc_t const *tc, const char *key)
+{
+	return microatf_vars_get(&tc->variables, key) != NULL;
+}
 
-	return MICROATF_SUCCESS;
+static inline const char *
+atf_tc_get_config_var(atf_tc_t const *tc, const char *key)
+{
+	return microatf_vars_get(&tc->config_variables, key);
 }
 
 static inline const char *
-atf_tc_get_md_var(atf_tc_t const *tc, const char *key)
+atf_tc_get_config_var_wd(atf_tc_t const *tc, const char *key,
+    const char *defval)
 {
-	size_t key_length = strlen(key);
+	char const *value = microatf_vars_get(&tc->config_variables, key);
 
-	for (size_t i = 0; i < tc->variables_size; ++i) {
-		if (strncmp(tc->variables_key[i], key, key_length) == 0) {
-			return tc->variables_value[i];
-		}
-	}
+	return value ? value : defval;
+}
 
-	return NULL;
+static inline bool
+atf_tc_has_config_var(atf_tc_t const *tc, const char *key)
+{
+	return microatf_vars_get(&tc->config_variables, key) != NULL;
 }
 
 /**/
@@ -468,7 +585,9 @@ atf_tc_skip(const char *reason, ...)
 	do {                                                                  \
 		atf_tc_t *tst = &microatf_tc_##tc;                            \
 		char const *ident = tst->name;                                \
-		atf_tc_set_md_var(tst, "ident", ident);                       \
+		if (atf_tc_set_md_var(tst, "ident", ident) != 0) {            \
+			abort();                                              \
+		}                                                             \
 		if (tst->head != NULL) {                                      \
 			tst->head(tst);                                       \
 		}                                                             \
@@ -478,6 +597,279 @@ atf_tc_skip(const char *reason, ...)
 		STAILQ_INSERT_TAIL(&tp->tcs, tst, entries);                   \
 	} while (0)
 
+/*
+ * Runs a single test case in the current process. Only returns if the test
+ * case could not be started.
+ */
+static inline atf_error_t
+microatf_tc_run(atf_tc_t *tc, char const *result_file_path,
+    microatf_vars_t const *config_variables)
+{
+	bool do_close_result_file = false;
+	FILE *result_file;
+
+	if (!result_file_path) {
+		result_file_path = "/dev/stdout";
+	}
+
+	if (strcmp(result_file_path, "/dev/stdout") == 0) {
+		result_file = stdout;
+	} else if (strcmp(result_file_path, "/dev/stderr") == 0) {
+		result_file = stderr;
+	} else {
+		do_close_result_file = true;
+
+		result_file = fopen(result_file_path, "w");
+		if (!result_file) {
+			return MICROATF_ERROR_RESULT_FILE;
+		}
+	}
+
+	/* Run the test case. */
+
+	microatf_context = (microatf_context_t){
+	    .result_file_path = result_file_path,
+	    .result_file = result_file,
+	    .do_close_result_file = do_close_result_file,
+	    .test_case = tc,
+	};
+
+	tc->config_variables = *config_variables;
+
+	tc->body(tc);
+
+	/**/
+
+	microatf_context_validate_expect(&microatf_context);
+
+	if (microatf_context.fail_count > 0) {
+		microatf_context_write_result(&microatf_context, "failed", -1,
+		    "Some checks failed");
+		microatf_context_exit(&microatf_context, EXIT_FAILURE);
+	} else if (microatf_context.expect_fail_count > 0) {
+		microatf_context_write_result(&microatf_context,
+		    "expected_failure", -1, "Some checks failed as expected");
+		microatf_context_exit(&microatf_context, EXIT_SUCCESS);
+	} else {
+		microatf_context_pass(&microatf_context);
+	}
+
+	return MICROATF_SUCCESS;
+}
+
+/**/
+
+static inline void
+microatf_remove_tree_at(int dirfd, char const *path)
+{
+	int fd;
+	DIR *dir;
+	struct dirent *entry;
+
+	fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd < 0) {
+		(void)unlinkat(dirfd, path, 0);
+		return;
+	}
+
+	dir = fdopendir(fd);
+	if (!dir) {
+		(void)close(fd);
+		return;
+	}
+	while ((entry = readdir(dir))) {
+		if (strcmp(entry->d_name, ".") == 0 ||
+		    strcmp(entry->d_name, "..") == 0) {
+			continue;
+		}
+		if (unlinkat(fd, entry->d_name, 0) < 0) {
+			microatf_remove_tree_at(fd, entry->d_name);
+		}
+	}
+	(void)closedir(dir);
+
+	(void)unlinkat(dirfd, path, AT_REMOVEDIR);
+}
+
+/*
+ * Copies the stderr file of a test case to our stderr and stores its last
+ * non-empty line, without the newline, in 'last'.
+ */
+static inline void
+microatf_forward_stderr(char const *path, char *last, size_t last_size)
+{
+	FILE *f = fopen(path, "r");
+	char line[1024];
+
+	last[0] = '\0';
+	while (f && fgets(line, sizeof(line), f)) {
+		fputs(line, stderr);
+		line[strcspn(line, "\n")] = '\0';
+		if (line[0] != '\0') {
+			(void)snprintf(last, last_size, "%s", line);
+		}
+	}
+	if (f) {
+		fclose(f);
+	}
+}
+
+/*
+ * Same rules ATFRunTest.cmake uses to judge a result line. An expected
+ * signal is only recognized for SIGHUP, reported as exit status 1 and a
+ * last stderr line of "SIGHUP".
+ */
+static inline bool
+microatf_batch_result_ok(char const *result, int status,
+    char const *stderr_last)
+{
+	bool exited_zero = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	int arg;
+
+	if (strcmp(result, "passed") == 0 ||
+	    strncmp(result, "skipped: ", 9) == 0 ||
+	    strncmp(result, "expected_failure: ", 18) == 0) {
+		return exited_zero;
+	}
+	if (strncmp(result, "expected_timeout: ", 18) == 0) {
+		return WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM;
+	}
+	if (strncmp(result, "expected_death: ", 16) == 0) {
+		return true;
+	}
+	if (sscanf(result, "expected_exit(%d)", &arg) == 1) {
+		return WIFEXITED(status) && WEXITSTATUS(status) == arg;
+	}
+	if (sscanf(result, "expected_signal(%d)", &arg) == 1) {
+		return WIFEXITED(status) && WEXITSTATUS(status) == 1 &&
+		    arg == SIGHUP && strcmp(stderr_last, "SIGHUP") == 0;
+	}
+
+	return false;
+}
+
+/*
+ * Batch mode: runs the given test cases one after another, each in a child
+ * forked from this already initialized process and inside its own work
+ * directory. One record per test case is written to the record file, in the
+ * same "key: value" format as the test case listing.
+ */
+static inline atf_error_t
+microatf_tp_run_batch(atf_tc_t **tcs, size_t tcs_size,
+    char const *record_file_path, microatf_vars_t const *config_variables)
+{
+	FILE *record_file = stdout;
+	char *cwd;
+	bool all_ok = true;
+
+	if (record_file_path && strcmp(record_file_path, "/dev/stdout") != 0) {
+		record_file = fopen(record_file_path, "w");
+		if (!record_file) {
+			return MICROATF_ERROR_RESULT_FILE;
+		}
+	}
+
+	cwd = getcwd(NULL, 0);
+	if (!cwd) {
+		return MICROATF_ERROR_RESULT_FILE;
+	}
+
+	for (size_t i = 0; i < tcs_size; ++i) {
+		atf_tc_t *tc = tcs[i];
+		char const *timeout_str = atf_tc_get_md_var(tc, "timeout");
+		unsigned int timeout = timeout_str
+		    ? (unsigned int)strtoul(timeout_str, NULL, 10)
+		    : 300;
+		size_t dir_size = strlen(cwd) + strlen(tc->name) + 16;
+		char *dir = malloc(dir_size);
+		char *result_path = malloc(dir_size + 8);
+		char *stderr_path = malloc(dir_size + 8);
+		char result[1024] = "";
+		char stderr_last[1024];
+		int status = 0;
+		pid_t pid;
+
+		if (!dir || !result_path || !stderr_path) {
+			abort();
+		}
+
+		(void)snprintf(dir, dir_size, "%s/%s.XXXXXX", cwd, tc->name);
+		if (!mkdtemp(dir)) {
+			abort();
+		}
+		(void)snprintf(result_path, dir_size + 8, "%s/result", dir);
+		(void)snprintf(stderr_path, dir_size + 8, "%s/stderr", dir);
+
+		fflush(stdout);
+		fflush(stderr);
+		fflush(record_file);
+
+		pid = fork();
+		if (pid < 0) {
+			abort();
+		}
+		if (pid == 0) {
+			int fd;
+
+			if (chdir(dir) < 0 || mkdir("work", 0700) < 0 ||
+			    chdir("work") < 0) {
+				_exit(127);
+			}
+			fd = open(stderr_path, O_WRONLY | O_CREAT | O_TRUNC,
+			    0600);
+			if (fd < 0 || dup2(fd, STDERR_FILENO) < 0) {
+				_exit(127);
+			}
+			(void)close(fd);
+			(void)alarm(timeout);
+			(void)microatf_tc_run(tc, result_path,
+			    config_variables);
+			_exit(127);
+		}
+
+		while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+		}
+
+		FILE *result_file = fopen(result_path, "r");
+		if (result_file) {
+			if (!fgets(result, sizeof(result), result_file)) {
+				result[0] = '\0';
+			}
+			fclose(result_file);
+		}
+		result[strcspn(result, "\n")] = '\0';
+
+		microatf_forward_stderr(stderr_path, stderr_last,
+		    sizeof(stderr_last));
+		if (!microatf_batch_result_ok(result, status, stderr_last)) {
+			all_ok = false;
+		}
+
+		fprintf(record_file, "%sident: %s\nresult: %s\n",
+		    i > 0 ? "\n" : "", tc->name, result);
+		if (WIFSIGNALED(status)) {
+			fprintf(record_file, "status: signaled(%d)\n",
+			    WTERMSIG(status));
+		} else {
+			fprintf(record_file, "status: exited(%d)\n",
+			    WEXITSTATUS(status));
+		}
+		fflush(record_file);
+
+		microatf_remove_tree_at(AT_FDCWD, dir);
+		free(stderr_path);
+		free(result_path);
+		free(dir);
+	}
+
+	free(cwd);
+	if (record_file != stdout) {
+		fclose(record_file);
+	}
+
+	return all_ok ? MICROATF_SUCCESS : MICROATF_ERROR_BATCH_FAILED;
+}
+
 static inline int
 microatf_tp_main(int argc, char **argv,
     atf_error_t (*add_tcs_hook)(atf_tp_t *))
@@ -485,15 +877,17 @@ microatf_tp_main(int argc, char **argv,
 	atf_error_t ec;
 
 	bool list_tests = false;
-	char const *test_case_name = NULL;
+	bool run_all = false;
 	char const *result_file_path = NULL;
 	char const *srcdir_path = NULL;
-	char const *config_variables[128];
-	size_t config_variables_size = 0;
+	microatf_vars_t config_variables = {0};
 
 	int ch;
-	while ((ch = getopt(argc, argv, "lr:s:v:")) != -1) {
+	while ((ch = getopt(argc, argv, "alr:s:v:")) != -1) {
 		switch (ch) {
+		case 'a':
+			run_all = true;
+			break;
 		case 'l':
 			list_tests = true;
 			break;
@@ -503,14 +897,19 @@ microatf_tp_main(int argc, char **argv,
 		case 's':
 			srcdir_path = optarg;
 			break;
-		case 'v':
-			if (config_variables_size == 128) {
-				ec = MICROATF_ERROR_TOO_MANY_VARIABLES;
+		case 'v': {
+			char *value = strchr(optarg, '=');
+			if (!value) {
+				ec = MICROATF_ERROR_ARGUMENT_PARSING;
+				goto out;
+			}
+			*value++ = '\0';
+			ec = microatf_vars_set(&config_variables, optarg, value);
+			if (ec) {
 				goto out;
 			}
-			config_variables[config_variables_size] = optarg;
-			++config_variables_size;
 			break;
+		}
 		case '?':
 		default:
 			ec = MICROATF_ERROR_ARGUMENT_PARSING;
@@ -520,17 +919,16 @@ microatf_tp_main(int argc, char **argv,
 	argc -= optind;
 	argv += optind;
 
-	if (list_tests) {
-		if (argc != 0) {
+	if (list_tests || run_all) {
+		if (argc != 0 || (list_tests && run_all)) {
 			ec = MICROATF_ERROR_ARGUMENT_PARSING;
 			goto out;
 		}
 	} else {
-		if (argc != 1) {
+		if (argc < 1) {
 			ec = MICROATF_ERROR_ARGUMENT_PARSING;
 			goto out;
 		}
-		test_case_name = argv[0];
 	}
 
 	atf_tp_t tp;
@@ -555,98 +953,67 @@ microatf_tp_main(int argc, char **argv,
 			}
 			print_newline = true;
 
-			for (size_t i = 0; i < tc->variables_size; ++i) {
-				char *key_end =
-				    strchr(tc->variables_key[i], '=');
-				ptrdiff_t key_length = key_end
-				    ? (key_end - tc->variables_key[i])
-				    : (ptrdiff_t)strlen(tc->variables_key[i]);
-				printf("%.*s: %s\n", (int)key_length,
-				    tc->variables_key[i],
-				    tc->variables_value[i]);
+			for (size_t i = 0; i < tc->variables.size; ++i) {
+				printf("%s: %s\n", tc->variables.keys[i],
+				    tc->variables.values[i]);
 			}
 		}
 
 		return 0;
 	}
 
-	atf_tc_t *matching_tc = NULL;
-
+	size_t tcs_size = 0;
 	atf_tc_t *tc;
 	STAILQ_FOREACH(tc, &tp.tcs, entries)
 	{
-		if (strcmp(tc->name, test_case_name) == 0) {
-			matching_tc = tc;
-			break;
-		}
+		++tcs_size;
 	}
 
-	if (!matching_tc) {
-		ec = MICROATF_ERROR_NO_MATCHING_TEST_CASE;
-		goto out;
+	atf_tc_t **tcs = calloc(tcs_size + (size_t)argc, sizeof(atf_tc_t *));
+	if (!tcs) {
+		abort();
 	}
 
-	bool do_close_result_file = false;
-	FILE *result_file;
-
-	if (!result_file_path) {
-		result_file_path = "/dev/stdout";
-	}
-
-	if (strcmp(result_file_path, "/dev/stdout") == 0) {
-		result_file = stdout;
-	} else if (strcmp(result_file_path, "/dev/stderr") == 0) {
-		result_file = stderr;
-	} else {
-		do_close_result_file = true;
-
-		result_file = fopen(result_file_path, "w");
-		if (!result_file) {
-			ec = MICROATF_ERROR_RESULT_FILE;
-			goto out;
+	if (run_all) {
+		tcs_size = 0;
+		STAILQ_FOREACH(tc, &tp.tcs, entries)
+		{
+			tcs[tcs_size++] = tc;
 		}
-	}
-
-	/* Run the test case. */
+	} else {
+		tcs_size = 0;
+		for (int i = 0; i < argc; ++i) {
+			atf_tc_t *matching_tc = NULL;
+
+			STAILQ_FOREACH(tc, &tp.tcs, entries)
+			{
+				if (strcmp(tc->name, argv[i]) == 0) {
+					matching_tc = tc;
+					break;
+				}
+			}
 
-	microatf_context = (microatf_context_t){
-	    .result_file_path = result_file_path,
-	    .result_file = result_file,
-	    .do_close_result_file = do_close_result_file,
-	    .test_case = matching_tc,
-	};
+			if (!matching_tc) {
+				free(tcs);
+				ec = MICROATF_ERROR_NO_MATCHING_TEST_CASE;
+				goto out;
+			}
 
-	for (size_t i = 0; i < config_variables_size; ++i) {
-		matching_tc->config_variables_key[i] = config_variables[i];
-		matching_tc->config_variables_value[i] =
-		    strchr(config_variables[i], '=');
-		if (!matching_tc->config_variables_value[i]) {
-			ec = MICROATF_ERROR_ARGUMENT_PARSING;
-			goto out;
+			tcs[tcs_size++] = matching_tc;
 		}
-		++matching_tc->config_variables_value[i];
 	}
-	matching_tc->config_variables_size = config_variables_size;
 
-	matching_tc->body(matching_tc);
-
-	/**/
-
-	microatf_context_validate_expect(&microatf_context);
-
-	if (microatf_context.fail_count > 0) {
-		microatf_context_write_result(&microatf_context, "failed", -1,
-		    "Some checks failed");
-		microatf_context_exit(&microatf_context, EXIT_FAILURE);
-	} else if (microatf_context.expect_fail_count > 0) {
-		microatf_context_write_result(&microatf_context,
-		    "expected_failure", -1, "Some checks failed as expected");
-		microatf_context_exit(&microatf_context, EXIT_SUCCESS);
+	if (run_all || tcs_size > 1) {
+		ec = microatf_tp_run_batch(tcs, tcs_size,
+		    result_file_path, &config_variables);
 	} else {
-		microatf_context_pass(&microatf_context);
+		ec = microatf_tc_run(tcs[0], result_file_path,
+		    &config_variables);
 	}
+	free(tcs);
 
 out:
+	(void)srcdir_path;
 	return ec ? 1 : 0;
 }
 
@@ -0,0 +1,514 @@
+/*
+ * atf-run: run all test cases of one or more microatf test programs in
+ * parallel, each in its own work directory, and report the results.
+ *
+ * This does the same as ATFRunTest.cmake, but from a single process that
+ * forks the test cases directly instead of spawning several cmake
+ * processes per test case.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <err.h>
+
+#define ATF_RUN_DEFAULT_TIMEOUT 300
+
+enum atf_run_status {
+	ATF_RUN_PASSED,
+	ATF_RUN_FAILED,
+	ATF_RUN_SKIPPED,
+};
+
+struct atf_run_job {
+	char const *program;
+	char *name;
+	int timeout;
+	char *dir;
+	pid_t pid;
+	uint64_t deadline;
+	bool timed_out;
+};
+
+static struct atf_run_job *jobs;
+static size_t jobs_size;
+static size_t jobs_capacity;
+
+static uint64_t
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static char *
+xasprintf(char const *fmt, ...) __attribute__((__format__(printf, 1, 2)));
+
+static char *
+xasprintf(char const *fmt, ...)
+{
+	va_list args;
+	char *str;
+	int len;
+
+	va_start(args, fmt);
+	len = vsnprintf(NULL, 0, fmt, args);
+	va_end(args);
+	if (len < 0 || !(str = malloc((size_t)len + 1))) {
+		err(1, "xasprintf");
+	}
+
+	va_start(args, fmt);
+	(void)vsnprintf(str, (size_t)len + 1, fmt, args);
+	va_end(args);
+
+	return str;
+}
+
+static void
+add_job(char const *program, char const *name, int timeout)
+{
+	if (jobs_size == jobs_capacity) {
+		jobs_capacity = jobs_capacity ? 2 * jobs_capacity : 32;
+		jobs = realloc(jobs,
+		    jobs_capacity * sizeof(struct atf_run_job));
+		if (!jobs) {
+			err(1, "realloc");
+		}
+	}
+
+	jobs[jobs_size++] = (struct atf_run_job) {
+		.program = program,
+		.name = strdup(name),
+		.timeout = timeout,
+		.pid = -1,
+	};
+}
+
+/* Runs 'program -l' and adds one job per listed test case. */
+static void
+list_test_cases(char const *program)
+{
+	int p[2];
+	pid_t pid;
+	FILE *f;
+	char *line = NULL;
+	size_t line_capacity = 0;
+	ssize_t line_length;
+	char *current = NULL;
+	int timeout = ATF_RUN_DEFAULT_TIMEOUT;
+	int status;
+
+	if (pipe(p) < 0) {
+		err(1, "pipe");
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		(void)dup2(p[1], STDOUT_FILENO);
+		(void)close(p[0]);
+		(void)close(p[1]);
+		execl(program, program, "-l", (char *)NULL);
+		_exit(127);
+	}
+	(void)close(p[1]);
+
+	f = fdopen(p[0], "r");
+	if (!f) {
+		err(1, "fdopen");
+	}
+
+	while ((line_length = getline(&line, &line_capacity, f)) >= 0) {
+		if (line_length > 0 && line[line_length - 1] == '\n') {
+			line[line_length - 1] = '\0';
+		}
+
+		if (strncmp(line, "ident: ", 7) == 0) {
+			if (current) {
+				add_job(program, current, timeout);
+				free(current);
+			}
+			current = strdup(line + 7);
+			timeout = ATF_RUN_DEFAULT_TIMEOUT;
+		} else if (strncmp(line, "timeout: ", 9) == 0) {
+			timeout = atoi(line + 9);
+		}
+	}
+	if (current) {
+		add_job(program, current, timeout);
+		free(current);
+	}
+
+	free(line);
+	(void)fclose(f);
+
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0) {
+		errx(1, "%s: listing test cases failed", program);
+	}
+}
+
+static void
+remove_tree_at(int dirfd, char const *path)
+{
+	int fd;
+	DIR *dir;
+	struct dirent *entry;
+
+	fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd < 0) {
+		(void)unlinkat(dirfd, path, 0);
+		return;
+	}
+
+	dir = fdopendir(fd);
+	if (!dir) {
+		(void)close(fd);
+		return;
+	}
+	while ((entry = readdir(dir))) {
+		if (strcmp(entry->d_name, ".") == 0 ||
+		    strcmp(entry->d_name, "..") == 0) {
+			continue;
+		}
+		if (unlinkat(fd, entry->d_name, 0) < 0) {
+			remove_tree_at(fd, entry->d_name);
+		}
+	}
+	(void)closedir(dir);
+
+	(void)unlinkat(dirfd, path, AT_REMOVEDIR);
+}
+
+static void
+start_job(struct atf_run_job *job, char const *base_dir, size_t index)
+{
+	char *work_dir;
+
+	job->dir = xasprintf("%s/%zu", base_dir, index);
+	work_dir = xasprintf("%s/work", job->dir);
+	if (mkdir(job->dir, 0700) < 0 || mkdir(work_dir, 0700) < 0) {
+		err(1, "mkdir");
+	}
+
+	job->pid = fork();
+	if (job->pid < 0) {
+		err(1, "fork");
+	}
+	if (job->pid == 0) {
+		char *result_path = xasprintf("%s/result", job->dir);
+		char *stderr_path = xasprintf("%s/stderr", job->dir);
+		char const *locale_vars[] = { "LANG", "LC_ALL", "LC_COLLATE",
+			"LC_CTYPE", "LC_MESSAGES", "LC_MONETARY", "LC_NUMERIC",
+			"LC_TIME" };
+		sigset_t sigset;
+		int fd;
+
+		(void)setpgid(0, 0);
+
+		sigemptyset(&sigset);
+		(void)sigprocmask(SIG_SETMASK, &sigset, NULL);
+
+		fd = open(stderr_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (fd < 0 || chdir(work_dir) < 0) {
+			_exit(127);
+		}
+		(void)dup2(fd, STDERR_FILENO);
+		(void)close(fd);
+
+		for (size_t i = 0;
+		     i < sizeof(locale_vars) / sizeof(locale_vars[0]); ++i) {
+			(void)unsetenv(locale_vars[i]);
+		}
+		(void)setenv("HOME", work_dir, 1);
+		(void)setenv("TMPDIR", work_dir, 1);
+		(void)setenv("TZ", "UTC", 1);
+		(void)setenv("__RUNNING_INSIDE_ATF_RUN", "internal-yes-value",
+		    1);
+
+		execl(job->program, job->program, "-r", result_path, job->name,
+		    (char *)NULL);
+		_exit(127);
+	}
+
+	job->deadline = now_ms() + (uint64_t)job->timeout * 1000;
+	free(work_dir);
+}
+
+static char const *
+program_name(char const *program)
+{
+	char const *slash = strrchr(program, '/');
+
+	return slash ? slash + 1 : program;
+}
+
+static void
+print_stderr(struct atf_run_job const *job)
+{
+	char *stderr_path = xasprintf("%s/stderr", job->dir);
+	FILE *f = fopen(stderr_path, "r");
+	char *line = NULL;
+	size_t line_capacity = 0;
+
+	while (f && getline(&line, &line_capacity, f) >= 0) {
+		printf("    stderr: %s", line);
+	}
+
+	free(line);
+	if (f) {
+		(void)fclose(f);
+	}
+	free(stderr_path);
+}
+
+/*
+ * Stores the last non-empty line of the job's stderr, without the newline,
+ * in 'last'.
+ */
+static void
+last_stderr_line(struct atf_run_job const *job, char *last, size_t size)
+{
+	char *stderr_path = xasprintf("%s/stderr", job->dir);
+	FILE *f = fopen(stderr_path, "r");
+	char line[1024];
+
+	last[0] = '\0';
+	while (f && fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (line[0] != '\0') {
+			(void)snprintf(last, size, "%s", line);
+		}
+	}
+	if (f) {
+		(void)fclose(f);
+	}
+	free(stderr_path);
+}
+
+/*
+ * Interprets the result file of a finished job the same way
+ * ATFRunTest.cmake does. Like there, an expected signal is only recognized
+ * for SIGHUP, reported as exit status 1 and a last stderr line of
+ * "SIGHUP".
+ */
+static enum atf_run_status
+finish_job(struct atf_run_job *job, int status)
+{
+	char *result_path = xasprintf("%s/result", job->dir);
+	char result[1024] = "";
+	char const *reason = NULL;
+	enum atf_run_status run_status = ATF_RUN_FAILED;
+	bool exited_zero = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	FILE *f;
+	int arg;
+
+	f = fopen(result_path, "r");
+	if (f) {
+		if (!fgets(result, sizeof(result), f)) {
+			result[0] = '\0';
+		}
+		(void)fclose(f);
+	}
+	result[strcspn(result, "\n")] = '\0';
+
+	if (strcmp(result, "passed") == 0) {
+		run_status = exited_zero ? ATF_RUN_PASSED : ATF_RUN_FAILED;
+	} else if (strncmp(result, "failed: ", 8) == 0) {
+		reason = result + 8;
+	} else if (strncmp(result, "skipped: ", 9) == 0) {
+		run_status = exited_zero ? ATF_RUN_SKIPPED : ATF_RUN_FAILED;
+		reason = result + 9;
+	} else if (strncmp(result, "expected_timeout: ", 18) == 0) {
+		run_status = job->timed_out ? ATF_RUN_PASSED : ATF_RUN_FAILED;
+	} else if (strncmp(result, "expected_failure: ", 18) == 0) {
+		run_status = exited_zero ? ATF_RUN_PASSED : ATF_RUN_FAILED;
+	} else if (strncmp(result, "expected_death: ", 16) == 0) {
+		run_status = ATF_RUN_PASSED;
+	} else if (sscanf(result, "expected_exit(%d)", &arg) == 1) {
+		run_status = WIFEXITED(status) && WEXITSTATUS(status) == arg
+		    ? ATF_RUN_PASSED
+		    : ATF_RUN_FAILED;
+	} else if (sscanf(result, "expected_signal(%d)", &arg) == 1) {
+		char last[1024];
+
+		last_stderr_line(job, last, sizeof(last));
+		run_status = WIFEXITED(status) && WEXITSTATUS(status) == 1 &&
+			arg == SIGHUP && strcmp(last, "SIGHUP") == 0
+		    ? ATF_RUN_PASSED
+		    : ATF_RUN_FAILED;
+	} else if (job->timed_out) {
+		reason = "Test case timed out";
+	} else {
+		reason = "Unexpected result";
+	}
+
+	printf("%-8s %s.%s", /**/
+	    run_status == ATF_RUN_PASSED	  ? "passed"
+		: run_status == ATF_RUN_SKIPPED ? "skipped"
+						: "failed",
+	    program_name(job->program), job->name);
+	if (run_status != ATF_RUN_PASSED && reason) {
+		printf(": %s", reason);
+	}
+	printf("\n");
+	if (run_status == ATF_RUN_FAILED) {
+		printf("    result: \"%s\", status: %d\n", result, status);
+		print_stderr(job);
+	}
+
+	free(result_path);
+	remove_tree_at(AT_FDCWD, job->dir);
+	free(job->dir);
+	job->dir = NULL;
+	job->pid = -1;
+
+	return run_status;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: atf-run [-j jobs] [-w work_dir] test_program...\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	long max_running = sysconf(_SC_NPROCESSORS_ONLN);
+	char const *work_base = ".";
+	char *base_dir;
+	size_t next_job = 0;
+	size_t running = 0;
+	size_t counts[3] = { 0, 0, 0 };
+	sigset_t sigchld;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "j:w:")) != -1) {
+		switch (ch) {
+		case 'j':
+			max_running = atol(optarg);
+			break;
+		case 'w':
+			work_base = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc == 0) {
+		usage();
+	}
+	if (max_running < 1) {
+		max_running = 1;
+	}
+
+	/* Test cases run in their own work directory; use absolute paths. */
+	for (int i = 0; i < argc; ++i) {
+		char *program = realpath(argv[i], NULL);
+
+		if (!program) {
+			err(1, "%s", argv[i]);
+		}
+		list_test_cases(program);
+	}
+
+	if (!(work_base = realpath(work_base, NULL))) {
+		err(1, "realpath");
+	}
+	base_dir = xasprintf("%s/atf-run.XXXXXX", work_base);
+	if (!mkdtemp(base_dir)) {
+		err(1, "mkdtemp");
+	}
+
+	/*
+	 * SIGCHLD is blocked and waited for with sigtimedwait(), which
+	 * doubles as the timer for the test case timeouts.
+	 */
+	sigemptyset(&sigchld);
+	sigaddset(&sigchld, SIGCHLD);
+	(void)sigprocmask(SIG_BLOCK, &sigchld, NULL);
+
+	while (next_job < jobs_size || running > 0) {
+		uint64_t now;
+		uint64_t next_deadline = UINT64_MAX;
+		pid_t pid;
+		int status;
+
+		while (next_job < jobs_size && running < (size_t)max_running) {
+			start_job(&jobs[next_job], base_dir, next_job);
+			++next_job;
+			++running;
+		}
+
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			for (size_t i = 0; i < next_job; ++i) {
+				if (jobs[i].pid == pid) {
+					++counts[finish_job(&jobs[i], status)];
+					--running;
+					break;
+				}
+			}
+		}
+
+		now = now_ms();
+		for (size_t i = 0; i < next_job; ++i) {
+			if (jobs[i].pid < 0) {
+				continue;
+			}
+			if (!jobs[i].timed_out && jobs[i].deadline <= now) {
+				jobs[i].timed_out = true;
+				(void)kill(-jobs[i].pid, SIGKILL);
+			}
+			if (jobs[i].deadline < next_deadline) {
+				next_deadline = jobs[i].deadline;
+			}
+		}
+
+		if (running > 0 &&
+		    !(next_job < jobs_size && running < (size_t)max_running)) {
+			uint64_t wait_ms = next_deadline > now
+			    ? next_deadline - now
+			    : 1;
+			struct timespec ts = {
+				.tv_sec = (time_t)(wait_ms / 1000),
+				.tv_nsec = (long)(wait_ms % 1000) * 1000000,
+			};
+
+			(void)sigtimedwait(&sigchld, NULL, &ts);
+		}
+	}
+
+	remove_tree_at(AT_FDCWD, base_dir);
+	free(base_dir);
+
+	printf("%zu test cases: %zu passed, %zu failed, %zu skipped\n",
+	    jobs_size, counts[ATF_RUN_PASSED], counts[ATF_RUN_FAILED],
+	    counts[ATF_RUN_SKIPPED]);
+
+	return counts[ATF_RUN_FAILED] > 0 ? 1 : 0;
+}
@@ -14,6 +14,8 @@
 
 #include <atf-c.h>
 
+#include "pipe_util.h"
+
 ATF_TC_WITHOUT_HEAD(pipe_kqueue__write_end);
 ATF_TC_BODY(pipe_kqueue__write_end, tc)
 {
@@ -39,35 +41,29 @@ ATF_TC_BODY(pipe_kqueue__write_end, tc)
 	ATF_REQUIRE(kev[0].filter == EVFILT_WRITE);
 	ATF_REQUIRE(kev[0].flags == EV_CLEAR);
 	ATF_REQUIRE(kev[0].fflags == 0);
-	ATF_REQUIRE(kev[0].data == 16384);
+	ATF_REQUIRE(kev[0].data == pipe_util_size(p[1]));
 	ATF_REQUIRE(kev[0].udata == 0);
 
 	/* Filling up the pipe should make the EVFILT_WRITE disappear. */
 
-	char c = 0;
-	ssize_t r;
-	while ((r = write(p[1], &c, 1)) == 1) {
-	}
-	ATF_REQUIRE(r < 0);
-	ATF_REQUIRE(errno == EAGAIN || errno == EWOULDBLOCK);
+	ATF_REQUIRE(pipe_util_fill(p[1]) > 0);
 
 	ATF_REQUIRE(kevent(kq, NULL, 0, kev, nitems(kev),
 			&(struct timespec) { 0, 0 }) == 0);
 
 	/* Reading (PIPE_BUF - 1) bytes will not trigger a EVFILT_WRITE yet. */
 
-	for (int i = 0; i < PIPE_BUF - 1; ++i) {
-		ATF_REQUIRE(read(p[0], &c, 1) == 1);
-	}
+	ATF_REQUIRE(pipe_util_read_exact(p[0], PIPE_BUF - 1) == 0);
 
 	ATF_REQUIRE(kevent(kq, NULL, 0, kev, nitems(kev),
 			&(struct timespec) { 0, 0 }) == 0);
 
 	/* Reading one additional byte triggers the EVFILT_WRITE. */
 
-	ATF_REQUIRE(read(p[0], &c, 1) == 1);
+	ATF_REQUIRE(pipe_util_read_exact(p[0], 1) == 0);
 
-	r = kevent(kq, NULL, 0, kev, nitems(kev), &(struct timespec) { 0, 0 });
+	int r = kevent(kq, NULL, 0, kev, nitems(kev),
+			&(struct timespec) { 0, 0 });
 	ATF_REQUIRE(r == 1);
 	ATF_REQUIRE(kev[0].ident == (uintptr_t)p[1]);
 	ATF_REQUIRE(kev[0].filter == EVFILT_WRITE);
@@ -81,7 +77,7 @@ ATF_TC_BODY(pipe_kqueue__write_end, tc)
 	 * 'data' field.
 	 */
 
-	ATF_REQUIRE(read(p[0], &c, 1) == 1);
+	ATF_REQUIRE(pipe_util_read_exact(p[0], 1) == 0);
 
 	ATF_REQUIRE(kevent(kq, NULL, 0, kev, nitems(kev),
 			&(struct timespec) { 0, 0 }) == 1);
@@ -195,7 +191,7 @@ ATF_TC_BODY(pipe_kqueue__closed_read_end_register_before_close, tc)
 		ATF_REQUIRE(kev[0].flags ==
 		    (EV_EOF | EV_CLEAR | EV_ONESHOT | EV_RECEIPT));
 		ATF_REQUIRE(kev[0].fflags == 0);
-		ATF_REQUIRE(kev[0].data == 16384);
+		ATF_REQUIRE(kev[0].data == pipe_util_size(p[1]));
 		ATF_REQUIRE(kev[0].udata == 0);
 	}
 	{
@@ -220,12 +216,8 @@ ATF_TC_BODY(pipe_kqueue__closed_write_end, tc)
 	ATF_REQUIRE(p[0] >= 0);
 	ATF_REQUIRE(p[1] >= 0);
 
-	char c = 0;
-	ssize_t r;
-	while ((r = write(p[1], &c, 1)) == 1) {
-	}
-	ATF_REQUIRE(r < 0);
-	ATF_REQUIRE(errno == EAGAIN || errno == EWOULDBLOCK);
+	ssize_t filled = pipe_util_fill(p[1]);
+	ATF_REQUIRE(filled > 0);
 
 	ATF_REQUIRE(close(p[1]) == 0);
 
@@ -255,7 +247,7 @@ ATF_TC_BODY(pipe_kqueue__closed_write_end, tc)
 	ATF_REQUIRE(kev[0].filter == EVFILT_READ);
 	ATF_REQUIRE(kev[0].flags == (EV_EOF | EV_CLEAR | EV_RECEIPT));
 	ATF_REQUIRE(kev[0].fflags == 0);
-	ATF_REQUIRE(kev[0].data == 65536);
+	ATF_REQUIRE(kev[0].data == filled);
 	ATF_REQUIRE(kev[0].udata == 0);
 
 	ATF_REQUIRE(close(kq) == 0);
@@ -291,12 +283,8 @@ ATF_TC_BODY(pipe_kqueue__closed_write_end_register_before_close, tc)
 	ATF_REQUIRE((kev[1].flags & EV_ERROR) != 0);
 	ATF_REQUIRE(kev[1].data == 0);
 
-	char c = 0;
-	ssize_t r;
-	while ((r = write(p[1], &c, 1)) == 1) {
-	}
-	ATF_REQUIRE(r < 0);
-	ATF_REQUIRE(errno == EAGAIN || errno == EWOULDBLOCK);
+	ssize_t filled = pipe_util_fill(p[1]);
+	ATF_REQUIRE(filled > 0);
 
 	ATF_REQUIRE(close(p[1]) == 0);
 
@@ -317,7 +305,7 @@ ATF_TC_BODY(pipe_kqueue__closed_write_end_register_before_close, tc)
 		ATF_REQUIRE(kev[1].filter == EVFILT_READ);
 		ATF_REQUIRE(kev[1].flags == (EV_EOF | EV_CLEAR | EV_RECEIPT));
 		ATF_REQUIRE(kev[1].fflags == 0);
-		ATF_REQUIRE(kev[1].data == 65536);
+		ATF_REQUIRE(kev[1].data == filled);
 		ATF_REQUIRE(kev[1].udata == 0);
 	}
 
@@ -325,6 +313,48 @@ ATF_TC_BODY(pipe_kqueue__closed_write_end_register_before_close, tc)
 	ATF_REQUIRE(close(p[0]) == 0);
 }
 
+ATF_TC_WITHOUT_HEAD(pipe_kqueue__reused_descriptor);
+ATF_TC_BODY(pipe_kqueue__reused_descriptor, tc)
+{
+	int p[2] = { -1, -1 };
+	int q[2] = { -1, -1 };
+
+	ATF_REQUIRE(pipe2(p, O_CLOEXEC | O_NONBLOCK) == 0);
+
+	int kq = kqueue();
+	ATF_REQUIRE(kq >= 0);
+
+	struct kevent kev[32];
+	EV_SET(&kev[0], p[0], EVFILT_READ, EV_ADD, 0, 0, 0);
+
+	ATF_REQUIRE(kevent(kq, kev, 1, NULL, 0, NULL) == 0);
+
+	ATF_REQUIRE(write(p[1], "a", 1) == 1);
+
+	ATF_REQUIRE(kevent(kq, NULL, 0, kev, nitems(kev),
+			&(struct timespec) { 0, 0 }) == 1);
+	ATF_REQUIRE(kev[0].ident == (uintptr_t)p[0]);
+	ATF_REQUIRE(kev[0].data == 1);
+
+	/*
+	 * Closing the read end removes its knote. A new pipe that gets the
+	 * same descriptor number must not be reported through it.
+	 */
+
+	ATF_REQUIRE(close(p[0]) == 0);
+	ATF_REQUIRE(pipe2(q, O_CLOEXEC | O_NONBLOCK) == 0);
+	ATF_REQUIRE(q[0] == p[0]);
+	ATF_REQUIRE(write(q[1], "bc", 2) == 2);
+
+	ATF_REQUIRE(kevent(kq, NULL, 0, kev, nitems(kev),
+			&(struct timespec) { 0, 0 }) == 0);
+
+	ATF_REQUIRE(close(kq) == 0);
+	ATF_REQUIRE(close(p[1]) == 0);
+	ATF_REQUIRE(close(q[0]) == 0);
+	ATF_REQUIRE(close(q[1]) == 0);
+}
+
 ATF_TC_WITHOUT_HEAD(pipe_kqueue__evfilt_vnode);
 ATF_TC_BODY(pipe_kqueue__evfilt_vnode, tc)
 {
@@ -350,6 +380,82 @@ ATF_TC_BODY(pipe_kqueue__evfilt_vnode, tc)
 	ATF_REQUIRE(close(p[1]) == 0);
 }
 
+#ifdef NOTE_NODATA
+ATF_TC_WITHOUT_HEAD(pipe_kqueue__nodata);
+ATF_TC_BODY(pipe_kqueue__nodata, tc)
+{
+	int p[2] = { -1, -1 };
+
+	ATF_REQUIRE(pipe2(p, O_CLOEXEC | O_NONBLOCK) == 0);
+	ATF_REQUIRE(p[0] >= 0);
+	ATF_REQUIRE(p[1] >= 0);
+
+	int kq = kqueue();
+	ATF_REQUIRE(kq >= 0);
+
+	struct kevent kev[32];
+	EV_SET(&kev[0], p[0], EVFILT_READ, EV_ADD | EV_CLEAR, NOTE_NODATA, 0,
+	    0);
+
+	ATF_REQUIRE(kevent(kq, kev, 1, NULL, 0, NULL) == 0);
+
+	ATF_REQUIRE(kevent(kq, NULL, 0, kev, nitems(kev),
+			&(struct timespec) { 0, 0 }) == 0);
+
+	/* With NOTE_NODATA, 'data' is 0 instead of the number of bytes. */
+
+	ATF_REQUIRE(write(p[1], "abc", 3) == 3);
+
+	ATF_REQUIRE(kevent(kq, NULL, 0, kev, nitems(kev),
+			&(struct timespec) { 0, 0 }) == 1);
+	ATF_REQUIRE(kev[0].ident == (uintptr_t)p[0]);
+	ATF_REQUIRE(kev[0].filter == EVFILT_READ);
+	ATF_REQUIRE(kev[0].flags == EV_CLEAR);
+	ATF_REQUIRE(kev[0].fflags == 0);
+	ATF_REQUIRE(kev[0].data == 0);
+	ATF_REQUIRE(kev[0].udata == 0);
+
+	/* The EV_CLEAR knote does not fire again while nothing changes... */
+
+	ATF_REQUIRE(kevent(kq, NULL, 0, kev, nitems(kev),
+			&(struct timespec) { 0, 0 }) == 0);
+
+	/* ...but once the pipe became readable again after draining it. */
+
+	ATF_REQUIRE(pipe_util_read_exact(p[0], 3) == 0);
+
+	ATF_REQUIRE(kevent(kq, NULL, 0, kev, nitems(kev),
+			&(struct timespec) { 0, 0 }) == 0);
+
+	ATF_REQUIRE(write(p[1], "d", 1) == 1);
+
+	ATF_REQUIRE(kevent(kq, NULL, 0, kev, nitems(kev),
+			&(struct timespec) { 0, 0 }) == 1);
+	ATF_REQUIRE(kev[0].ident == (uintptr_t)p[0]);
+	ATF_REQUIRE(kev[0].flags == EV_CLEAR);
+	ATF_REQUIRE(kev[0].data == 0);
+
+	ATF_REQUIRE(kevent(kq, NULL, 0, kev, nitems(kev),
+			&(struct timespec) { 0, 0 }) == 0);
+
+	/* EV_EOF is still reported, also with 'data' being 0. */
+
+	ATF_REQUIRE(close(p[1]) == 0);
+
+	ATF_REQUIRE(kevent(kq, NULL, 0, kev, nitems(kev),
+			&(struct timespec) { 0, 0 }) == 1);
+	ATF_REQUIRE(kev[0].ident == (uintptr_t)p[0]);
+	ATF_REQUIRE(kev[0].filter == EVFILT_READ);
+	ATF_REQUIRE(kev[0].flags == (EV_EOF | EV_CLEAR));
+	ATF_REQUIRE(kev[0].fflags == 0);
+	ATF_REQUIRE(kev[0].data == 0);
+	ATF_REQUIRE(kev[0].udata == 0);
+
+	ATF_REQUIRE(close(kq) == 0);
+	ATF_REQUIRE(close(p[0]) == 0);
+}
+#endif
+
 ATF_TP_ADD_TCS(tp)
 {
 	ATF_TP_ADD_TC(tp, pipe_kqueue__write_end);
@@ -357,7 +463,11 @@ ATF_TP_ADD_TCS(tp)
 	ATF_TP_ADD_TC(tp, pipe_kqueue__closed_read_end_register_before_close);
 	ATF_TP_ADD_TC(tp, pipe_kqueue__closed_write_end);
 	ATF_TP_ADD_TC(tp, pipe_kqueue__closed_write_end_register_before_close);
+	ATF_TP_ADD_TC(tp, pipe_kqueue__reused_descriptor);
 	ATF_TP_ADD_TC(tp, pipe_kqueue__evfilt_vnode);
+#ifdef NOTE_NODATA
+	ATF_TP_ADD_TC(tp, pipe_kqueue__nodata);
+#endif
 
 	return atf_no_error();
 }
@@ -0,0 +1,164 @@
+#ifndef PIPE_UTIL_H_
+#define PIPE_UTIL_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+
+#include <unistd.h>
+
+/*
+ * Helpers to fill and drain non-blocking pipes and FIFOs in bulk. The
+ * kernel's pipe buffer state only depends on how many bytes are in it, so
+ * large reads and writes leave it exactly as the equivalent sequence of one
+ * byte read(2)/write(2) calls would, at a tiny fraction of the syscalls.
+ */
+
+/* <sys/param.h> only has it on the BSDs. */
+#ifndef nitems
+#define nitems(x) (sizeof((x)) / sizeof((x)[0]))
+#endif
+
+/*
+ * FreeBSD's PIPE_SIZE, the buffer a fresh pipe starts with. <sys/pipe.h>
+ * is not meant for userland.
+ */
+#define PIPE_UTIL_FREEBSD_PIPE_SIZE 16384
+
+#define PIPE_UTIL_CHUNK_SIZE (64 * 1024)
+#define PIPE_UTIL_IOV_COUNT 4
+
+static char pipe_util_buffer[PIPE_UTIL_CHUNK_SIZE];
+
+/*
+ * Returns the buffer size of the fresh pipe or FIFO behind 'fd', which is
+ * what EVFILT_WRITE should report for it. The size is taken from the kernel
+ * without going through kevent(2), so that tests do not check kevent(2)
+ * against itself.
+ */
+static inline long
+pipe_util_size(int fd)
+{
+#ifdef F_GETPIPE_SZ
+	return (fcntl(fd, F_GETPIPE_SZ));
+#else
+	(void)fd;
+	return (PIPE_UTIL_FREEBSD_PIPE_SIZE);
+#endif
+}
+
+/*
+ * Writes to 'fd' until it is full, i.e. until not even a single byte fits
+ * anymore. Writes of up to PIPE_BUF bytes are atomic and fail with EAGAIN if
+ * they do not fit completely, so the write size is halved down to one byte
+ * before giving up.
+ *
+ * Returns the number of bytes written, or -1 if write(2) failed with
+ * anything other than EAGAIN.
+ */
+static inline ssize_t
+pipe_util_fill(int fd)
+{
+	struct iovec iov[PIPE_UTIL_IOV_COUNT];
+	size_t size = PIPE_UTIL_IOV_COUNT * PIPE_UTIL_CHUNK_SIZE;
+	ssize_t filled = 0;
+	ssize_t r;
+
+	for (;;) {
+		size_t remaining = size;
+		int iovcnt = 0;
+
+		while (remaining > 0) {
+			size_t n = remaining < PIPE_UTIL_CHUNK_SIZE
+			    ? remaining
+			    : PIPE_UTIL_CHUNK_SIZE;
+			iov[iovcnt].iov_base = pipe_util_buffer;
+			iov[iovcnt].iov_len = n;
+			++iovcnt;
+			remaining -= n;
+		}
+
+		r = writev(fd, iov, iovcnt);
+		if (r < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				return (-1);
+			}
+			if (size == 1) {
+				return (filled);
+			}
+			size /= 2;
+			continue;
+		}
+		filled += r;
+	}
+}
+
+/*
+ * Reads exactly 'count' bytes from 'fd'. Returns 0 on success and -1 if
+ * read(2) failed or fewer than 'count' bytes were available.
+ */
+static inline int
+pipe_util_read_exact(int fd, size_t count)
+{
+	struct iovec iov[PIPE_UTIL_IOV_COUNT];
+	ssize_t r;
+
+	while (count > 0) {
+		size_t remaining = count;
+		int iovcnt = 0;
+
+		while (remaining > 0 && iovcnt < PIPE_UTIL_IOV_COUNT) {
+			size_t n = remaining < PIPE_UTIL_CHUNK_SIZE
+			    ? remaining
+			    : PIPE_UTIL_CHUNK_SIZE;
+			iov[iovcnt].iov_base = pipe_util_buffer;
+			iov[iovcnt].iov_len = n;
+			++iovcnt;
+			remaining -= n;
+		}
+
+		r = readv(fd, iov, iovcnt);
+		if (r <= 0) {
+			return (-1);
+		}
+		count -= (size_t)r;
+	}
+
+	return (0);
+}
+
+/*
+ * Reads from 'fd' until read(2) fails with EAGAIN. Returns the number of
+ * bytes read, or -1 on EOF or any other error.
+ */
+static inline ssize_t
+pipe_util_drain(int fd)
+{
+	struct iovec iov[PIPE_UTIL_IOV_COUNT];
+	ssize_t drained = 0;
+	ssize_t r;
+
+	for (int i = 0; i < PIPE_UTIL_IOV_COUNT; ++i) {
+		iov[i].iov_base = pipe_util_buffer;
+		iov[i].iov_len = PIPE_UTIL_CHUNK_SIZE;
+	}
+
+	for (;;) {
+		r = readv(fd, iov, PIPE_UTIL_IOV_COUNT);
+		if (r < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				return (-1);
+			}
+			return (drained);
+		}
+		if (r == 0) {
+			return (-1);
+		}
+		drained += r;
+	}
+}
+
+#endif